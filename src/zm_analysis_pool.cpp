@@ -0,0 +1,289 @@
+//
+// ZoneMinder Analysis Pool Implementation, $Date$, $Revision$
+// Copyright (C) 2001-2008 Philip Coombes
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "zm.h"
+#include "zm_time.h"
+#include "zm_signal.h"
+#include "zm_analysis_pool.h"
+
+#include <signal.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+AnalysisPool::AnalysisPool( const unsigned int *monitor_ids, int n_monitors, int n_workers ) :
+  mNumTasks( n_monitors ),
+  mLastReportTime( time( 0 ) ),
+  mStop( false )
+{
+  mTasks = new Task[mNumTasks];
+  for ( int i = 0; i < mNumTasks; i++ ) {
+    Task &task = mTasks[i];
+    task.monitor_id = monitor_ids[i];
+    task.monitor = NULL;
+    task.busy = 0;
+    task.reload = false;
+    task.skip = false;
+    task.next_load_time = 0;
+    task.capture_seq = 0;
+    task.analysis_rate = 0;
+    task.next_analysis_time.tv_sec = task.next_analysis_time.tv_usec = 0;
+    task.last_update_time = 0;
+    task.cpu_usec = 0;
+    task.frames = 0;
+  }
+
+  // More workers than monitors would have nothing to do
+  mNumWorkers = n_workers < 1 ? 1 : (n_workers > mNumTasks ? mNumTasks : n_workers);
+  mWorkers = new Worker *[mNumWorkers];
+  for ( int i = 0; i < mNumWorkers; i++ )
+    mWorkers[i] = new Worker( *this, i );
+}
+
+AnalysisPool::~AnalysisPool() {
+  stop();
+  for ( int i = 0; i < mNumWorkers; i++ )
+    delete mWorkers[i];
+  delete[] mWorkers;
+  for ( int i = 0; i < mNumTasks; i++ )
+    delete mTasks[i].monitor;
+  delete[] mTasks;
+}
+
+void AnalysisPool::start() {
+  Debug( 1, "Starting %d analysis workers for %d monitors", mNumWorkers, mNumTasks );
+  for ( int i = 0; i < mNumWorkers; i++ )
+    mWorkers[i]->start();
+}
+
+void AnalysisPool::stop() {
+  mStop = true;
+  for ( int i = 0; i < mNumWorkers; i++ ) {
+    if ( mWorkers[i]->isStarted() )
+      mWorkers[i]->join();
+  }
+}
+
+void AnalysisPool::reload() {
+  for ( int i = 0; i < mNumTasks; i++ )
+    mTasks[i].reload = true;
+}
+
+// Called with the task claimed
+void AnalysisPool::loadTask( Task &task, time_t now ) {
+  task.next_load_time = now + ANALYSIS_POOL_RETRY_INTERVAL;
+  ScopedMutex lock( mLoadMutex );
+
+  // Loading for analysis gives up on the whole process if the capture
+  // daemon isn't there, so look first
+  Monitor *query = Monitor::Load( task.monitor_id, false, Monitor::QUERY );
+  if ( !query ) {
+    Error( "Can't find monitor %u to analyse", task.monitor_id );
+    task.skip = true;
+    return;
+  }
+  if ( query->GetFunction() <= Monitor::MONITOR ) {
+    Debug( 1, "Not analysing monitor %u, function is %d", task.monitor_id, query->GetFunction() );
+    task.skip = true;
+    delete query;
+    return;
+  }
+  bool capturing = query->connect() && query->ShmValid();
+  delete query;
+  if ( !capturing ) {
+    Warning( "Capture daemon for monitor %u isn't running, will try again in %d seconds", task.monitor_id, ANALYSIS_POOL_RETRY_INTERVAL );
+    return;
+  }
+
+  // Waits for the first capture, like zma does
+  Monitor *monitor = Monitor::Load( task.monitor_id, true, Monitor::ANALYSIS );
+  if ( !monitor ) {
+    Error( "Can't load monitor %u for analysis", task.monitor_id );
+    return;
+  }
+  Info( "Analysing monitor %s in mode %d/%d", monitor->Name(), monitor->GetFunction(), monitor->Enabled() );
+  monitor->UpdateAdaptiveSkip();
+  task.analysis_rate = monitor->GetAnalysisRate();
+  task.next_analysis_time.tv_sec = task.next_analysis_time.tv_usec = 0;
+  task.last_update_time = time( 0 );
+  task.monitor = monitor;
+}
+
+// Called with the task claimed. Analyses the monitor's next image, or batch
+// of images, returning whether it did any, and brings max_wait down to when
+// the monitor will next be allowed one if its analysis rate is holding it back.
+bool AnalysisPool::runTask( Task &task, const struct timeval &now, int &max_wait ) {
+  if ( task.reload ) {
+    task.reload = false;
+    task.skip = false;
+    task.next_load_time = 0;
+    if ( task.monitor ) {
+      delete task.monitor;
+      task.monitor = NULL;
+    }
+  }
+  if ( !task.monitor ) {
+    if ( task.skip || now.tv_sec < task.next_load_time )
+      return( false );
+    loadTask( task, now.tv_sec );
+    if ( !task.monitor )
+      return( false );
+  }
+  Monitor *monitor = task.monitor;
+
+  // Some periodic updates are required for variable capturing framerate
+  if ( monitor->GetAnalysisUpdateDelay() && (unsigned int)(now.tv_sec - task.last_update_time) > monitor->GetAnalysisUpdateDelay() ) {
+    task.analysis_rate = monitor->GetAnalysisRate();
+    monitor->UpdateAdaptiveSkip();
+    task.last_update_time = now.tv_sec;
+  }
+
+  if ( task.next_analysis_time.tv_sec ) {
+    int due = tvDiffUsec( now, task.next_analysis_time );
+    if ( due > 0 ) {
+      if ( due < max_wait )
+        max_wait = due;
+      return( false );
+    }
+  }
+
+  // Taken before looking for an image so that one captured meanwhile still wakes us
+  task.capture_seq = monitor->CaptureSeq();
+  struct timespec cpu_start, cpu_end;
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &cpu_start );
+  int analysed = monitor->Analyse();
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &cpu_end );
+  uint64_t cpu_usec = ((cpu_end.tv_sec - cpu_start.tv_sec) * 1000000LL) + ((cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000);
+  __sync_fetch_and_add( &task.cpu_usec, cpu_usec );
+
+  if ( analysed ) {
+    __sync_fetch_and_add( &task.frames, analysed );
+    if ( task.analysis_rate ) {
+      gettimeofday( &task.next_analysis_time, NULL );
+      task.next_analysis_time.tv_usec += task.analysis_rate;
+      task.next_analysis_time.tv_sec += task.next_analysis_time.tv_usec/1000000;
+      task.next_analysis_time.tv_usec %= 1000000;
+    }
+  }
+  return( analysed > 0 );
+}
+
+void AnalysisPool::report( time_t now ) {
+  int interval = now - mLastReportTime;
+  if ( interval <= 0 )
+    return;
+  uint64_t total_usec = 0;
+  uint32_t total_frames = 0;
+  for ( int i = 0; i < mNumTasks; i++ ) {
+    Task &task = mTasks[i];
+    // Read and reset together, as a worker may be adding to them
+    uint64_t cpu_usec = __sync_fetch_and_and( &task.cpu_usec, 0 );
+    uint32_t frames = __sync_fetch_and_and( &task.frames, 0 );
+    if ( !cpu_usec && !frames )
+      continue;
+    Debug( 1, "Monitor %u: analysed %u images in %d seconds using %.1f%% cpu, %.1f ms an image",
+        task.monitor_id, frames, interval, (double)cpu_usec/(interval*10000.0), frames ? (double)cpu_usec/(frames*1000.0) : 0.0 );
+    total_usec += cpu_usec;
+    total_frames += frames;
+  }
+  Info( "Analysed %u images of %d monitors in %d seconds using %.1f%% cpu across %d workers",
+      total_frames, mNumTasks, interval, (double)total_usec/(interval*10000.0), mNumWorkers );
+  mLastReportTime = now;
+}
+
+int AnalysisPool::work( int index ) {
+  // Signals are for the main thread, which passes them on
+  sigset_t block_set;
+  sigemptyset( &block_set );
+  sigaddset( &block_set, SIGHUP );
+  sigaddset( &block_set, SIGTERM );
+  sigaddset( &block_set, SIGINT );
+  sigaddset( &block_set, SIGQUIT );
+  sigaddset( &block_set, SIGUSR1 );
+  sigaddset( &block_set, SIGUSR2 );
+  pthread_sigmask( SIG_BLOCK, &block_set, 0 );
+
+  std::vector< std::pair<uint64_t,int> > candidates;
+  struct timeval now;
+  while ( !mStop && !zm_terminate ) {
+    gettimeofday( &now, NULL );
+    if ( index == 0 && now.tv_sec - mLastReportTime >= ANALYSIS_POOL_REPORT_INTERVAL )
+      report( now.tv_sec );
+
+    // Longest we may sleep without holding up a monitor limited by its analysis rate
+    int max_wait = mNumTasks > 1 ? ZM_SAMPLE_RATE : ZM_SUSPENDED_RATE;
+    bool analysed = false;
+
+    // One image from each of our own monitors in turn
+    for ( int i = index; i < mNumTasks; i += mNumWorkers ) {
+      Task &task = mTasks[i];
+      if ( !__sync_bool_compare_and_swap( &task.busy, 0, 1 ) )
+        continue;
+      if ( runTask( task, now, max_wait ) )
+        analysed = true;
+      __sync_lock_release( &task.busy );
+    }
+    if ( analysed )
+      continue;
+
+    // Nothing of our own to do, so help with whichever waiting monitor
+    // has had least cpu lately
+    candidates.clear();
+    for ( int i = 0; i < mNumTasks; i++ ) {
+      if ( i % mNumWorkers == index || mTasks[i].busy || !mTasks[i].monitor )
+        continue;
+      candidates.push_back( std::make_pair( mTasks[i].cpu_usec, i ) );
+    }
+    std::sort( candidates.begin(), candidates.end() );
+    for ( unsigned int j = 0; j < candidates.size() && !analysed; j++ ) {
+      Task &task = mTasks[candidates[j].second];
+      if ( !__sync_bool_compare_and_swap( &task.busy, 0, 1 ) )
+        continue;
+      if ( task.monitor && task.monitor->HasPendingImages() )
+        analysed = runTask( task, now, max_wait );
+      __sync_lock_release( &task.busy );
+    }
+    if ( analysed )
+      continue;
+
+    // Sleep until one of our monitors captures something. We can only
+    // sleep on one, and keep it claimed meanwhile so it can't be unloaded.
+    bool waited = false;
+    for ( int i = index; i < mNumTasks && !waited; i += mNumWorkers ) {
+      Task &task = mTasks[i];
+      if ( !__sync_bool_compare_and_swap( &task.busy, 0, 1 ) )
+        continue;
+      if ( task.monitor && task.monitor->Active() ) {
+        if ( task.next_analysis_time.tv_sec && tvDiffUsec( now, task.next_analysis_time ) > 0 ) {
+          // Held back by its analysis rate rather than waiting for an image
+          usleep( max_wait );
+        } else {
+          task.monitor->WaitForCapture( task.capture_seq, max_wait );
+        }
+        waited = true;
+      }
+      __sync_lock_release( &task.busy );
+    }
+    if ( !waited )
+      usleep( max_wait );
+  }
+  Image::DeinitialiseThread();
+  return( 0 );
+}
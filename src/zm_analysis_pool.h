@@ -0,0 +1,101 @@
+//
+// ZoneMinder Analysis Pool Interface, $Date$, $Revision$
+// Copyright (C) 2001-2008 Philip Coombes
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#ifndef ZM_ANALYSIS_POOL_H
+#define ZM_ANALYSIS_POOL_H
+
+#include "zm_thread.h"
+#include "zm_monitor.h"
+
+#include <sys/time.h>
+
+// How often the cpu used analysing each monitor is reported, in seconds
+#define ANALYSIS_POOL_REPORT_INTERVAL 60
+// How long to leave a monitor whose capture daemon isn't running before trying it again
+#define ANALYSIS_POOL_RETRY_INTERVAL 10
+
+//
+// Analyses a number of monitors from a pool of worker threads, doing the
+// work of one analysis daemon per monitor. Each monitor is loaded for
+// analysis exactly as zma would load it, so it reads the shared image ring
+// like any other reader and live streams and the watchdog see no difference.
+//
+// Each worker has its own share of the monitors, which it goes round
+// analysing one image from each in turn, sleeping on the shared memory of
+// one of them when none has anything new. A worker with nothing to do takes
+// an image from another worker's monitor, picking the waiting monitor which
+// has used least cpu lately, so a busy monitor can't hold up quiet ones and
+// no worker sits idle while images wait. A monitor is only ever analysed by
+// one worker at a time.
+//
+class AnalysisPool {
+private:
+  struct Task {
+    unsigned int    monitor_id;
+    Monitor         *monitor;           // Null until loaded, or if not being analysed
+    int             busy;               // Claimed by a worker, only changed atomically
+    bool            reload;
+    bool            skip;               // Not to be analysed until reloaded
+    time_t          next_load_time;     // When to next try to load the monitor
+    uint32_t        capture_seq;        // Capture sequence when last analysed
+    useconds_t      analysis_rate;
+    struct timeval  next_analysis_time; // Zero unless limited by analysis_rate
+    time_t          last_update_time;
+    uint64_t        cpu_usec;           // Cpu used since the last report, only changed atomically
+    uint32_t        frames;             // Images analysed since the last report, likewise
+  };
+
+  class Worker : public Thread {
+  private:
+    AnalysisPool  &mPool;
+    int           mIndex;
+
+  public:
+    Worker( AnalysisPool &pool, int index ) : mPool( pool ), mIndex( index ) {
+    }
+    int run() {
+      return( mPool.work( mIndex ) );
+    }
+  };
+
+  int           mNumTasks;
+  Task          *mTasks;
+  int           mNumWorkers;
+  Worker        **mWorkers;
+  time_t        mLastReportTime;
+  bool          mStop;
+  Mutex         mLoadMutex;         // Monitors are loaded one at a time, as cameras and images set up shared state
+
+  void loadTask( Task &task, time_t now );
+  bool runTask( Task &task, const struct timeval &now, int &max_wait );
+  void report( time_t now );
+  int work( int index );
+
+public:
+  AnalysisPool( const unsigned int *monitor_ids, int n_monitors, int n_workers );
+  ~AnalysisPool();
+
+  void start();
+  // Stops the workers and waits for them to finish
+  void stop();
+  // Asks for the monitors to be loaded again, as zma would on SIGHUP
+  void reload();
+};
+
+#endif // ZM_ANALYSIS_POOL_H
@@ -19,6 +19,8 @@
 
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "zm.h"
 #include "zm_buffer.h"
@@ -79,3 +81,89 @@ int Buffer::read_into( int sd, unsigned int bytes ) {
   }
   return bytes_read;
 }
+
+RingBuffer::RingBuffer( unsigned int pSize ) : mHead( 0 ), mTail( 0 )
+{
+  mAllocation = 1;
+  while ( mAllocation < pSize )
+    mAllocation <<= 1;
+  mMask = mAllocation - 1;
+  mStorage = new unsigned char[mAllocation];
+}
+
+int RingBuffer::writeV( struct iovec iov[2] ) const
+{
+  unsigned int count = space();
+  if ( !count )
+    return( 0 );
+  unsigned int offset = mTail & mMask;
+  unsigned int first = std::min( count, mAllocation - offset );
+  iov[0].iov_base = mStorage + offset;
+  iov[0].iov_len = first;
+  if ( first == count )
+    return( 1 );
+  iov[1].iov_base = mStorage;
+  iov[1].iov_len = count - first;
+  return( 2 );
+}
+
+unsigned int RingBuffer::consume( unsigned int count )
+{
+  if ( count > size() )
+  {
+    Warning( "Attempt to consume %d bytes of ring buffer, size is only %d bytes", count, size() );
+    count = size();
+  }
+  mHead += count;
+  return( count );
+}
+
+unsigned int RingBuffer::peek( unsigned char *pStorage, unsigned int pSize ) const
+{
+  pSize = std::min( pSize, size() );
+  unsigned int offset = mHead & mMask;
+  unsigned int first = std::min( pSize, mAllocation - offset );
+  memcpy( pStorage, mStorage + offset, first );
+  memcpy( pStorage + first, mStorage, pSize - first );
+  return( pSize );
+}
+
+unsigned char *RingBuffer::linearize()
+{
+  unsigned int count = size();
+  unsigned int offset = mHead & mMask;
+  if ( offset + count > mAllocation )
+  {
+    // Rotate the storage so the data starts at the beginning
+    std::rotate( mStorage, mStorage + offset, mStorage + mAllocation );
+    mHead = 0;
+    mTail = count;
+    offset = 0;
+  }
+  return( mStorage + offset );
+}
+
+int RingBuffer::read_into( int sd, unsigned int bytes )
+{
+  struct iovec iov[2];
+  int n_iov = writeV( iov );
+  if ( !n_iov )
+  {
+    Warning( "No space in ring buffer to read into" );
+    return( 0 );
+  }
+  // Only offer the driver as much space as was asked for
+  if ( iov[0].iov_len >= bytes )
+  {
+    iov[0].iov_len = bytes;
+    n_iov = 1;
+  }
+  else if ( n_iov > 1 && (iov[0].iov_len + iov[1].iov_len) > bytes )
+  {
+    iov[1].iov_len = bytes - iov[0].iov_len;
+  }
+  int bytes_read = readv( sd, iov, n_iov );
+  if ( bytes_read > 0 )
+    mTail += bytes_read;
+  return( bytes_read );
+}
@@ -23,6 +23,8 @@
 #include "zm.h"
 
 #include <string.h>
+#include <sys/uio.h>
+#include <algorithm>
 
 class Buffer
 {
@@ -50,6 +52,11 @@ public:
     memcpy( mStorage, buffer.mHead, mSize );
     mTail = mHead + mSize;
   }
+  // Takes over the storage of the other buffer, leaving it empty
+  Buffer( Buffer &&buffer ) : mStorage( buffer.mStorage ), mAllocation( buffer.mAllocation ), mSize( buffer.mSize ), mHead( buffer.mHead ), mTail( buffer.mTail ) {
+    buffer.mStorage = buffer.mHead = buffer.mTail = 0;
+    buffer.mAllocation = buffer.mSize = 0;
+  }
   ~Buffer() {
     delete[] mStorage;
   }
@@ -145,6 +152,19 @@ public:
     assign( buffer );
     return( *this );
   }
+  Buffer &operator=( Buffer &&buffer ) {
+    swap( buffer );
+    buffer.clear();
+    return( *this );
+  }
+  // Exchange contents with another buffer without copying any data
+  void swap( Buffer &buffer ) {
+    std::swap( mStorage, buffer.mStorage );
+    std::swap( mAllocation, buffer.mAllocation );
+    std::swap( mSize, buffer.mSize );
+    std::swap( mHead, buffer.mHead );
+    std::swap( mTail, buffer.mTail );
+  }
   Buffer &operator+=( const Buffer &buffer ) {
     append( buffer );
     return( *this );
@@ -175,4 +195,55 @@ public:
   int read_into( int sd, unsigned int bytes );
 };
 
+//
+// Fixed size circular byte buffer. The capacity is a power of two so that
+// positions can be wrapped with a mask, and data is never moved to make
+// room. The socket is read straight into the free space with readv.
+//
+class RingBuffer
+{
+protected:
+  unsigned char *mStorage;
+  unsigned int mAllocation;
+  unsigned int mMask;
+  unsigned int mHead;   // Free running read position
+  unsigned int mTail;   // Free running write position
+
+protected:
+  // Spans of free space, returns how many of the two are used
+  int writeV( struct iovec iov[2] ) const;
+
+public:
+  explicit RingBuffer( unsigned int pSize );
+  ~RingBuffer() {
+    delete[] mStorage;
+  }
+
+  unsigned int size() const { return( mTail - mHead ); }
+  unsigned int space() const { return( mAllocation - size() ); }
+  bool empty() const { return( mHead == mTail ); }
+  void clear() { mHead = mTail = 0; }
+
+  // Drop count bytes from the front
+  unsigned int consume( unsigned int count );
+  // The first count bytes in place, or null if they wrap round the end
+  unsigned char *contiguous( unsigned int count ) {
+    unsigned int offset = mHead & mMask;
+    return( offset + count <= mAllocation ? mStorage + offset : 0 );
+  }
+  // Copy up to pSize bytes from the front without consuming them
+  unsigned int peek( unsigned char *pStorage, unsigned int pSize ) const;
+  unsigned char operator[]( unsigned int index ) const {
+    return( mStorage[(mHead+index)&mMask] );
+  }
+  // Make the buffered data contiguous, only moving anything if it wraps
+  unsigned char *linearize();
+
+  int read_into( int sd, unsigned int bytes );
+
+private:
+  RingBuffer( const RingBuffer & );
+  RingBuffer &operator=( const RingBuffer & );
+};
+
 #endif // ZM_BUFFER_H
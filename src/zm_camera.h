@@ -80,6 +80,31 @@ public:
   virtual int Colour( int/*p_colour*/=-1 ) { return( -1 ); }
   virtual int Contrast( int/*p_contrast*/=-1 ) { return( -1 ); }
 
+  // Cheap estimate (0-100) of how much changed in the last captured frame, -1 if unknown
+  virtual int Activity() const { return( -1 ); }
+
+  // Offers the monitor's shared image ring to the camera so it can capture
+  // straight into it. Returns false if the camera will keep copying.
+  virtual bool UseSharedBuffers( uint8_t * /*p_buffers*/, unsigned int /*p_count*/ ) { return( false ); }
+  // Number of ring slots after the current one that the camera may already be filling
+  virtual unsigned int SharedBuffersAhead() const { return( 0 ); }
+
+  // Asks the camera to capture planar YUV 4:2:0 images instead of ones in
+  // the monitor's colours. Must be called before any capture. Returns false
+  // if the camera can't, in which case nothing changes.
+  virtual bool CapturePlanarYUV() { return( false ); }
+
+  // Whether the camera may get its frames as JPEGs
+  virtual bool CapturesJpeg() const { return( false ); }
+  // The JPEG the last captured frame was decoded from, if the camera got
+  // one, so it can be kept instead of encoding the image again. Only valid
+  // until the next capture.
+  virtual const uint8_t *CapturedJpeg( unsigned int &p_size ) const { p_size = 0; return( NULL ); }
+
+  // When the data for the last captured frame arrived from the camera, so
+  // that the time taken to decode and publish it can be measured
+  virtual bool CaptureArrival( struct timeval & /*p_arrival*/ ) const { return( false ); }
+
   bool CanCapture() const { return( capture ); }
 
   bool SupportsNativeVideo() const { return( (type == FFMPEG_SRC )||(type == REMOTE_SRC)); }
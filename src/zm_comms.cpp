@@ -676,6 +676,69 @@ bool InetSocket::bind( int port )
     return bind( NULL, serv );
 }
 
+DatagramBatch::DatagramBatch( int maxPackets, int packetSize ) :
+  mMaxPackets( maxPackets ),
+  mPacketSize( packetSize ),
+  mCount( 0 )
+{
+  mSlab = new unsigned char[mMaxPackets*mPacketSize];
+  mLengths = new int[mMaxPackets];
+  mIovs = new struct iovec[mMaxPackets];
+#if HAVE_RECVMMSG
+  mHeaders = new struct mmsghdr[mMaxPackets];
+  memset( mHeaders, 0, mMaxPackets*sizeof(*mHeaders) );
+#else
+  mHeaders = NULL;
+#endif
+  for ( int i = 0; i < mMaxPackets; i++ ) {
+    mIovs[i].iov_base = packet( i );
+    mIovs[i].iov_len = mPacketSize;
+#if HAVE_RECVMMSG
+    mHeaders[i].msg_hdr.msg_iov = &mIovs[i];
+    mHeaders[i].msg_hdr.msg_iovlen = 1;
+#endif
+    mLengths[i] = 0;
+  }
+}
+
+DatagramBatch::~DatagramBatch()
+{
+#if HAVE_RECVMMSG
+  delete[] mHeaders;
+#endif
+  delete[] mIovs;
+  delete[] mLengths;
+  delete[] mSlab;
+}
+
+int UdpSocket::recvBatch( DatagramBatch &batch ) const
+{
+  batch.mCount = 0;
+#if HAVE_RECVMMSG
+  // Wait for the first packet, then take whatever else is already queued
+  int nPackets = ::recvmmsg( mSd, batch.mHeaders, batch.mMaxPackets, MSG_WAITFORONE, NULL );
+  if ( nPackets < 0 ) {
+    Debug( 1, "Recvmmsg of %d packets max on sd %d failed: %s", batch.mMaxPackets, mSd, strerror(errno) );
+    return( nPackets );
+  }
+  for ( int i = 0; i < nPackets; i++ ) {
+    batch.mLengths[i] = batch.mHeaders[i].msg_len;
+    if ( batch.mHeaders[i].msg_hdr.msg_flags & MSG_TRUNC )
+      Warning( "Datagram on sd %d truncated to %d bytes", mSd, batch.mPacketSize );
+  }
+#else
+  int nPackets = 0;
+  ssize_t nBytes = ::recv( mSd, batch.packet( 0 ), batch.mPacketSize, 0 );
+  if ( nBytes < 0 ) {
+    Debug( 1, "Recv of %d bytes max on sd %d failed: %s", batch.mPacketSize, mSd, strerror(errno) );
+    return( -1 );
+  }
+  batch.mLengths[nPackets++] = nBytes;
+#endif
+  batch.mCount = nPackets;
+  return( nPackets );
+}
+
 bool TcpInetServer::listen()
 {
   return( Socket::listen() );
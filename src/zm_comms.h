@@ -405,6 +405,41 @@ protected:
   }
 };
 
+struct mmsghdr;
+
+// Preallocated storage for a batch of datagrams, so that all the packets
+// waiting on a socket can be read with a single system call.
+class DatagramBatch {
+friend class UdpSocket;
+
+private:
+  int mMaxPackets;
+  int mPacketSize;
+  unsigned char *mSlab;
+  int *mLengths;
+  struct iovec *mIovs;
+  struct mmsghdr *mHeaders;
+  int mCount;           // Packets received by the last call
+
+public:
+  DatagramBatch( int maxPackets, int packetSize );
+  ~DatagramBatch();
+
+  int count() const {
+    return( mCount );
+  }
+  unsigned char *packet( int index ) const {
+    return( mSlab + (index * mPacketSize) );
+  }
+  int length( int index ) const {
+    return( mLengths[index] );
+  }
+
+private:
+  DatagramBatch( const DatagramBatch & );
+  DatagramBatch &operator=( const DatagramBatch & );
+};
+
 class UdpSocket : virtual public Socket {
 public:
   int getType() const {
@@ -437,6 +472,9 @@ public:
     }
     return( nBytes );
   }
+  // Read as many waiting datagrams as will fit in the batch, blocking only
+  // if there are none. Returns the number read, or -1 on error.
+  virtual int recvBatch( DatagramBatch &batch ) const;
 };
 
 class UdpInetSocket : virtual public UdpSocket, virtual public InetSocket {
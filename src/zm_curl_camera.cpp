@@ -20,6 +20,7 @@
 #include "zm.h"
 
 #include "zm_curl_camera.h"
+#include "zm_curl_engine.h"
 
 #include "zm_packetqueue.h"
 
@@ -35,7 +36,9 @@ size_t content_type_match_len;
 
 cURLCamera::cURLCamera( int p_id, const std::string &p_path, const std::string &p_user, const std::string &p_pass, unsigned int p_width, unsigned int p_height, int p_colours, int p_brightness, int p_contrast, int p_hue, int p_colour, bool p_capture, bool p_record_audio ) :
   Camera( p_id, CURL_SRC, p_width, p_height, p_colours, ZM_SUBPIX_ORDER_DEFAULT_FOR_COLOUR(p_colours), p_brightness, p_contrast, p_hue, p_colour, p_capture, p_record_audio ),
-  mPath( p_path ), mUser( p_user ), mPass ( p_pass ), bTerminate( false ), bReset( false ), mode ( MODE_UNSET )
+  mPath( p_path ), mUser( p_user ), mPass ( p_pass ), c( NULL ), mode ( MODE_UNSET ),
+  SubHeadersParsingComplete( false ), frame_content_length( 0 ), attempts( 0 ),
+  bFrameReady( false ), bFailed( false ), bUnsupported( false )
 {
 
   if ( capture ) {
@@ -56,14 +59,6 @@ void cURLCamera::Initialise() {
 
   databuffer.expand(CURL_BUFFER_INITIAL_SIZE);
 
-  /* cURL initialization */
-  CURLcode cRet = curl_global_init(CURL_GLOBAL_ALL);
-  if(cRet != CURLE_OK) {
-    Fatal("libcurl initialization failed: ", curl_easy_strerror(cRet));
-  }
-
-  Debug(2,"libcurl version: %s",curl_version());
-
   /* Create the shared data mutex */
   int nRet = pthread_mutex_init(&shareddata_mutex, NULL);
   if(nRet != 0) {
@@ -74,36 +69,25 @@ void cURLCamera::Initialise() {
   if(nRet != 0) {
     Fatal("Data available condition variable creation failed: %s",strerror(nRet));
   }
-  /* Create the request complete condition variable */
-  nRet = pthread_cond_init(&request_complete_cond, NULL);
-  if(nRet != 0) {
-    Fatal("Request complete condition variable creation failed: %s",strerror(nRet));
-  }
 
-  /* Create the thread */
-  nRet = pthread_create(&thread, NULL, thread_func_dispatcher, this);
-  if(nRet != 0) {
-    Fatal("Thread creation failed: %s",strerror(nRet));
-  }
+  /* Hand the transfer to the engine, which starts it */
+  SetupHandle();
+  cURLEngine::Attach(this);
 }
 
 void cURLCamera::Terminate() {
-  /* Signal the thread to terminate */
-  bTerminate = true;
+  /* Once detached the engine won't call us again */
+  cURLEngine::Detach(this);
 
-  /* Wait for thread termination */
-  pthread_join(thread, NULL);
+  /* cURL cleanup */
+  curl_easy_cleanup(c);
+  c = NULL;
 
-  /* Destroy condition variables */
-  pthread_cond_destroy(&request_complete_cond);
+  /* Destroy condition variable */
   pthread_cond_destroy(&data_available_cond);
 
   /* Destroy mutex */
   pthread_mutex_destroy(&shareddata_mutex);
-
-  /* cURL cleanup */
-  curl_global_cleanup();
-
 }
 
 int cURLCamera::PrimeCapture() {
@@ -117,188 +101,60 @@ int cURLCamera::PreCapture() {
 }
 
 int cURLCamera::Capture( Image &image ) {
-  bool frameComplete = false;
-
-  /* MODE_STREAM specific variables */
-  bool SubHeadersParsingComplete = false;
-  unsigned int frame_content_length = 0;
-  std::string frame_content_type;
-  bool need_more_data = false;
   int nRet;
 
+  /* A stalled camera mustn't hold up other monitors captured by this process */
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  struct timespec deadline;
+  deadline.tv_sec = now.tv_sec + config.http_timeout/1000;
+  deadline.tv_nsec = now.tv_usec*1000 + (config.http_timeout%1000)*1000000;
+  if ( deadline.tv_nsec >= 1000000000 ) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
   /* Grab the mutex to ensure exclusive access to the shared data */
   lock();
 
-  while ( !frameComplete ) {
-
-    /* If the work thread did a reset, reset our local variables */
-    if ( bReset ) {
-      SubHeadersParsingComplete = false;
-      frame_content_length = 0;
-      frame_content_type.clear();
-      need_more_data = false;
-      bReset = false;
+  while ( !bFrameReady && !bFailed ) {
+    /* Don't have a frame yet. Sleep while waiting for one */
+    nRet = pthread_cond_timedwait(&data_available_cond,&shareddata_mutex,&deadline);
+    if ( nRet == ETIMEDOUT ) {
+      Error("Timed out waiting for a frame from %s", mPath.c_str());
+      unlock();
+      return -1;
     }
-
-    if ( mode == MODE_UNSET ) {
-      /* Don't have a mode yet. Sleep while waiting for data */
-      nRet = pthread_cond_wait(&data_available_cond,&shareddata_mutex);
-      if ( nRet != 0 ) {
-        Error("Failed waiting for available data condition variable: %s",strerror(nRet));
-        return -20;
-      }
+    if ( nRet != 0 ) {
+      Error("Failed waiting for available data condition variable: %s",strerror(nRet));
+      unlock();
+      return -20;
     }
+  }
 
-    if ( mode == MODE_STREAM ) {
-
-      /* Subheader parsing */
-      while( !SubHeadersParsingComplete && !need_more_data ) {
-
-        size_t crlf_start, crlf_end, crlf_size;
-        std::string subheader;
-
-        /* Check if the buffer contains something */
-        if ( databuffer.empty() ) {
-          /* Empty buffer, wait for data */
-          need_more_data = true;
-          break;
-        }
-     
-        /* Find crlf start */
-        crlf_start = memcspn(databuffer,"\r\n",databuffer.size());
-        if ( crlf_start == databuffer.size() ) {
-          /* Not found, wait for more data */
-          need_more_data = true;
-          break;
-        }
-
-        /* See if we have enough data for determining crlf length */
-        if ( databuffer.size() < crlf_start+5 ) {
-          /* Need more data */
-          need_more_data = true;
-          break;
-        }
-
-        /* Find crlf end and calculate crlf size */
-        crlf_end = memspn(((const char*)databuffer.head())+crlf_start,"\r\n",5);
-        crlf_size = (crlf_start + crlf_end) - crlf_start;
-
-        /* Is this the end of a previous stream? (This is just before the boundary) */
-        if ( crlf_start == 0 ) {
-          databuffer.consume(crlf_size);
-          continue;        
-        }
-
-        /* Check for invalid CRLF size */
-        if ( crlf_size > 4 ) {
-          Error("Invalid CRLF length");
-        }
-
-        /* Check if the crlf is \n\n or \r\n\r\n (marks end of headers, this is the last header) */
-        if( (crlf_size == 2 && memcmp(((const char*)databuffer.head())+crlf_start,"\n\n",2) == 0) || (crlf_size == 4 && memcmp(((const char*)databuffer.head())+crlf_start,"\r\n\r\n",4) == 0) ) {
-          /* This is the last header */
-          SubHeadersParsingComplete = true;
-        }
-
-        /* Copy the subheader, excluding the crlf */
-        subheader.assign(databuffer, crlf_start);
-
-        /* Advance the buffer past this one */
-        databuffer.consume(crlf_start+crlf_size);
-
-        Debug(7,"Got subheader: %s",subheader.c_str());
-
-        /* Find where the data in this header starts */
-        size_t subheader_data_start = subheader.rfind(' ');
-        if ( subheader_data_start == std::string::npos ) {
-          subheader_data_start = subheader.find(':');
-        }
-
-        /* Extract the data into a string */
-        std::string subheader_data = subheader.substr(subheader_data_start+1, std::string::npos);
-
-        Debug(8,"Got subheader data: %s",subheader_data.c_str());
-
-        /* Check the header */
-        if(strncasecmp(subheader.c_str(),content_length_match,content_length_match_len) == 0) {  
-          /* Found the content-length header */
-          frame_content_length = atoi(subheader_data.c_str());
-          Debug(6,"Got content-length subheader: %d",frame_content_length);
-        } else if(strncasecmp(subheader.c_str(),content_type_match,content_type_match_len) == 0) { 
-          /* Found the content-type header */
-          frame_content_type = subheader_data;
-          Debug(6,"Got content-type subheader: %s",frame_content_type.c_str());
-        }
-
-      }
-
-      /* Attempt to extract the frame */
-      if(!need_more_data) {
-        if(!SubHeadersParsingComplete) {
-          /* We haven't parsed all headers yet */
-          need_more_data = true;
-        } else if ( ! frame_content_length ) {
-          /* Invalid frame */
-          Error("Invalid frame: invalid content length");
-        } else if ( frame_content_type != "image/jpeg" ) {
-          /* Unsupported frame type */
-          Error("Unsupported frame: %s",frame_content_type.c_str());
-        } else if(frame_content_length > databuffer.size()) {
-          /* Incomplete frame, wait for more data */
-          need_more_data = true;
-        } else {
-          /* All good. decode the image */
-          image.DecodeJpeg(databuffer.extract(frame_content_length), frame_content_length, colours, subpixelorder);
-          frameComplete = true;
-        }
-      }
-
-      /* Attempt to get more data */
-      if(need_more_data) {
-        nRet = pthread_cond_wait(&data_available_cond,&shareddata_mutex);
-        if(nRet != 0) {
-          Error("Failed waiting for available data condition variable: %s",strerror(nRet));
-          return -18;
-        }
-        need_more_data = false;
-      }
-
-    } else if(mode == MODE_SINGLE) { 
-      /* Check if we have anything */
-      if (!single_offsets.empty()) {
-        if( (single_offsets.front() > 0) && (databuffer.size() >= single_offsets.front()) ) {
-          /* Extract frame */
-          image.DecodeJpeg(databuffer.extract(single_offsets.front()), single_offsets.front(), colours, subpixelorder);
-          single_offsets.pop_front();
-          frameComplete = true;
-        } else {
-          /* This shouldn't happen */
-          Error("Internal error. Attempting recovery");
-          databuffer.consume(single_offsets.front());
-          single_offsets.pop_front();
-        }
-      } else {
-        /* Don't have a frame yet, wait for the request complete condition variable */
-        nRet = pthread_cond_wait(&request_complete_cond,&shareddata_mutex);
-        if(nRet != 0) {
-          Error("Failed waiting for request complete condition variable: %s",strerror(nRet));
-          return -19;
-        }
-      }
-    } else {
+  if ( !bFrameReady ) {
+    unlock();
+    if ( bUnsupported ) {
       /* Failed to match content-type */
       Fatal("Unable to match Content-Type. Check URL, username and password");
-    } /* mode */
+    }
+    Error("Unable to get frames from %s", mPath.c_str());
+    return -1;
+  }
 
-  } /* frameComplete loop */
+  /* Take the frame, leaving our old buffer for the engine to fill next */
+  capture_frame.swap(ready_frame);
+  bFrameReady = false;
 
   /* Release the mutex */
   unlock();
 
-  if(!frameComplete)
+  if ( !image.DecodeJpeg(capture_frame, capture_frame.size(), colours, subpixelorder) ) {
+    Error("Unable to decode jpeg from %s", mPath.c_str());
     return -1;
+  }
 
-  return 0;
+  return 1;
 }
 
 int cURLCamera::PostCapture() {
@@ -312,21 +168,155 @@ int cURLCamera::CaptureAndRecord( Image &image, struct timeval recording, char*
   return( 0 );
 }
 
-size_t cURLCamera::data_callback(void *buffer, size_t size, size_t nmemb, void *userdata) {
+void cURLCamera::PublishFrame( const unsigned char *frame, size_t size ) {
   lock();
 
-  /* Append the data we just received to our buffer */
-  databuffer.append((const char*)buffer, size*nmemb);
+  if ( bFrameReady ) {
+    Debug(4,"Replacing frame from %s which wasn't captured in time", mPath.c_str());
+  }
+  ready_frame.assign(frame, size);
+  bFrameReady = true;
+  attempts = 0;
 
   /* Signal data available */
   int nRet = pthread_cond_signal(&data_available_cond);
   if ( nRet != 0 ) {
     Error("Failed signaling data available condition variable: %s",strerror(nRet));
-    unlock();
-    return -16;
   }
 
   unlock();
+}
+
+void cURLCamera::Fail() {
+  lock();
+  bFailed = true;
+  pthread_cond_signal(&data_available_cond);
+  unlock();
+}
+
+void cURLCamera::ParseStream() {
+  while ( true ) {
+
+    /* Subheader parsing */
+    while( !SubHeadersParsingComplete ) {
+
+      size_t crlf_start, crlf_end, crlf_size;
+      std::string subheader;
+
+      /* Check if the buffer contains something */
+      if ( databuffer.empty() ) {
+        /* Empty buffer, wait for data */
+        return;
+      }
+
+      /* Find crlf start */
+      crlf_start = memcspn(databuffer,"\r\n",databuffer.size());
+      if ( crlf_start == databuffer.size() ) {
+        /* Not found, wait for more data */
+        return;
+      }
+
+      /* See if we have enough data for determining crlf length */
+      if ( databuffer.size() < crlf_start+5 ) {
+        /* Need more data */
+        return;
+      }
+
+      /* Find crlf end and calculate crlf size */
+      crlf_end = memspn(((const char*)databuffer.head())+crlf_start,"\r\n",5);
+      crlf_size = (crlf_start + crlf_end) - crlf_start;
+
+      /* Is this the end of a previous stream? (This is just before the boundary) */
+      if ( crlf_start == 0 ) {
+        databuffer.consume(crlf_size);
+        continue;        
+      }
+
+      /* Check for invalid CRLF size */
+      if ( crlf_size > 4 ) {
+        Error("Invalid CRLF length");
+      }
+
+      /* Check if the crlf is \n\n or \r\n\r\n (marks end of headers, this is the last header) */
+      if( (crlf_size == 2 && memcmp(((const char*)databuffer.head())+crlf_start,"\n\n",2) == 0) || (crlf_size == 4 && memcmp(((const char*)databuffer.head())+crlf_start,"\r\n\r\n",4) == 0) ) {
+        /* This is the last header */
+        SubHeadersParsingComplete = true;
+      }
+
+      /* Copy the subheader, excluding the crlf */
+      subheader.assign(databuffer, crlf_start);
+
+      /* Advance the buffer past this one */
+      databuffer.consume(crlf_start+crlf_size);
+
+      Debug(7,"Got subheader: %s",subheader.c_str());
+
+      /* Find where the data in this header starts */
+      size_t subheader_data_start = subheader.rfind(' ');
+      if ( subheader_data_start == std::string::npos ) {
+        subheader_data_start = subheader.find(':');
+      }
+
+      /* Extract the data into a string */
+      std::string subheader_data = subheader.substr(subheader_data_start+1, std::string::npos);
+
+      Debug(8,"Got subheader data: %s",subheader_data.c_str());
+
+      /* Check the header */
+      if(strncasecmp(subheader.c_str(),content_length_match,content_length_match_len) == 0) {  
+        /* Found the content-length header */
+        frame_content_length = atoi(subheader_data.c_str());
+        Debug(6,"Got content-length subheader: %d",frame_content_length);
+      } else if(strncasecmp(subheader.c_str(),content_type_match,content_type_match_len) == 0) { 
+        /* Found the content-type header */
+        frame_content_type = subheader_data;
+        Debug(6,"Got content-type subheader: %s",frame_content_type.c_str());
+      }
+
+    }
+
+    /* Attempt to extract the frame */
+    if ( ! frame_content_length ) {
+      /* Invalid frame, we can't tell where it ends so start again with what comes next */
+      Error("Invalid frame: invalid content length");
+      databuffer.clear();
+    } else if(frame_content_length > databuffer.size()) {
+      /* Incomplete frame, wait for more data */
+      return;
+    } else if ( frame_content_type != "image/jpeg" ) {
+      /* Unsupported frame type */
+      Error("Unsupported frame: %s",frame_content_type.c_str());
+      databuffer.consume(frame_content_length);
+    } else {
+      /* All good. pass it on for decoding */
+      PublishFrame(databuffer, frame_content_length);
+      databuffer.consume(frame_content_length);
+    }
+
+    SubHeadersParsingComplete = false;
+    frame_content_length = 0;
+    frame_content_type.clear();
+  }
+}
+
+size_t cURLCamera::data_callback(void *buffer, size_t size, size_t nmemb, void *userdata) {
+  if ( mode == MODE_UNSET ) {
+    long response_code = 0;
+    curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &response_code);
+    if ( response_code < 200 || response_code > 299 ) {
+      /* Body of an authentication challenge or redirect, curl will follow it up */
+      return size*nmemb;
+    }
+    /* Failed to match content-type, abort the transfer and let Capture report it */
+    bUnsupported = true;
+    return 0;
+  }
+
+  /* Append the data we just received to our buffer */
+  databuffer.append((const char*)buffer, size*nmemb);
+
+  if ( mode == MODE_STREAM )
+    ParseStream();
 
   /* Return bytes processed */
   return size*nmemb;
@@ -353,8 +343,6 @@ size_t cURLCamera::header_callback( void *buffer, size_t size, size_t nmemb, voi
     std::string content_type = header.substr(pos+1, std::string::npos);
     Debug(6,"Content-Type is: %s",content_type.c_str());
 
-    lock();
-
     const char* multipart_match = "multipart/x-mixed-replace";
     const char* image_jpeg_match = "image/jpeg";
     if(strncasecmp(content_type.c_str(),multipart_match,strlen(multipart_match)) == 0) {  
@@ -364,18 +352,50 @@ size_t cURLCamera::header_callback( void *buffer, size_t size, size_t nmemb, voi
       Debug(7,"Content type matched as image/jpeg");
       mode = MODE_SINGLE;
     }
-
-    unlock();
   }
   
   /* Return bytes processed */
   return size*nmemb;
 }
 
-void* cURLCamera::thread_func() {
-  long tRet;
-  double dSize;
+bool cURLCamera::TransferDone( CURLcode cRet ) {
+  if ( bUnsupported ) {
+    Fail();
+    return false;
+  }
 
+  if ( cRet == CURLE_OK && mode == MODE_SINGLE ) {
+    /* The whole response is the image */
+    if ( databuffer.size() ) {
+      PublishFrame(databuffer, databuffer.size());
+    } else {
+      Error("Got an empty image from %s", mPath.c_str());
+    }
+    databuffer.clear();
+    /* Go again for the next one */
+    return true;
+  }
+
+  if ( cRet == CURLE_OK ) {
+    Error("cURL stream from %s ended", mPath.c_str());
+  } else {
+    Error("cURL Request failed: %s",curl_easy_strerror(cRet));
+  }
+  if ( ++attempts < CURL_MAXRETRY ) {
+    Error("Retrying.. Attempt %d of %d",attempts,CURL_MAXRETRY);
+    /* Do a reset */
+    databuffer.clear();
+    mode = MODE_UNSET;
+    SubHeadersParsingComplete = false;
+    frame_content_length = 0;
+    frame_content_type.clear();
+    return true;
+  }
+  Fail();
+  return false;
+}
+
+void cURLCamera::SetupHandle() {
   c = curl_easy_init();
   if(c == NULL) {
     Fatal("Failed getting easy handle from libcurl");
@@ -403,16 +423,10 @@ void* cURLCamera::thread_func() {
   if(cRet != CURLE_OK)
     Fatal("Failed setting libcurl data callback object: %s", curl_easy_strerror(cRet));
 
-  /* Progress callback */
-  cRet = curl_easy_setopt(c, CURLOPT_NOPROGRESS, 0);
-  if(cRet != CURLE_OK)
-    Fatal("Failed enabling libcurl progress callback function: %s", curl_easy_strerror(cRet));  
-  cRet = curl_easy_setopt(c, CURLOPT_PROGRESSFUNCTION, &progress_callback_dispatcher);
+  /* So the engine can find us when the transfer finishes */
+  cRet = curl_easy_setopt(c, CURLOPT_PRIVATE, this);
   if(cRet != CURLE_OK)
-    Fatal("Failed setting libcurl progress callback function: %s", curl_easy_strerror(cRet));
-  cRet = curl_easy_setopt(c, CURLOPT_PROGRESSDATA, this);
-  if(cRet != CURLE_OK)
-    Fatal("Failed setting libcurl progress callback object: %s", curl_easy_strerror(cRet));
+    Fatal("Failed setting libcurl private pointer: %s", curl_easy_strerror(cRet));
 
   /* Set username and password */
   if(!mUser.empty()) {
@@ -426,75 +440,22 @@ void* cURLCamera::thread_func() {
       Error("Failed setting password: %s", curl_easy_strerror(cRet));
   }
 
+  /* Give up on a connection which stops sending, so the transfer is retried */
+  long timeout_secs = config.http_timeout > 1000 ? config.http_timeout/1000 : 1;
+  cRet = curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, timeout_secs);
+  if(cRet != CURLE_OK)
+    Warning("Failed setting libcurl connect timeout: %s", curl_easy_strerror(cRet));
+  cRet = curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  if(cRet != CURLE_OK)
+    Warning("Failed setting libcurl low speed limit: %s", curl_easy_strerror(cRet));
+  cRet = curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, timeout_secs);
+  if(cRet != CURLE_OK)
+    Warning("Failed setting libcurl low speed time: %s", curl_easy_strerror(cRet));
+
   /* Authenication preference */
   cRet = curl_easy_setopt(c, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
   if(cRet != CURLE_OK)
     Warning("Failed setting libcurl acceptable http authenication methods: %s", curl_easy_strerror(cRet));
-
-
-  /* Work loop */
-  for(int attempt=1;attempt<=CURL_MAXRETRY;attempt++) {
-    tRet = 0;
-    while(!bTerminate) {
-      /* Do the work */
-      cRet = curl_easy_perform(c);
-
-      if(mode == MODE_SINGLE) {
-        if(cRet != CURLE_OK) {
-          break;
-        }
-        /* Attempt to get the size of the file */
-        cRet = curl_easy_getinfo(c, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &dSize);
-        if(cRet != CURLE_OK) {
-          break;
-        }
-        /* We need to lock for the offsets array and the condition variable */
-        lock();
-        /* Push the size into our offsets array */
-        if(dSize > 0) {
-          single_offsets.push_back(dSize);
-        } else {
-          Fatal("Unable to get the size of the image");
-        }
-        /* Signal the request complete condition variable */
-        tRet = pthread_cond_signal(&request_complete_cond);
-        if(tRet != 0) {
-          Error("Failed signaling request completed condition variable: %s",strerror(tRet));
-        }
-        /* Unlock */
-        unlock();
-
-      } else if (mode == MODE_STREAM) {
-        break;
-      }
-    }
-
-    /* Return value checking */
-    if(cRet == CURLE_ABORTED_BY_CALLBACK || bTerminate) {
-      /* Aborted */
-      break;
-    } else if (cRet != CURLE_OK) {
-      /* Some error */
-      Error("cURL Request failed: %s",curl_easy_strerror(cRet));
-      if(attempt < CURL_MAXRETRY) {
-        Error("Retrying.. Attempt %d of %d",attempt,CURL_MAXRETRY);
-        /* Do a reset */
-        lock();
-        databuffer.clear();
-        single_offsets.clear();
-        mode = MODE_UNSET;
-        bReset = true;
-        unlock();
-      }
-      tRet = -50;
-    }
-  }
-      
-  /* Cleanup */
-  curl_easy_cleanup(c);
-  c = NULL;
-  
-  return (void*)tRet;
 }
 
 int cURLCamera::lock() {
@@ -519,14 +480,6 @@ int cURLCamera::unlock() {
   return nRet;
 }
 
-int cURLCamera::progress_callback(void *userdata, double dltotal, double dlnow, double ultotal, double ulnow) {
-  /* Signal the curl thread to terminate */
-  if(bTerminate)
-    return -10;
-  
-  return 0;
-}
-
 /* These functions call the functions in the class for the correct object */
 size_t data_callback_dispatcher(void *buffer, size_t size, size_t nmemb, void *userdata) {
   return reinterpret_cast<cURLCamera*>(userdata)->data_callback(buffer,size,nmemb,userdata);
@@ -536,12 +489,4 @@ size_t header_callback_dispatcher(void *buffer, size_t size, size_t nmemb, void
   return reinterpret_cast<cURLCamera*>(userdata)->header_callback(buffer,size,nmemb,userdata);
 }
 
-int progress_callback_dispatcher(void *userdata, double dltotal, double dlnow, double ultotal, double ulnow) {
-  return reinterpret_cast<cURLCamera*>(userdata)->progress_callback(userdata,dltotal,dlnow,ultotal,ulnow);
-}
-
-void* thread_func_dispatcher(void* object) {
-  return reinterpret_cast<cURLCamera*>(object)->thread_func();
-}
-
 #endif // HAVE_LIBCURL
@@ -29,7 +29,6 @@
 #include "zm_utils.h"
 #include "zm_signal.h"
 #include <string>
-#include <deque>
 
 #if HAVE_CURL_CURL_H
 #include <curl/curl.h>
@@ -50,18 +49,31 @@ protected:
   /* cURL object(s) */
   CURL* c;
 
-  /* Shared data */
-  volatile bool bTerminate;
-  volatile bool bReset;
-  volatile mode_t mode;
+  /* Transfer state, only used by the engine thread */
+  mode_t mode;
   Buffer databuffer;
-  std::deque<size_t> single_offsets;
+  bool SubHeadersParsingComplete;
+  unsigned int frame_content_length;
+  std::string frame_content_type;
+  int attempts;
+
+  /* Completed frames are double buffered. The engine thread copies each
+     one into ready_frame and Capture swaps it for capture_frame, so neither
+     side holds the lock while parsing or decoding. */
+  Buffer ready_frame;
+  Buffer capture_frame;
+  bool bFrameReady;
+  volatile bool bFailed;
+  volatile bool bUnsupported;
 
   /* pthread objects */
-  pthread_t thread;
   pthread_mutex_t shareddata_mutex;
   pthread_cond_t data_available_cond;
-  pthread_cond_t request_complete_cond;
+
+  void SetupHandle();
+  void ParseStream();
+  void PublishFrame( const unsigned char *frame, size_t size );
+  void Fail();
 
 public:
   cURLCamera( int p_id, const std::string &path, const std::string &username, const std::string &password, unsigned int p_width, unsigned int p_height, int p_colours, int p_brightness, int p_contrast, int p_hue, int p_colour, bool p_capture, bool p_record_audio );
@@ -80,12 +92,15 @@ public:
   int Capture( Image &image );
   int PostCapture();
   int CaptureAndRecord( Image &image, struct timeval recording, char* event_directory );
+  bool CapturesJpeg() const { return( true ); }
+  const uint8_t *CapturedJpeg( unsigned int &p_size ) const { p_size = capture_frame.size(); return( capture_frame.head() ); }
+
+  /* Called by the engine thread */
+  CURL *Handle() const { return( c ); }
+  bool TransferDone( CURLcode result );
 
   size_t data_callback(void *buffer, size_t size, size_t nmemb, void *userdata);
   size_t header_callback(void *buffer, size_t size, size_t nmemb, void *userdata);
-  int progress_callback(void *userdata, double dltotal, double dlnow, double ultotal, double ulnow);  
-  int debug_callback(CURL* handle, curl_infotype type, char* str, size_t strsize, void* data);
-  void* thread_func();
   int lock();
   int unlock();
 
@@ -94,8 +109,6 @@ public:
 /* Dispatchers */
 size_t header_callback_dispatcher(void *buffer, size_t size, size_t nmemb, void *userdata);
 size_t data_callback_dispatcher(void *buffer, size_t size, size_t nmemb, void *userdata);
-int progress_callback_dispatcher(void *userdata, double dltotal, double dlnow, double ultotal, double ulnow);
-void* thread_func_dispatcher(void* object);
 
 #endif // HAVE_LIBCURL
 
@@ -0,0 +1,202 @@
+//
+// ZoneMinder cURL Engine Implementation, $Date$, $Revision$
+// Copyright (C) 2001-2008 Philip Coombes
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "zm.h"
+
+#include "zm_curl_engine.h"
+#include "zm_curl_camera.h"
+
+#include <algorithm>
+
+#if HAVE_LIBCURL
+
+// How long to wait for socket activity before looking for new or departing cameras
+#define CURL_ENGINE_WAIT_MS 100
+
+cURLEngine *cURLEngine::smInstance = 0;
+int cURLEngine::smUsers = 0;
+pthread_mutex_t cURLEngine::smMutex = PTHREAD_MUTEX_INITIALIZER;
+
+cURLEngine::cURLEngine() : bTerminate( false ) {
+  CURLcode cRet = curl_global_init(CURL_GLOBAL_ALL);
+  if(cRet != CURLE_OK) {
+    Fatal("libcurl initialization failed: %s", curl_easy_strerror(cRet));
+  }
+
+  Debug(2,"libcurl version: %s",curl_version());
+
+  multi = curl_multi_init();
+  if(multi == NULL) {
+    Fatal("Failed getting multi handle from libcurl");
+  }
+
+  int nRet = pthread_mutex_init(&changes_mutex, NULL);
+  if(nRet != 0) {
+    Fatal("Engine changes mutex creation failed: %s",strerror(nRet));
+  }
+  nRet = pthread_cond_init(&changes_cond, NULL);
+  if(nRet != 0) {
+    Fatal("Engine changes condition variable creation failed: %s",strerror(nRet));
+  }
+
+  nRet = pthread_create(&thread, NULL, engine_thread_func_dispatcher, this);
+  if(nRet != 0) {
+    Fatal("Engine thread creation failed: %s",strerror(nRet));
+  }
+}
+
+cURLEngine::~cURLEngine() {
+  bTerminate = true;
+  pthread_join(thread, NULL);
+
+  pthread_cond_destroy(&changes_cond);
+  pthread_mutex_destroy(&changes_mutex);
+
+  curl_multi_cleanup(multi);
+  curl_global_cleanup();
+}
+
+void cURLEngine::Attach( cURLCamera *camera ) {
+  pthread_mutex_lock(&smMutex);
+  if ( !smInstance ) {
+    Debug(2,"Starting cURL engine");
+    smInstance = new cURLEngine();
+  }
+  smUsers++;
+  smInstance->Add(camera);
+  pthread_mutex_unlock(&smMutex);
+}
+
+void cURLEngine::Detach( cURLCamera *camera ) {
+  pthread_mutex_lock(&smMutex);
+  if ( smInstance ) {
+    smInstance->Remove(camera);
+    if ( --smUsers == 0 ) {
+      Debug(2,"Stopping cURL engine");
+      delete smInstance;
+      smInstance = 0;
+    }
+  }
+  pthread_mutex_unlock(&smMutex);
+}
+
+void cURLEngine::Add( cURLCamera *camera ) {
+  pthread_mutex_lock(&changes_mutex);
+  additions.push_back(camera);
+  pthread_mutex_unlock(&changes_mutex);
+}
+
+void cURLEngine::Remove( cURLCamera *camera ) {
+  pthread_mutex_lock(&changes_mutex);
+  removals.push_back(camera);
+  /* Once the engine has dropped the camera none of its callbacks will be called again */
+  while ( std::find(removals.begin(), removals.end(), camera) != removals.end() ) {
+    int nRet = pthread_cond_wait(&changes_cond, &changes_mutex);
+    if ( nRet != 0 ) {
+      Error("Failed waiting for engine changes condition variable: %s",strerror(nRet));
+      break;
+    }
+  }
+  pthread_mutex_unlock(&changes_mutex);
+}
+
+void cURLEngine::ApplyChanges() {
+  pthread_mutex_lock(&changes_mutex);
+  for ( std::vector<cURLCamera *>::iterator iter = removals.begin(); iter != removals.end(); ++iter ) {
+    cURLCamera *camera = *iter;
+    std::vector<cURLCamera *>::iterator added = std::find(additions.begin(), additions.end(), camera);
+    if ( added != additions.end() )
+      additions.erase(added);
+    if ( active.erase(camera) )
+      curl_multi_remove_handle(multi, camera->Handle());
+  }
+  if ( !removals.empty() ) {
+    removals.clear();
+    pthread_cond_broadcast(&changes_cond);
+  }
+  for ( std::vector<cURLCamera *>::iterator iter = additions.begin(); iter != additions.end(); ++iter ) {
+    cURLCamera *camera = *iter;
+    CURLMcode mRet = curl_multi_add_handle(multi, camera->Handle());
+    if ( mRet != CURLM_OK ) {
+      Error("Failed adding transfer for %s: %s", camera->Path().c_str(), curl_multi_strerror(mRet));
+      continue;
+    }
+    active.insert(camera);
+  }
+  additions.clear();
+  pthread_mutex_unlock(&changes_mutex);
+}
+
+void cURLEngine::TransfersDone() {
+  CURLMsg *msg;
+  int msgs_left;
+
+  while ( (msg = curl_multi_info_read(multi, &msgs_left)) ) {
+    if ( msg->msg != CURLMSG_DONE )
+      continue;
+
+    /* The message goes away when the handle is removed, so take what we need first */
+    CURL *handle = msg->easy_handle;
+    CURLcode result = msg->data.result;
+    cURLCamera *camera = NULL;
+    curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&camera);
+
+    curl_multi_remove_handle(multi, handle);
+    if ( !camera || !active.count(camera) )
+      continue;
+
+    /* Re-adding the handle starts the transfer again */
+    if ( camera->TransferDone(result) && curl_multi_add_handle(multi, handle) == CURLM_OK )
+      continue;
+    active.erase(camera);
+  }
+}
+
+void *cURLEngine::thread_func() {
+  while ( !bTerminate ) {
+    ApplyChanges();
+
+    int running = 0;
+    CURLMcode mRet = curl_multi_perform(multi, &running);
+    if ( mRet != CURLM_OK && mRet != CURLM_CALL_MULTI_PERFORM ) {
+      Error("cURL multi perform failed: %s", curl_multi_strerror(mRet));
+    }
+
+    TransfersDone();
+
+    mRet = curl_multi_wait(multi, NULL, 0, CURL_ENGINE_WAIT_MS, NULL);
+    if ( mRet != CURLM_OK ) {
+      Error("cURL multi wait failed: %s", curl_multi_strerror(mRet));
+      usleep(CURL_ENGINE_WAIT_MS*1000);
+    }
+  }
+
+  /* Anything still attached is being torn down with the engine */
+  for ( std::set<cURLCamera *>::iterator iter = active.begin(); iter != active.end(); ++iter )
+    curl_multi_remove_handle(multi, (*iter)->Handle());
+  active.clear();
+
+  return NULL;
+}
+
+void *engine_thread_func_dispatcher( void *object ) {
+  return reinterpret_cast<cURLEngine*>(object)->thread_func();
+}
+
+#endif // HAVE_LIBCURL
@@ -0,0 +1,81 @@
+//
+// ZoneMinder cURL Engine Interface, $Date$, $Revision$
+// Copyright (C) 2001-2008 Philip Coombes
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#ifndef ZM_CURL_ENGINE_H
+#define ZM_CURL_ENGINE_H
+
+#if HAVE_LIBCURL
+
+#include <pthread.h>
+#include <set>
+#include <vector>
+
+#if HAVE_CURL_CURL_H
+#include <curl/curl.h>
+#endif
+
+class cURLCamera;
+
+//
+// Runs the transfers for all the curl cameras in a process from a single
+// thread, using a curl multi handle, instead of each camera having its own
+// thread blocked in curl_easy_perform. Cameras attach when they start and
+// detach when they finish; the engine exists while any are attached. A zmc
+// given a list of monitor ids runs all of their cameras through it.
+//
+class cURLEngine {
+private:
+  static cURLEngine *smInstance;
+  static int smUsers;
+  static pthread_mutex_t smMutex;
+
+  CURLM *multi;
+  pthread_t thread;
+  volatile bool bTerminate;
+
+  // Changes requested by camera threads, applied by the engine thread
+  pthread_mutex_t changes_mutex;
+  pthread_cond_t changes_cond;
+  std::vector<cURLCamera *> additions;
+  std::vector<cURLCamera *> removals;
+
+  // Cameras with a transfer in the multi handle, only used by the engine thread
+  std::set<cURLCamera *> active;
+
+private:
+  cURLEngine();
+  ~cURLEngine();
+
+  void Add( cURLCamera *camera );
+  void Remove( cURLCamera *camera );
+  void ApplyChanges();
+  void TransfersDone();
+
+public:
+  static void Attach( cURLCamera *camera );
+  static void Detach( cURLCamera *camera );
+
+  void *thread_func();
+};
+
+void *engine_thread_func_dispatcher( void *object );
+
+#endif // HAVE_LIBCURL
+
+#endif // ZM_CURL_ENGINE_H
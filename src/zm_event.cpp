@@ -40,10 +40,6 @@
 
 const char * Event::frame_type_names[3] = { "Normal", "Bulk", "Alarm" };
 
-int Event::pre_alarm_count = 0;
-
-Event::PreAlarmData Event::pre_alarm_data[MAX_PRE_ALARM_FRAMES] = { { 0 } };
-
 Event::Event(
     Monitor *p_monitor,
     struct timeval p_start_time,
@@ -289,6 +285,25 @@ bool Event::WriteFrameImage( Image *image, struct timeval timestamp, const char
   bool rc;
 Debug(3, "Writing image to %s", event_file );
 
+  if ( !thisquality && !monitor->Exif() && monitor->CapturedJpegMaxSize() ) {
+    // Write out what the camera sent if we still have it, rather than encoding the image again
+    if ( captured_jpeg.size() < monitor->CapturedJpegMaxSize() )
+      captured_jpeg.resize( monitor->CapturedJpegMaxSize() );
+    unsigned int jpeg_size = monitor->GetCapturedJpeg( image, timestamp, &captured_jpeg[0], captured_jpeg.size() );
+    if ( jpeg_size ) {
+      FILE *outfile;
+      if ( (outfile = fopen( event_file, "wb" )) == NULL ) {
+        Error( "Can't open %s: %s", event_file, strerror(errno) );
+        return false;
+      }
+      rc = ( fwrite( &captured_jpeg[0], jpeg_size, 1, outfile ) == 1 );
+      if ( !rc )
+        Error( "Can't write %s: %s", event_file, strerror(errno) );
+      fclose( outfile );
+      return rc;
+    }
+  }
+
   if ( !config.timestamp_on_capture ) {
     // stash the image we plan to use in another pointer regardless if timestamped.
     Image *ts_image = new Image(*image);
@@ -373,7 +388,7 @@ void Event::updateNotes( const StringSetMap &newNoteSetMap ) {
     createNotes( notes );
 
     Debug( 2, "Updating notes for event %d, '%s'", id, notes.c_str() );
-    static char sql[ZM_SQL_MED_BUFSIZ];
+    char sql[ZM_SQL_MED_BUFSIZ];
 #if USE_PREPARED_SQL
     static MYSQL_STMT *stmt = 0;
 
@@ -420,7 +435,7 @@ void Event::updateNotes( const StringSetMap &newNoteSetMap ) {
       Fatal( "Unable to execute sql '%s': %s", sql, mysql_stmt_error(stmt) );
     }
 #else
-    static char escapedNotes[ZM_SQL_MED_BUFSIZ];
+    char escapedNotes[ZM_SQL_MED_BUFSIZ];
 
     mysql_real_escape_string( &dbconn, escapedNotes, notes.c_str(), notes.length() );
 
@@ -441,7 +456,7 @@ void Event::AddFrames( int n_frames, Image **images, struct timeval **timestamps
 }
 
 void Event::AddFramesInternal( int n_frames, int start_frame, Image **images, struct timeval **timestamps ) {
-  static char sql[ZM_SQL_LGE_BUFSIZ];
+  char sql[ZM_SQL_LGE_BUFSIZ];
   strncpy( sql, "insert into Frames ( EventId, FrameId, TimeStamp, Delta ) values ", sizeof(sql) );
   int frameCount = 0;
   for ( int i = start_frame; i < n_frames && i - start_frame < ZM_SQL_BATCH_SIZE; i++ ) {
@@ -452,7 +467,7 @@ void Event::AddFramesInternal( int n_frames, int start_frame, Image **images, st
 
     frames++;
 
-    static char event_file[PATH_MAX];
+    char event_file[PATH_MAX];
     snprintf( event_file, sizeof(event_file), staticConfig.capture_file_format, path, frames );
     if ( monitor->GetOptSaveJPEGs() & 1 ) {
       Debug( 1, "Writing pre-capture frame %d", frames );
@@ -509,7 +524,7 @@ void Event::AddFrame( Image *image, struct timeval timestamp, int score, Image *
 
   frames++;
 
-  static char event_file[PATH_MAX];
+  char event_file[PATH_MAX];
   snprintf( event_file, sizeof(event_file), staticConfig.capture_file_format, path, frames );
 
   if ( monitor->GetOptSaveJPEGs() & 1 ) {
@@ -542,7 +557,7 @@ Debug(3, "Writing video");
   if ( db_frame ) {
 
     Debug( 1, "Adding frame %d of type \"%s\" to DB", frames, Event::frame_type_names[frame_type] );
-    static char sql[ZM_SQL_MED_BUFSIZ];
+    char sql[ZM_SQL_MED_BUFSIZ];
     snprintf(sql, sizeof(sql), "INSERT INTO Frames ( EventId, FrameId, Type, TimeStamp, Delta, Score ) values ( %" PRIu64 ", %d, '%s', from_unixtime( %ld ), %s%ld.%02ld, %d )", id, frames, frame_type_names[frame_type], timestamp.tv_sec, delta_time.positive?"":"-", delta_time.sec, delta_time.fsec, score);
     db_mutex.lock();
     if ( mysql_query(&dbconn, sql) ) {
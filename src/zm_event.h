@@ -33,6 +33,7 @@
 
 #include <set>
 #include <map>
+#include <vector>
 
 #include "zm.h"
 #include "zm_image.h"
@@ -63,16 +64,6 @@ class Event {
     typedef enum { NORMAL=0, BULK, ALARM } FrameType;
     static const char * frame_type_names[3];
 
-    struct PreAlarmData {
-      Image *image;
-      struct timeval timestamp;
-      unsigned int score;
-      Image *alarm_frame;
-    };
-
-    static int pre_alarm_count;
-    static PreAlarmData pre_alarm_data[MAX_PRE_ALARM_FRAMES];
-
     uint64_t  id;
     Monitor      *monitor;
     struct timeval  start_time;
@@ -93,6 +84,7 @@ class Event {
     char timecodes_file[PATH_MAX];
     int        last_db_frame;
     Storage::Schemes  scheme;
+    std::vector<uint8_t> captured_jpeg; // Copy of the camera's JPEG for the frame being written
 
     void createNotes( std::string &notes );
 
@@ -138,36 +130,6 @@ class Event {
     char* getEventFile(void) {
       return video_file;
     }
-
-  public:
-    static int PreAlarmCount() {
-      return pre_alarm_count;
-    }
-    static void EmptyPreAlarmFrames() {
-      if ( pre_alarm_count > 0 ) {
-        for ( int i = 0; i < MAX_PRE_ALARM_FRAMES; i++ ) {
-          delete pre_alarm_data[i].image;
-          delete pre_alarm_data[i].alarm_frame;
-        }
-        memset( pre_alarm_data, 0, sizeof(pre_alarm_data) );
-      }
-      pre_alarm_count = 0;
-    }
-    static void AddPreAlarmFrame( Image *image, struct timeval timestamp, int score=0, Image *alarm_frame=NULL ) {
-      pre_alarm_data[pre_alarm_count].image = new Image( *image );
-      pre_alarm_data[pre_alarm_count].timestamp = timestamp;
-      pre_alarm_data[pre_alarm_count].score = score;
-      if ( alarm_frame ) {
-        pre_alarm_data[pre_alarm_count].alarm_frame = new Image( *alarm_frame );
-      }
-      pre_alarm_count++;
-    }
-    void SavePreAlarmFrames() {
-      for ( int i = 0; i < pre_alarm_count; i++ ) {
-        AddFrame( pre_alarm_data[i].image, pre_alarm_data[i].timestamp, pre_alarm_data[i].score, pre_alarm_data[i].alarm_frame );
-      }
-      EmptyPreAlarmFrames();
-    }
 };
 
 #endif // ZM_EVENT_H
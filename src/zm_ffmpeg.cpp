@@ -74,7 +74,11 @@ enum _AVPIXELFORMAT GetFFMPEGPixelFormat(unsigned int p_colours, unsigned p_subp
         break;
       }
     case ZM_COLOUR_GRAY8:
-      pf = AV_PIX_FMT_GRAY8;
+      if(p_subpixelorder == ZM_SUBPIX_ORDER_YUV420P) {
+        pf = AV_PIX_FMT_YUV420P;
+      } else {
+        pf = AV_PIX_FMT_GRAY8;
+      }
       break;
     default:
       Panic("Unexpected colours: %d",p_colours);
@@ -22,6 +22,7 @@
 #if HAVE_LIBAVFORMAT
 
 #include "zm_ffmpeg_camera.h"
+#include "zm_time.h"
 
 extern "C" {
 #include "libavutil/time.h"
@@ -30,10 +31,34 @@ extern "C" {
 	#include "libavutil/hwcontext_qsv.h"
 #endif
 }
+// Motion vector export is only available in FFmpeg, not libav
+#if LIBAVUTIL_VERSION_MICRO >= 100 && LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(54, 18, 100)
+#define HAVE_MOTION_VECTORS 1
+extern "C" {
+#include "libavutil/motion_vector.h"
+}
+#endif
+
 #ifndef AV_ERROR_MAX_STRING_SIZE
 #define AV_ERROR_MAX_STRING_SIZE 64
 #endif
 
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+// Whether a decoder opened for the old parameters can carry on decoding the new stream
+static bool same_video_parameters( const AVCodecParameters *old_par, const AVCodecParameters *new_par ) {
+  if ( !old_par || !new_par )
+    return false;
+  if ( old_par->codec_id != new_par->codec_id
+      || old_par->width != new_par->width
+      || old_par->height != new_par->height
+      || old_par->format != new_par->format )
+    return false;
+  if ( old_par->extradata_size != new_par->extradata_size )
+    return false;
+  return old_par->extradata_size == 0 || !memcmp( old_par->extradata, new_par->extradata, old_par->extradata_size );
+}
+#endif
+
 #ifdef SOLARIS
 #include <sys/errno.h>  // for ESRCH
 #include <signal.h>
@@ -109,12 +134,31 @@ FfmpegCamera::FfmpegCamera( int p_id, const std::string &p_path, const std::stri
   frameCount = 0;
   startTime = 0;
   mCanCapture = false;
+  decoding_all_frames = true;
+  activity = -1;
+  static_packet_size = 0.0;
   videoStore = NULL;
   video_last_pts = 0;
   have_video_keyframe = false;
+  reconnect_start.tv_sec = 0;
+  reconnect_start.tv_usec = 0;
+  mLowLatency = false;
+  next_arrival = 0;
+  frame_arrival.tv_sec = 0;
+  frame_arrival.tv_usec = 0;
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+  mCachedStreamCount = 0;
+  mCachedVideoStreamId = -1;
+  mCachedAudioStreamId = -1;
+  mCachedVideoParams = NULL;
+  mCachedAudioParams = NULL;
+#endif
 
 #if HAVE_LIBSWSCALE  
   mConvertContext = NULL;
+  mConvertWidth = 0;
+  mConvertHeight = 0;
+  mConvertFormat = AV_PIX_FMT_NONE;
 #endif
   /* Has to be located inside the constructor so other components such as zma will receive correct colours and subpixel order */
   if ( colours == ZM_COLOUR_RGB32 ) {
@@ -138,6 +182,11 @@ FfmpegCamera::~FfmpegCamera() {
     videoStore = NULL;
   }
   Close();
+  CloseDecoder();
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+  avcodec_parameters_free( &mCachedVideoParams );
+  avcodec_parameters_free( &mCachedAudioParams );
+#endif
 
   if ( capture ) {
     Terminate();
@@ -203,6 +252,8 @@ int FfmpegCamera::Capture( Image &image ) {
       }
       return -1;
     }
+    if ( packet.stream_index == mVideoStreamId )
+      PacketArrived( &packet );
 
     int keyframe = packet.flags & AV_PKT_FLAG_KEY;
     if ( keyframe )
@@ -211,6 +262,10 @@ int FfmpegCamera::Capture( Image &image ) {
     Debug( 5, "Got packet from stream %d dts (%d) pts(%d)", packet.stream_index, packet.pts, packet.dts );
     // What about audio stream? Maybe someday we could do sound detection...
     if ( ( packet.stream_index == mVideoStreamId ) && ( keyframe || have_video_keyframe ) ) {
+      if ( !ShouldDecode(keyframe) ) {
+        zm_av_packet_unref( &packet );
+        return 0;
+      }
     int ret;
 #if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
       ret = avcodec_send_packet( mVideoCodecContext, &packet );
@@ -266,6 +321,8 @@ int FfmpegCamera::Capture( Image &image ) {
 
       if ( frameComplete ) {
         Debug( 4, "Got frame %d", frameCount );
+        UpdateActivity( &packet, mRawFrame );
+        FrameDecoded( mRawFrame );
 
         uint8_t* directbuffer;
 
@@ -285,6 +342,8 @@ int FfmpegCamera::Capture( Image &image ) {
 #endif
 
 #if HAVE_LIBSWSCALE
+        if ( !SetupConvertContext() )
+          return -1;
         if ( sws_scale(mConvertContext, mRawFrame->data, mRawFrame->linesize, 0, mVideoCodecContext->height, mFrame->data, mFrame->linesize) < 0 ) {
           Error("Unable to convert raw format %u to target format %u at frame %d", mVideoCodecContext->pix_fmt, imagePixFormat, frameCount);
           return -1;
@@ -314,6 +373,16 @@ int FfmpegCamera::OpenFfmpeg() {
   int ret;
 
   have_video_keyframe = false;
+  decoding_all_frames = true;
+  activity = -1;
+  static_packet_size = 0.0;
+  for ( unsigned int i = 0; i < ARRIVAL_HISTORY; i++ )
+    packet_arrivals[i].pts = AV_NOPTS_VALUE;
+
+  if ( startTime ) {
+    // We have had the stream open before, so time how long it takes to get images again
+    gettimeofday( &reconnect_start, NULL );
+  }
 
   // Open the input, not necessarily a file
 #if !LIBAVFORMAT_VERSION_CHECK(53, 2, 0, 4, 0)
@@ -327,6 +396,21 @@ int FfmpegCamera::OpenFfmpeg() {
     Warning("Could not parse ffmpeg input options list '%s'\n", Options().c_str());
   }
 
+  // low_latency is our own option rather than ffmpeg's, so take it out
+  AVDictionaryEntry *low_latency = av_dict_get(opts, "low_latency", NULL, 0);
+  mLowLatency = low_latency && atoi(low_latency->value);
+  if ( low_latency )
+    av_dict_set(&opts, "low_latency", NULL, 0);
+  if ( mLowLatency ) {
+    // Don't buffer or reorder packets and probe as little as possible
+    // before starting. Anything given explicitly in the options wins.
+    Debug(1, "Using low latency settings for %s", mPath.c_str());
+    av_dict_set(&opts, "fflags", "nobuffer", AV_DICT_DONT_OVERWRITE);
+    av_dict_set(&opts, "probesize", "32768", AV_DICT_DONT_OVERWRITE);
+    av_dict_set(&opts, "analyzeduration", "500000", AV_DICT_DONT_OVERWRITE);
+    av_dict_set(&opts, "max_delay", "0", AV_DICT_DONT_OVERWRITE);
+  }
+
   // Set transport method as specified by method field, rtpUni is default
   const std::string method = Method();
   if ( method == "rtpMulti" ) {
@@ -375,18 +459,26 @@ int FfmpegCamera::OpenFfmpeg() {
 
   Debug(1, "Opened input");
 
-  Info( "Stream open %s, parsing streams...", mPath.c_str() );
+  bool cached_stream_info = false;
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+  cached_stream_info = UseCachedStreamInfo();
+#endif
+  if ( cached_stream_info ) {
+    Info( "Stream open %s, reusing stream parameters from the last connection", mPath.c_str() );
+  } else {
+    Info( "Stream open %s, parsing streams...", mPath.c_str() );
 
 #if !LIBAVFORMAT_VERSION_CHECK(53, 6, 0, 6, 0)
-  Debug(4, "Calling av_find_stream_info");
-  if ( av_find_stream_info( mFormatContext ) < 0 )
+    Debug(4, "Calling av_find_stream_info");
+    if ( av_find_stream_info( mFormatContext ) < 0 )
 #else
-  Debug(4, "Calling avformat_find_stream_info");
-  if ( avformat_find_stream_info( mFormatContext, 0 ) < 0 )
+    Debug(4, "Calling avformat_find_stream_info");
+    if ( avformat_find_stream_info( mFormatContext, 0 ) < 0 )
 #endif
-  {
-    Error("Unable to find stream info from %s due to: %s", mPath.c_str(), strerror(errno));
-    return -1;
+    {
+      Error("Unable to find stream info from %s due to: %s", mPath.c_str(), strerror(errno));
+      return -1;
+    }
   }
 
   startTime = av_gettime();//FIXME here or after find_Stream_info
@@ -438,6 +530,104 @@ int FfmpegCamera::OpenFfmpeg() {
   Debug(3, "Found video stream at index %d", mVideoStreamId);
   Debug(3, "Found audio stream at index %d", mAudioStreamId);
 
+  // Anything queued from a previous connection is no use to us
+  packetqueue.clearQueue();
+  packetqueue.setVideoStreamId(mVideoStreamId);
+
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+  if ( mVideoCodecContext ) {
+    // Still have the decoder from the last connection, which can carry on if the stream is the same
+    if ( same_video_parameters( mCachedVideoParams, mFormatContext->streams[mVideoStreamId]->codecpar ) ) {
+      Debug( 1, "Video stream is unchanged, keeping the decoder" );
+      avcodec_flush_buffers( mVideoCodecContext );
+      mVideoCodecContext->skip_frame = AVDISCARD_DEFAULT;
+    } else {
+      Info( "Video stream parameters have changed, reopening the decoder" );
+      CloseDecoder();
+    }
+  }
+  CacheStreamInfo();
+#endif
+  if ( mVideoCodecContext ) {
+    av_dict_free(&opts);
+  } else if ( OpenVideoDecoder( opts ) < 0 ) {
+    return -1;
+  }
+
+  if (mVideoCodecContext->hwaccel != NULL) {
+    Debug(1, "HWACCEL in use");
+  } else {
+    Debug(1, "HWACCEL not in use");
+  }
+  if ( mAudioStreamId >= 0 ) {
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+    mAudioCodecContext = avcodec_alloc_context3( NULL );
+    avcodec_parameters_to_context( mAudioCodecContext, mFormatContext->streams[mAudioStreamId]->codecpar );
+#else
+    mAudioCodecContext = mFormatContext->streams[mAudioStreamId]->codec;
+#endif
+    if ( (mAudioCodec = avcodec_find_decoder(mAudioCodecContext->codec_id)) == NULL ) {
+      Debug(1, "Can't find codec for audio stream from %s", mPath.c_str());
+    } else {
+      Debug(1, "Audio Found decoder");
+      zm_dump_stream_format(mFormatContext, mAudioStreamId, 0, 0);
+      // Open the codec
+#if !LIBAVFORMAT_VERSION_CHECK(53, 8, 0, 8, 0)
+      Debug ( 1, "Calling avcodec_open" );
+      if ( avcodec_open(mAudioCodecContext, mAudioCodec) < 0 ) {
+#else
+      Debug ( 1, "Calling avcodec_open2" );
+      if ( avcodec_open2(mAudioCodecContext, mAudioCodec, 0) < 0 ) {
+#endif
+        Error( "Unable to open codec for video stream from %s", mPath.c_str() );
+        return -1;
+      }
+      Debug(2, "Opened audio codec");
+    } // end if find decoder
+  } // end if have audio_context
+
+  // Allocate space for the native video frame
+  if ( !mRawFrame )
+    mRawFrame = zm_av_frame_alloc();
+
+  // Allocate space for the converted video frame
+  if ( !mFrame )
+    mFrame = zm_av_frame_alloc();
+
+  if ( mRawFrame == NULL || mFrame == NULL ) {
+    Error("Unable to allocate frame for %s", mPath.c_str());
+    return -1;
+  }
+
+  Debug( 3, "Allocated frames");
+
+#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
+  int pSize = av_image_get_buffer_size( imagePixFormat, width, height,1 );
+#else
+  int pSize = avpicture_get_size( imagePixFormat, width, height );
+#endif
+
+  if ( (unsigned int)pSize != imagesize ) {
+    Error("Image size mismatch. Required: %d Available: %d",pSize,imagesize);
+    return -1;
+  }
+
+  Debug(4, "Validated imagesize");
+
+  if ( !SetupConvertContext() )
+    return -1;
+
+  if ( (unsigned int)mVideoCodecContext->width != width || (unsigned int)mVideoCodecContext->height != height ) {
+    Warning( "Monitor dimensions are %dx%d but camera is sending %dx%d", width, height, mVideoCodecContext->width, mVideoCodecContext->height );
+  }
+
+  mCanCapture = true;
+
+  return 0;
+} // int FfmpegCamera::OpenFfmpeg()
+
+// Finds and opens a decoder for the video stream
+int FfmpegCamera::OpenVideoDecoder( AVDictionary *&opts ) {
 #if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
   mVideoCodecContext = avcodec_alloc_context3(NULL);
   avcodec_parameters_to_context( mVideoCodecContext, mFormatContext->streams[mVideoStreamId]->codecpar );
@@ -450,6 +640,15 @@ int FfmpegCamera::OpenFfmpeg() {
 #ifdef CODEC_FLAG2_FAST
 	mVideoCodecContext->flags2 |= CODEC_FLAG2_FAST | CODEC_FLAG_LOW_DELAY;
 #endif
+  if ( mLowLatency ) {
+#ifdef AV_CODEC_FLAG_LOW_DELAY
+    mVideoCodecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+#else
+    mVideoCodecContext->flags |= CODEC_FLAG_LOW_DELAY;
+#endif
+    // Frame threading holds back a frame for each thread
+    mVideoCodecContext->thread_type = FF_THREAD_SLICE;
+  }
 
 #if HAVE_AVUTIL_HWCONTEXT_H
   if ( mVideoCodecContext->codec_id == AV_CODEC_ID_H264 ) {
@@ -473,7 +672,7 @@ int FfmpegCamera::OpenFfmpeg() {
       } else {
         Debug(1, "Success finding decoder (h264_qsv)" );
         /* open the hardware device */
-        ret = av_hwdevice_ctx_create(&decode.hw_device_ref, AV_HWDEVICE_TYPE_QSV,
+        int ret = av_hwdevice_ctx_create(&decode.hw_device_ref, AV_HWDEVICE_TYPE_QSV,
             "auto", NULL, 0);
         if (ret < 0) {
           Error("Failed to open the hardware device");
@@ -518,6 +717,12 @@ int FfmpegCamera::OpenFfmpeg() {
   Debug ( 1, "Calling avcodec_open" );
   if ( avcodec_open(mVideoCodecContext, mVideoCodec) < 0 ){
 #else
+#if HAVE_MOTION_VECTORS
+  if ( config.motion_activity_floor ) {
+    // Have the decoder give us the motion vectors for the activity estimate
+    av_dict_set(&opts, "flags2", "+export_mvs", 0);
+  }
+#endif
     Debug ( 1, "Calling avcodec_open2" );
   if ( avcodec_open2(mVideoCodecContext, mVideoCodec, &opts) < 0 ) {
 #endif
@@ -538,105 +743,12 @@ int FfmpegCamera::OpenFfmpeg() {
   }
   }
 
-  if (mVideoCodecContext->hwaccel != NULL) {
-    Debug(1, "HWACCEL in use");
-  } else {
-    Debug(1, "HWACCEL not in use");
-  }
-  if ( mAudioStreamId >= 0 ) {
-#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
-    mAudioCodecContext = avcodec_alloc_context3( NULL );
-    avcodec_parameters_to_context( mAudioCodecContext, mFormatContext->streams[mAudioStreamId]->codecpar );
-#else
-    mAudioCodecContext = mFormatContext->streams[mAudioStreamId]->codec;
-#endif
-    if ( (mAudioCodec = avcodec_find_decoder(mAudioCodecContext->codec_id)) == NULL ) {
-      Debug(1, "Can't find codec for audio stream from %s", mPath.c_str());
-    } else {
-      Debug(1, "Audio Found decoder");
-      zm_dump_stream_format(mFormatContext, mAudioStreamId, 0, 0);
-      // Open the codec
-#if !LIBAVFORMAT_VERSION_CHECK(53, 8, 0, 8, 0)
-      Debug ( 1, "Calling avcodec_open" );
-      if ( avcodec_open(mAudioCodecContext, mAudioCodec) < 0 ) {
-#else
-      Debug ( 1, "Calling avcodec_open2" );
-      if ( avcodec_open2(mAudioCodecContext, mAudioCodec, 0) < 0 ) {
-#endif
-        Error( "Unable to open codec for video stream from %s", mPath.c_str() );
-        return -1;
-      }
-      Debug(2, "Opened audio codec");
-    } // end if find decoder
-  } // end if have audio_context
-
-  // Allocate space for the native video frame
-  mRawFrame = zm_av_frame_alloc();
-
-  // Allocate space for the converted video frame
-  mFrame = zm_av_frame_alloc();
-
-  if ( mRawFrame == NULL || mFrame == NULL ) {
-    Error("Unable to allocate frame for %s", mPath.c_str());
-    return -1;
-  }
-
-  Debug( 3, "Allocated frames");
-
-#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
-  int pSize = av_image_get_buffer_size( imagePixFormat, width, height,1 );
-#else
-  int pSize = avpicture_get_size( imagePixFormat, width, height );
-#endif
-
-  if ( (unsigned int)pSize != imagesize ) {
-    Error("Image size mismatch. Required: %d Available: %d",pSize,imagesize);
-    return -1;
-  }
-
-  Debug(4, "Validated imagesize");
-
-#if HAVE_LIBSWSCALE
-  Debug(1, "Calling sws_isSupportedInput");
-  if ( !sws_isSupportedInput(mVideoCodecContext->pix_fmt) ) {
-    Error("swscale does not support the codec format: %c%c%c%c", (mVideoCodecContext->pix_fmt)&0xff, ((mVideoCodecContext->pix_fmt >> 8)&0xff), ((mVideoCodecContext->pix_fmt >> 16)&0xff), ((mVideoCodecContext->pix_fmt >> 24)&0xff));
-    return -1;
-  }
-
-  if ( !sws_isSupportedOutput(imagePixFormat) ) {
-    Error("swscale does not support the target format: %c%c%c%c",(imagePixFormat)&0xff,((imagePixFormat>>8)&0xff),((imagePixFormat>>16)&0xff),((imagePixFormat>>24)&0xff));
-    return -1;
-  }
-
-  mConvertContext = sws_getContext(mVideoCodecContext->width,
-      mVideoCodecContext->height,
-      mVideoCodecContext->pix_fmt,
-      width, height,
-      imagePixFormat, SWS_BICUBIC, NULL,
-      NULL, NULL);
-  if ( mConvertContext == NULL ) {
-    Error( "Unable to create conversion context for %s", mPath.c_str() );
-    return -1;
-  }
-#else // HAVE_LIBSWSCALE
-  Fatal( "You must compile ffmpeg with the --enable-swscale option to use ffmpeg cameras" );
-#endif // HAVE_LIBSWSCALE
-
-  if ( (unsigned int)mVideoCodecContext->width != width || (unsigned int)mVideoCodecContext->height != height ) {
-    Warning( "Monitor dimensions are %dx%d but camera is sending %dx%d", width, height, mVideoCodecContext->width, mVideoCodecContext->height );
-  }
-
-  mCanCapture = true;
-
   return 0;
-} // int FfmpegCamera::OpenFfmpeg()
-
-int FfmpegCamera::Close() {
-
-  Debug(2, "CloseFfmpeg called.");
-
-  mCanCapture = false;
+} // end int FfmpegCamera::OpenVideoDecoder( AVDictionary *&opts )
 
+// Frees the video decoder, frames and conversion context, which are
+// otherwise kept over a reconnect to the same stream
+void FfmpegCamera::CloseDecoder() {
   if ( mFrame ) {
     av_frame_free( &mFrame );
     mFrame = NULL;
@@ -651,6 +763,9 @@ int FfmpegCamera::Close() {
     sws_freeContext( mConvertContext );
     mConvertContext = NULL;
   }
+  mConvertWidth = 0;
+  mConvertHeight = 0;
+  mConvertFormat = AV_PIX_FMT_NONE;
 #endif
 
   if ( mVideoCodecContext ) {
@@ -660,6 +775,20 @@ int FfmpegCamera::Close() {
 #endif
     mVideoCodecContext = NULL; // Freed by av_close_input_file
   }
+  mVideoCodec = NULL;
+} // end void FfmpegCamera::CloseDecoder()
+
+int FfmpegCamera::Close() {
+
+  Debug(2, "CloseFfmpeg called.");
+
+  mCanCapture = false;
+
+#if !LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+  // The decoder belongs to the stream, so has to go with it
+  CloseDecoder();
+#endif
+
   if ( mAudioCodecContext ) {
     avcodec_close(mAudioCodecContext);
 #if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
@@ -685,6 +814,238 @@ int FfmpegCamera::Close() {
   return 0;
 } // end FfmpegCamera::Close
 
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+// When reconnecting to a stream laid out as before, fills in the codec
+// parameters from the last connection instead of probing for them, which
+// would otherwise need several seconds of packets.
+bool FfmpegCamera::UseCachedStreamInfo() {
+  if ( !config.ffmpeg_fast_reconnect || !mCachedVideoParams )
+    return false;
+
+  if ( mFormatContext->nb_streams != mCachedStreamCount ) {
+    Debug( 1, "Stream count has changed from %d to %d, probing streams", mCachedStreamCount, mFormatContext->nb_streams );
+    return false;
+  }
+  AVCodecParameters *video_par = mFormatContext->streams[mCachedVideoStreamId]->codecpar;
+  if ( video_par->codec_type != AVMEDIA_TYPE_VIDEO
+      || ( video_par->codec_id != AV_CODEC_ID_NONE && video_par->codec_id != mCachedVideoParams->codec_id ) ) {
+    Debug( 1, "Video stream has changed, probing streams" );
+    return false;
+  }
+  if ( mCachedAudioParams ) {
+    AVCodecParameters *audio_par = mFormatContext->streams[mCachedAudioStreamId]->codecpar;
+    if ( audio_par->codec_type != AVMEDIA_TYPE_AUDIO
+        || ( audio_par->codec_id != AV_CODEC_ID_NONE && audio_par->codec_id != mCachedAudioParams->codec_id ) ) {
+      Debug( 1, "Audio stream has changed, probing streams" );
+      return false;
+    }
+  }
+
+  // Parameters sent in the session description, such as the H.264 parameter
+  // sets, are newer than what we have, so only fill in what is missing.
+  if ( !video_par->extradata_size ) {
+    if ( avcodec_parameters_copy( video_par, mCachedVideoParams ) < 0 )
+      return false;
+  } else if ( !video_par->width || !video_par->height ) {
+    video_par->width = mCachedVideoParams->width;
+    video_par->height = mCachedVideoParams->height;
+  }
+  if ( video_par->format < 0 )
+    video_par->format = mCachedVideoParams->format;
+  if ( mCachedAudioParams ) {
+    AVCodecParameters *audio_par = mFormatContext->streams[mCachedAudioStreamId]->codecpar;
+    if ( !audio_par->sample_rate || !audio_par->channels || audio_par->format < 0 ) {
+      if ( avcodec_parameters_copy( audio_par, mCachedAudioParams ) < 0 )
+        return false;
+    }
+  }
+  return true;
+} // end bool FfmpegCamera::UseCachedStreamInfo()
+
+// Keeps the stream layout and parameters of the current connection for the next reconnect
+void FfmpegCamera::CacheStreamInfo() {
+  if ( !mCachedVideoParams )
+    mCachedVideoParams = avcodec_parameters_alloc();
+  if ( !mCachedVideoParams || avcodec_parameters_copy( mCachedVideoParams, mFormatContext->streams[mVideoStreamId]->codecpar ) < 0 ) {
+    Warning( "Unable to keep video stream parameters for reconnecting" );
+    avcodec_parameters_free( &mCachedVideoParams );
+    return;
+  }
+  avcodec_parameters_free( &mCachedAudioParams );
+  if ( mAudioStreamId >= 0 ) {
+    mCachedAudioParams = avcodec_parameters_alloc();
+    if ( mCachedAudioParams && avcodec_parameters_copy( mCachedAudioParams, mFormatContext->streams[mAudioStreamId]->codecpar ) < 0 )
+      avcodec_parameters_free( &mCachedAudioParams );
+  }
+  mCachedStreamCount = mFormatContext->nb_streams;
+  mCachedVideoStreamId = mVideoStreamId;
+  mCachedAudioStreamId = mAudioStreamId;
+} // end void FfmpegCamera::CacheStreamInfo()
+#endif
+
+void FfmpegCamera::PacketArrived( const AVPacket *pkt ) {
+  PacketArrival &arrival = packet_arrivals[next_arrival];
+  arrival.pts = pkt->pts;
+  gettimeofday( &arrival.time, NULL );
+  next_arrival = (next_arrival+1) % ARRIVAL_HISTORY;
+}
+
+bool FfmpegCamera::CaptureArrival( struct timeval &p_arrival ) const {
+  if ( !frame_arrival.tv_sec )
+    return false;
+  p_arrival = frame_arrival;
+  return true;
+}
+
+// Keep images as most decoders produce them, which makes the conversion
+// into the ring a copy, and takes half the space of RGB
+bool FfmpegCamera::CapturePlanarYUV() {
+  colours = ZM_COLOUR_GRAY8;
+  subpixelorder = ZM_SUBPIX_ORDER_YUV420P;
+  imagePixFormat = AV_PIX_FMT_YUV420P;
+  imagesize = zm_image_size( width, height, colours, subpixelorder );
+  Debug( 2, "Capturing planar YUV420P images of %d bytes", imagesize );
+  return true;
+}
+
+// Called for each decoded image, to find when the packet it came from
+// arrived, and to report how long a reconnect took to produce the first one
+void FfmpegCamera::FrameDecoded( const AVFrame *frame ) {
+  // The decoder may hold frames back, so the image isn't necessarily from
+  // the packet just read. Fall back to that if we can't match it up.
+  unsigned int last = (next_arrival+ARRIVAL_HISTORY-1) % ARRIVAL_HISTORY;
+  frame_arrival = packet_arrivals[last].time;
+  if ( frame->pts != AV_NOPTS_VALUE ) {
+    for ( unsigned int i = 0; i < ARRIVAL_HISTORY; i++ ) {
+      if ( packet_arrivals[i].pts == frame->pts ) {
+        frame_arrival = packet_arrivals[i].time;
+        break;
+      }
+    }
+  }
+
+  if ( !reconnect_start.tv_sec )
+    return;
+  unsigned int msec = tvDiffUsec( reconnect_start ) / 1000;
+  Info( "Reconnected to %s, first image after %u ms", mPath.c_str(), msec );
+  monitor->ReconnectDone( msec );
+  reconnect_start.tv_sec = 0;
+  reconnect_start.tv_usec = 0;
+} // end void FfmpegCamera::FrameDecoded( const AVFrame *frame )
+
+// Makes sure the conversion context matches what the decoder is producing,
+// keeping the existing one when it does
+bool FfmpegCamera::SetupConvertContext() {
+#if HAVE_LIBSWSCALE
+  if ( mConvertContext
+      && mConvertWidth == mVideoCodecContext->width
+      && mConvertHeight == mVideoCodecContext->height
+      && mConvertFormat == mVideoCodecContext->pix_fmt )
+    return true;
+
+  Debug(1, "Calling sws_isSupportedInput");
+  if ( !sws_isSupportedInput(mVideoCodecContext->pix_fmt) ) {
+    Error("swscale does not support the codec format: %c%c%c%c", (mVideoCodecContext->pix_fmt)&0xff, ((mVideoCodecContext->pix_fmt >> 8)&0xff), ((mVideoCodecContext->pix_fmt >> 16)&0xff), ((mVideoCodecContext->pix_fmt >> 24)&0xff));
+    return false;
+  }
+
+  if ( !sws_isSupportedOutput(imagePixFormat) ) {
+    Error("swscale does not support the target format: %c%c%c%c",(imagePixFormat)&0xff,((imagePixFormat>>8)&0xff),((imagePixFormat>>16)&0xff),((imagePixFormat>>24)&0xff));
+    return false;
+  }
+
+  mConvertContext = sws_getCachedContext(mConvertContext,
+      mVideoCodecContext->width,
+      mVideoCodecContext->height,
+      mVideoCodecContext->pix_fmt,
+      width, height,
+      imagePixFormat, SWS_BICUBIC, NULL,
+      NULL, NULL);
+  if ( mConvertContext == NULL ) {
+    Error( "Unable to create conversion context for %s", mPath.c_str() );
+    return false;
+  }
+  mConvertWidth = mVideoCodecContext->width;
+  mConvertHeight = mVideoCodecContext->height;
+  mConvertFormat = mVideoCodecContext->pix_fmt;
+  return true;
+#else // HAVE_LIBSWSCALE
+  Fatal( "You must compile ffmpeg with the --enable-swscale option to use ffmpeg cameras" );
+  return false;
+#endif // HAVE_LIBSWSCALE
+} // end bool FfmpegCamera::SetupConvertContext()
+
+// Returns whether this video packet should be sent to the decoder.  When no
+// attached process needs decoded images we only decode keyframes.  Full
+// decoding only resumes on a keyframe so that the decoder has its references.
+bool FfmpegCamera::ShouldDecode( bool keyframe ) {
+  if ( monitor->DecodingRequired() ) {
+    if ( !decoding_all_frames && keyframe ) {
+      Info("Decoded images are needed again, resuming decoding of all frames");
+      mVideoCodecContext->skip_frame = AVDISCARD_DEFAULT;
+      decoding_all_frames = true;
+    }
+  } else if ( decoding_all_frames ) {
+    Info("No process needs decoded images, only decoding keyframes");
+    mVideoCodecContext->skip_frame = AVDISCARD_NONKEY;
+    decoding_all_frames = false;
+  }
+  return decoding_all_frames || keyframe;
+} // end bool FfmpegCamera::ShouldDecode( bool keyframe )
+
+// Estimates how much of the scene changed in the frame we just decoded, without
+// looking at the pixels.  The motion vectors give us the fraction of the image
+// that moved.  Without them we fall back to how much bigger this predicted
+// frame is than those seen while the scene was static.
+void FfmpegCamera::UpdateActivity( const AVPacket *pkt, const AVFrame *frame ) {
+  if ( !config.motion_activity_floor ) {
+    activity = -1;
+    return;
+  }
+
+#if HAVE_MOTION_VECTORS
+  AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+  if ( sd ) {
+    const AVMotionVector *mvs = (const AVMotionVector *)sd->data;
+    unsigned int n_mvs = sd->size / sizeof(*mvs);
+    uint64_t moving_area = 0;
+    for ( unsigned int i = 0; i < n_mvs; i++ ) {
+      // Ignore single pixel jitter from sensor noise
+      if ( abs(mvs[i].dst_x - mvs[i].src_x) + abs(mvs[i].dst_y - mvs[i].src_y) > 1 )
+        moving_area += mvs[i].w * mvs[i].h;
+    }
+    uint64_t area = mVideoCodecContext->width * mVideoCodecContext->height;
+    activity = area ? (int)((moving_area * 100) / area) : -1;
+    if ( activity > 100 )
+      activity = 100;
+    Debug( 4, "Activity %d from %d motion vectors", activity, n_mvs );
+    return;
+  }
+#endif
+
+  // Keyframes say nothing about motion, so keep the last estimate
+  if ( pkt->flags & AV_PKT_FLAG_KEY )
+    return;
+
+  if ( !static_packet_size ) {
+    static_packet_size = pkt->size;
+    return;
+  }
+  if ( pkt->size < static_packet_size ) {
+    // Follow quiet scenes quickly
+    static_packet_size = ( static_packet_size*3 + pkt->size ) / 4;
+  } else {
+    // and only slowly adapt to noisier ones
+    static_packet_size = ( static_packet_size*255 + pkt->size ) / 256;
+  }
+  activity = (int)(( pkt->size - static_packet_size ) * 100 / static_packet_size);
+  if ( activity < 0 )
+    activity = 0;
+  else if ( activity > 100 )
+    activity = 100;
+  Debug( 4, "Activity %d from packet size %d, static size %.0f", activity, pkt->size, static_packet_size );
+} // end void FfmpegCamera::UpdateActivity( const AVPacket *pkt, const AVFrame *frame )
+
 //Function to handle capture and store
 int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event_file ) {
   if ( ! mCanCapture ) {
@@ -712,6 +1073,8 @@ int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event
       }
       return -1;
     }
+    if ( packet.stream_index == mVideoStreamId )
+      PacketArrived( &packet );
 
     int keyframe = packet.flags & AV_PKT_FLAG_KEY;
     dumpPacket(&packet);
@@ -790,7 +1153,7 @@ int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event
           ZMPacket *queued_packet;
 
           // Clear all packets that predate the moment when the recording began
-          packetqueue.clear_unwanted_packets( &recording, mVideoStreamId );
+          packetqueue.clear_unwanted_packets( &recording );
 
           while ( ( queued_packet = packetqueue.popPacket() ) ) {
             AVPacket *avp = queued_packet->av_packet();
@@ -810,7 +1173,6 @@ int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event
             if ( ret < 0 ) {
               //Less than zero and we skipped a frame
             }
-            delete queued_packet;
           } // end while packets in the packetqueue
           Debug(2, "Wrote %d queued packets", packet_count );
         }
@@ -831,7 +1193,7 @@ int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event
       if ( packet.stream_index == mVideoStreamId ) {
         if ( keyframe ) {
           Debug(3, "Clearing queue");
-          packetqueue.clearQueue( monitor->GetPreEventCount(), mVideoStreamId );
+          packetqueue.clearQueue( monitor->GetPreEventCount() );
           packetqueue.queuePacket( &packet );
         } else if ( packetqueue.size() ) {
           // it's a keyframe or we already have something in the queue
@@ -863,6 +1225,12 @@ int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event
         }
       } // end if keyframe or have_video_keyframe
 
+        if ( !ShouldDecode(keyframe) ) {
+          // Packet has been recorded, but nobody needs the decoded image
+          zm_av_packet_unref( &packet );
+          return 0;
+        }
+
         Debug(4, "about to decode video" );
 
 #if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
@@ -916,6 +1284,8 @@ int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event
 
         if ( frameComplete ) {
           Debug( 4, "Got frame %d", frameCount );
+          UpdateActivity( &packet, mRawFrame );
+          FrameDecoded( mRawFrame );
 
           uint8_t* directbuffer;
 
@@ -933,6 +1303,10 @@ int FfmpegCamera::CaptureAndRecord( Image &image, timeval recording, char* event
 #endif
 
 
+          if ( !SetupConvertContext() ) {
+            zm_av_packet_unref( &packet );
+            return -1;
+          }
           if (sws_scale(mConvertContext, mRawFrame->data, mRawFrame->linesize,
                 0, mVideoCodecContext->height, mFrame->data, mFrame->linesize) < 0) {
             Error("Unable to convert raw format %u to target format %u at frame %d",
@@ -74,8 +74,48 @@ class FfmpegCamera : public Camera {
     AVPacket packet;       
 
     int OpenFfmpeg();
+    int OpenVideoDecoder( AVDictionary *&opts );
     int Close();
+    void CloseDecoder();
     bool mCanCapture;
+
+#if LIBAVCODEC_VERSION_CHECK(57, 64, 0, 64, 0)
+    // Stream layout and codec parameters from the last successful open, so
+    // a reconnect can skip probing and keep the decoder if nothing changed
+    unsigned int        mCachedStreamCount;
+    int                 mCachedVideoStreamId;
+    int                 mCachedAudioStreamId;
+    AVCodecParameters   *mCachedVideoParams;
+    AVCodecParameters   *mCachedAudioParams;
+    bool UseCachedStreamInfo();
+    void CacheStreamInfo();
+#endif
+    struct timeval      reconnect_start;   // When the current reconnect began, zero once it has produced a frame
+    void FrameDecoded( const AVFrame *frame );
+
+    // Set by the low_latency monitor option, trades resilience to jitter and
+    // reordering for getting each frame out as soon as it arrives
+    bool mLowLatency;
+
+    // When recent video packets were read, to tell how long each frame took to come out of the decoder
+    struct PacketArrival {
+      int64_t pts;
+      struct timeval time;
+    };
+    static const unsigned int ARRIVAL_HISTORY = 16;
+    PacketArrival       packet_arrivals[ARRIVAL_HISTORY];
+    unsigned int        next_arrival;
+    struct timeval      frame_arrival;     // When the packets for the last decoded frame were read
+    void PacketArrived( const AVPacket *pkt );
+
+    // False while only keyframes are being decoded because nobody needs the images
+    bool decoding_all_frames;
+    bool ShouldDecode( bool keyframe );
+
+    // Compressed domain activity estimate of the last decoded frame
+    int activity;
+    double static_packet_size;  // Tracks the size of non-key packets while the scene is static
+    void UpdateActivity( const AVPacket *pkt, const AVFrame *frame );
 #endif // HAVE_LIBAVFORMAT
 
     VideoStore          *videoStore;
@@ -84,7 +124,12 @@ class FfmpegCamera : public Camera {
 
 #if HAVE_LIBSWSCALE
     struct SwsContext   *mConvertContext;
+    // Decoder output the conversion context was made for
+    int                 mConvertWidth;
+    int                 mConvertHeight;
+    int                 mConvertFormat;
 #endif
+    bool SetupConvertContext();
 
     int64_t             startTime;
 
@@ -104,6 +149,11 @@ class FfmpegCamera : public Camera {
     int Capture( Image &image );
     int CaptureAndRecord( Image &image, timeval recording, char* event_directory );
     int PostCapture();
+#if HAVE_LIBAVFORMAT
+    int Activity() const { return( activity ); }
+    bool CaptureArrival( struct timeval &p_arrival ) const;
+    bool CapturePlanarYUV();
+#endif // HAVE_LIBAVFORMAT
 };
 
 #endif // ZM_FFMPEG_CAMERA_H
@@ -0,0 +1,293 @@
+//
+// ZoneMinder HTTP Stream Parser Implementation, $Date$, $Revision$
+// Copyright (C) 2001-2008 Philip Coombes
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include "zm.h"
+#include "zm_http_parser.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+// Copies a header value, skipping leading spaces and stopping at the end of the line or the destination
+static void copy_value( char *dest, size_t dest_size, const char *value, const char *end ) {
+  while ( value < end && *value == ' ' )
+    value++;
+  size_t len = end - value;
+  if ( len >= dest_size )
+    len = dest_size - 1;
+  memcpy( dest, value, len );
+  dest[len] = '\0';
+}
+
+static bool header_is( const char *line, const char *end, const char *name, size_t name_len ) {
+  return( (size_t)(end - line) >= name_len && strncasecmp( line, name, name_len ) == 0 );
+}
+
+HttpParser::HttpParser() {
+  Reset();
+}
+
+void HttpParser::Reset() {
+  state = HEADER;
+  multipart = false;
+  delivered = false;
+  scan_offset = 0;
+  status = 0;
+  http11 = false;
+  connection[0] = '\0';
+  status_message[0] = '\0';
+  content_type[0] = '\0';
+  content_length = -1;
+  boundary[0] = '\0';
+  boundary_len = 0;
+  authenticate_header.clear();
+}
+
+// Returns the length of the header block at the head of the buffer, not
+// including the blank line ending it, or -1 if it isn't all there yet.
+int HttpParser::FindHeaderEnd( const Buffer &buffer, unsigned int &terminator_len ) {
+  const char *head = (const char *)buffer;
+  const char *end = head + buffer.size();
+  const char *ptr = head + scan_offset;
+
+  while ( ptr < end && (ptr = (const char *)memchr( ptr, '\n', end-ptr )) ) {
+    if ( ptr+1 >= end || ( ptr[1] == '\r' && ptr+2 >= end ) ) {
+      // Can't tell yet whether the next line is blank
+      break;
+    }
+    if ( ptr[1] == '\n' ) {
+      terminator_len = 2;
+      return( ptr - head );
+    }
+    if ( ptr[1] == '\r' && ptr[2] == '\n' ) {
+      terminator_len = 3;
+      return( ptr - head );
+    }
+    ptr++;
+  }
+  // Next time carry on from the last line end we couldn't decide on
+  scan_offset = ptr ? ptr - head : buffer.size();
+  return( -1 );
+}
+
+bool HttpParser::ParseHeaders( const char *headers, unsigned int length, bool subheaders ) {
+  static const char content_length_match[] = "Content-length:";
+  static const char content_type_match[] = "Content-type:";
+  static const char authenticate_match[] = "WWW-Authenticate:";
+  static const char connection_match[] = "Connection:";
+  static const char boundary_match[] = "boundary=";
+
+  const char *end = headers + length;
+  const char *line = headers;
+  bool first = true;
+  bool have_content_type = false;
+  bool have_content_length = false;
+
+  while ( line < end ) {
+    const char *line_end = (const char *)memchr( line, '\n', end-line );
+    if ( !line_end )
+      line_end = end;
+    const char *next = line_end+1;
+    if ( line_end > line && line_end[-1] == '\r' )
+      line_end--;
+
+    if ( first ) {
+      first = false;
+      if ( subheaders ) {
+        // The part must open with the boundary, which we store with a leading crlf
+        if ( !header_is( line, line_end, boundary+2, boundary_len-2 ) ) {
+          Error( "Expected boundary '%s' at start of part", boundary+2 );
+          return( false );
+        }
+        Debug( 4, "Got boundary" );
+      } else {
+        if ( !header_is( line, line_end, "HTTP/", 5 ) ) {
+          Error( "Unable to extract HTTP status from header" );
+          return( false );
+        }
+        const char *ptr = line + 5;
+        http11 = header_is( ptr, line_end, "1.1", 3 );
+        while ( ptr < line_end && *ptr != ' ' )
+          ptr++;
+        while ( ptr < line_end && *ptr == ' ' )
+          ptr++;
+        status = atoi( ptr );
+        while ( ptr < line_end && *ptr != ' ' )
+          ptr++;
+        copy_value( status_message, sizeof(status_message), ptr, line_end );
+        Debug( 3, "Got status '%d' (%s)", status, status_message );
+      }
+    } else if ( !have_content_length && header_is( line, line_end, content_length_match, sizeof(content_length_match)-1 ) ) {
+      char value[16];
+      copy_value( value, sizeof(value), line+sizeof(content_length_match)-1, line_end );
+      content_length = atoi( value );
+      have_content_length = true;
+      Debug( 4, "Got content length '%d'", content_length );
+    } else if ( !have_content_type && header_is( line, line_end, content_type_match, sizeof(content_type_match)-1 ) ) {
+      const char *value = line+sizeof(content_type_match)-1;
+      const char *semicolon = (const char *)memchr( value, ';', line_end-value );
+      copy_value( content_type, sizeof(content_type), value, semicolon ? semicolon : line_end );
+      have_content_type = true;
+      Debug( 4, "Got content type '%s'", content_type );
+
+      if ( semicolon && !subheaders ) {
+        const char *param = semicolon;
+        while ( param < line_end && ( *param == ';' || *param == ' ' ) )
+          param++;
+        if ( header_is( param, line_end, boundary_match, sizeof(boundary_match)-1 ) ) {
+          param += sizeof(boundary_match)-1;
+          if ( param < line_end && *param == '"' )
+            param++;
+          while ( param < line_end && *param == '-' )
+            param++;
+          const char *param_end = param;
+          while ( param_end < line_end && *param_end != '"' && *param_end != ';' && *param_end != ' ' )
+            param_end++;
+          if ( (size_t)(param_end-param) > sizeof(boundary)-5 ) {
+            Error( "Content boundary in '%s' is too long", content_type );
+            return( false );
+          }
+          boundary_len = snprintf( boundary, sizeof(boundary), "\r\n--%.*s", (int)(param_end-param), param );
+          Debug( 3, "Got content boundary '%s'", boundary+2 );
+        }
+      }
+    } else if ( !subheaders && header_is( line, line_end, connection_match, sizeof(connection_match)-1 ) ) {
+      copy_value( connection, sizeof(connection), line+sizeof(connection_match)-1, line_end );
+      Debug( 4, "Got connection '%s'", connection );
+    } else if ( !subheaders && header_is( line, line_end, authenticate_match, sizeof(authenticate_match)-1 ) ) {
+      authenticate_header.assign( line, line_end-line );
+      Debug( 4, "Got authenticate header '%s'", authenticate_header.c_str() );
+    }
+    line = next;
+  }
+  return( true );
+}
+
+HttpParser::Result HttpParser::Parse( Buffer &buffer ) {
+  if ( delivered ) {
+    // The caller has taken the last content
+    delivered = false;
+    content_length = -1;
+    content_type[0] = '\0';
+    scan_offset = 0;
+    if ( multipart ) {
+      state = SUBHEADER;
+    } else {
+      Reset();
+    }
+  }
+
+  while ( true ) {
+    switch ( state ) {
+      case HEADER :
+      case SUBHEADER :
+        {
+          if ( scan_offset == 0 ) {
+            // Drop the line end left over from the previous part or response
+            unsigned int skip = 0;
+            while ( skip < buffer.size() && ( buffer[skip] == '\r' || buffer[skip] == '\n' ) )
+              skip++;
+            if ( skip )
+              buffer.consume( skip );
+          }
+
+          unsigned int terminator_len = 0;
+          int header_len = FindHeaderEnd( buffer, terminator_len );
+          if ( header_len < 0 )
+            return( NEED_DATA );
+
+          bool subheaders = ( state == SUBHEADER );
+          bool parsed = ParseHeaders( (const char *)buffer, header_len, subheaders );
+          buffer.consume( header_len+terminator_len );
+          scan_offset = 0;
+          if ( !parsed )
+            return( FAILED );
+
+          if ( !subheaders ) {
+            if ( status == 401 )
+              return( AUTH_REQUIRED );
+            if ( status < 200 || status > 299 ) {
+              Error( "Invalid response status %d: %s", status, status_message );
+              return( FAILED );
+            }
+            if ( !strcasecmp( content_type, "multipart/x-mixed-replace" ) ) {
+              if ( !boundary_len ) {
+                Error( "No content boundary found in multipart response" );
+                return( FAILED );
+              }
+              multipart = true;
+              content_length = -1;
+              state = SUBHEADER;
+              break;
+            }
+          }
+          state = CONTENT;
+          break;
+        }
+      case CONTENT :
+        {
+          if ( content_length >= 0 ) {
+            if ( buffer.size() < (unsigned int)content_length )
+              return( NEED_DATA );
+            Debug( 3, "Got end of image by length, content-length = %d", content_length );
+          } else if ( multipart ) {
+            // Look for the next boundary, only in what we haven't searched yet
+            unsigned int start = scan_offset > boundary_len ? scan_offset - boundary_len : 0;
+            if ( start >= buffer.size() )
+              return( NEED_DATA );
+            const char *found = (const char *)memmem( (const char *)buffer+start, buffer.size()-start, boundary, boundary_len );
+            if ( !found ) {
+              scan_offset = buffer.size();
+              return( NEED_DATA );
+            }
+            content_length = found - (const char *)buffer;
+            Debug( 3, "Got end of image by boundary, content-length = %d", content_length );
+          } else {
+            // Single image of unknown length, read until the connection closes
+            return( NEED_DATA );
+          }
+          delivered = true;
+          return( HAVE_CONTENT );
+        }
+    }
+  }
+}
+
+HttpParser::Result HttpParser::Finish( Buffer &buffer ) {
+  if ( !AwaitingClose() )
+    return( FAILED );
+  content_length = buffer.size();
+  // Strip off any last line feeds
+  while ( content_length && ( buffer[content_length-1] == '\r' || buffer[content_length-1] == '\n' ) )
+    content_length--;
+  Debug( 2, "Got end of image by closure, content-length = %d", content_length );
+  // Nothing more can come on this connection
+  strcpy( connection, "close" );
+  delivered = true;
+  return( HAVE_CONTENT );
+}
+
+bool HttpParser::KeepAlive() const {
+  // Content delimited by closing the connection, or a stream, leaves nothing to reuse
+  if ( multipart || content_length < 0 || state != CONTENT )
+    return( false );
+  if ( http11 )
+    return( strcasecmp( connection, "close" ) != 0 );
+  return( strcasecmp( connection, "keep-alive" ) == 0 );
+}
@@ -0,0 +1,85 @@
+//
+// ZoneMinder HTTP Stream Parser Interface, $Date$, $Revision$
+// Copyright (C) 2001-2008 Philip Coombes
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#ifndef ZM_HTTP_PARSER_H
+#define ZM_HTTP_PARSER_H
+
+#include "zm_buffer.h"
+
+#include <string>
+
+//
+// Incremental parser for http image responses, either a single image or a
+// multipart/x-mixed-replace stream of them. It works in place on the
+// receive buffer, remembering how far it has searched so that each call
+// only looks at bytes which have arrived since the last one. When a part
+// is complete its content is left at the head of the buffer for the caller
+// to take, without being copied.
+//
+class HttpParser {
+public:
+  typedef enum { NEED_DATA, HAVE_CONTENT, AUTH_REQUIRED, FAILED } Result;
+
+protected:
+  enum { HEADER, SUBHEADER, CONTENT } state;
+  bool multipart;
+  bool delivered;               // Content has been handed to the caller, who consumes it
+  unsigned int scan_offset;     // How far from the head of the buffer we have already searched
+
+  int status;
+  bool http11;                  // Whether the response is HTTP/1.1, so persistent unless it says otherwise
+  char connection[32];
+  char status_message[128];
+  char content_type[64];
+  int content_length;           // -1 if not given
+  char boundary[80];            // Including the leading "\r\n--"
+  unsigned int boundary_len;
+  std::string authenticate_header;
+
+  int FindHeaderEnd( const Buffer &buffer, unsigned int &terminator_len );
+  bool ParseHeaders( const char *headers, unsigned int length, bool subheaders );
+
+public:
+  HttpParser();
+
+  // Start again with a new response
+  void Reset();
+
+  // Parse as much as possible of what is in the buffer. Response and part
+  // headers are consumed from it. On HAVE_CONTENT the content is at the head
+  // of the buffer and the caller is expected to consume ContentLength() bytes.
+  Result Parse( Buffer &buffer );
+  // The connection closed while reading content of unknown length, so
+  // everything left is the content.
+  Result Finish( Buffer &buffer );
+  // Whether only the connection closing can tell us the content is complete
+  bool AwaitingClose() const { return( state == CONTENT && !multipart && content_length < 0 ); }
+
+  bool Multipart() const { return( multipart ); }
+  int Status() const { return( status ); }
+  const char *StatusMessage() const { return( status_message ); }
+  const char *ContentType() const { return( content_type ); }
+  int ContentLength() const { return( content_length ); }
+  const std::string &AuthenticateHeader() const { return( authenticate_header ); }
+  // Whether the server will take another request on this connection
+  // once the current content has been consumed
+  bool KeepAlive() const;
+};
+
+#endif // ZM_HTTP_PARSER_H
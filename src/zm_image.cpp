@@ -23,6 +23,7 @@
 #include "zm_utils.h"
 #include "zm_rgb.h"
 #include "zm_ffmpeg.h"
+#include "zm_swscale.h"
 
 #include <sys/stat.h>
 #include <errno.h>
@@ -47,11 +48,10 @@ static short *g_v_table;
 static short *g_u_table;
 static short *b_u_table;
 
-jpeg_compress_struct *Image::writejpg_ccinfo[101] = { 0 };
-jpeg_compress_struct *Image::encodejpg_ccinfo[101] = { 0 };
-jpeg_decompress_struct *Image::readjpg_dcinfo = 0;
-jpeg_decompress_struct *Image::decodejpg_dcinfo = 0;
-struct zm_error_mgr Image::jpg_err;
+thread_local jpeg_compress_struct *Image::writejpg_ccinfo[101] = { 0 };
+thread_local jpeg_compress_struct *Image::encodejpg_ccinfo[101] = { 0 };
+thread_local jpeg_decompress_struct *Image::readjpg_dcinfo = 0;
+thread_local jpeg_decompress_struct *Image::decodejpg_dcinfo = 0;
 
 /* Pointer to blend function. */
 static blend_fptr_t fptr_blend;
@@ -75,6 +75,35 @@ static deinterlace_4field_fptr_t fptr_deinterlace_4field_gray8;
 /* Pointer to image buffer memory copy function */
 imgbufcpy_fptr_t fptr_imgbufcpy;
 
+/* Hands the planes of a YUV420P image to libjpeg as they are, saving it from converting and subsampling RGB.
+   Rows are read in whole blocks, so the width must be a multiple of 16. Rows past the bottom repeat the last one. */
+static void jpeg_write_yuv420p( struct jpeg_compress_struct *cinfo, const uint8_t *buffer, unsigned int width, unsigned int height ) {
+  const unsigned int chroma_width = (width+1)>>1;
+  const unsigned int chroma_height = (height+1)>>1;
+  const uint8_t *y_plane = buffer;
+  const uint8_t *u_plane = y_plane + (width*height);
+  const uint8_t *v_plane = u_plane + (chroma_width*chroma_height);
+
+  JSAMPROW y_rows[2*DCTSIZE];
+  JSAMPROW u_rows[DCTSIZE];
+  JSAMPROW v_rows[DCTSIZE];
+  JSAMPARRAY planes[3] = { y_rows, u_rows, v_rows };
+
+  while ( cinfo->next_scanline < cinfo->image_height ) {
+    unsigned int line = cinfo->next_scanline;
+    for ( unsigned int i = 0; i < 2*DCTSIZE; i++ ) {
+      unsigned int y = line+i < height ? line+i : height-1;
+      y_rows[i] = (JSAMPROW)&y_plane[y*width];
+    }
+    for ( unsigned int i = 0; i < DCTSIZE; i++ ) {
+      unsigned int y = (line>>1)+i < chroma_height ? (line>>1)+i : chroma_height-1;
+      u_rows[i] = (JSAMPROW)&u_plane[y*chroma_width];
+      v_rows[i] = (JSAMPROW)&v_plane[y*chroma_width];
+    }
+    jpeg_write_raw_data( cinfo, planes, 2*DCTSIZE );
+  }
+}
+
 Image::Image() {
   if ( !initialised )
     Initialise();
@@ -116,7 +145,7 @@ Image::Image( int p_width, int p_height, int p_colours, int p_subpixelorder, uin
   pixels = width*height;
   colours = p_colours;
   subpixelorder = p_subpixelorder;
-  size = pixels*colours;
+  size = zm_image_size(width, height, colours, subpixelorder);
   buffer = 0;
   holdbuffer = 0;
   if ( p_buffer ) {
@@ -202,24 +231,42 @@ void Image::Deinitialise() {
        delete[] b_u_table;
      */
     initialised = false;
-    if ( readjpg_dcinfo ) {
-      jpeg_destroy_decompress( readjpg_dcinfo );
-      delete readjpg_dcinfo;
-      readjpg_dcinfo = 0;
+    DeinitialiseThread();
+  }
+}
+
+/* Frees the JPEG structs cached by the calling thread, which should be done
+   by any thread other than the main one which reads or writes JPEGs */
+void Image::DeinitialiseThread() {
+  // The error managers the cached structs last used are gone
+  struct zm_error_mgr jpg_err;
+  jpeg_std_error( &jpg_err.pub );
+  if ( readjpg_dcinfo ) {
+    readjpg_dcinfo->err = &jpg_err.pub;
+    jpeg_destroy_decompress( readjpg_dcinfo );
+    delete readjpg_dcinfo;
+    readjpg_dcinfo = 0;
+  }
+  if ( decodejpg_dcinfo ) {
+    decodejpg_dcinfo->err = &jpg_err.pub;
+    jpeg_destroy_decompress( decodejpg_dcinfo );
+    delete decodejpg_dcinfo;
+    decodejpg_dcinfo = 0;
+  }
+  for ( unsigned int quality=0; quality <= 100; quality += 1 ) {
+    if ( writejpg_ccinfo[quality] ) {
+      writejpg_ccinfo[quality]->err = &jpg_err.pub;
+      jpeg_destroy_compress( writejpg_ccinfo[quality] );
+      delete writejpg_ccinfo[quality];
+      writejpg_ccinfo[quality] = NULL;
     }
-    if ( decodejpg_dcinfo ) {
-      jpeg_destroy_decompress( decodejpg_dcinfo );
-      delete decodejpg_dcinfo;
-      decodejpg_dcinfo = 0;
+    if ( encodejpg_ccinfo[quality] ) {
+      encodejpg_ccinfo[quality]->err = &jpg_err.pub;
+      jpeg_destroy_compress( encodejpg_ccinfo[quality] );
+      delete encodejpg_ccinfo[quality];
+      encodejpg_ccinfo[quality] = NULL;
     }
-    for ( unsigned int quality=0; quality <= 100; quality += 1 ) {
-      if ( writejpg_ccinfo[quality] ) {
-        jpeg_destroy_compress( writejpg_ccinfo[quality] );
-        delete writejpg_ccinfo[quality];
-        writejpg_ccinfo[quality] = NULL;
-      }
-    } // end foreach quality
-  }
+  } // end foreach quality
 }
 
 void Image::Initialise() {
@@ -470,7 +517,7 @@ uint8_t* Image::WriteBuffer(const unsigned int p_width, const unsigned int p_hei
   }
 
   if ( p_width != width || p_height != height || p_colours != colours || p_subpixelorder != subpixelorder ) {
-    unsigned int newsize = (p_width * p_height) * p_colours;
+    unsigned int newsize = zm_image_size(p_width, p_height, p_colours, p_subpixelorder);
 
     if ( buffer == NULL ) {
       AllocImgBuffer(newsize);
@@ -516,7 +563,7 @@ void Image::AssignDirect( const unsigned int p_width, const unsigned int p_heigh
     return;
   }
 
-  unsigned int new_buffer_size = ((p_width*p_height)*p_colours);
+  unsigned int new_buffer_size = zm_image_size(p_width, p_height, p_colours, p_subpixelorder);
 
   if ( buffer_size < new_buffer_size ) {
     Error("Attempt to directly assign buffer from an undersized buffer of size: %zu, needed %dx%d*%d colours = %zu",buffer_size, p_width, p_height, p_colours, new_buffer_size );
@@ -561,7 +608,7 @@ void Image::AssignDirect( const unsigned int p_width, const unsigned int p_heigh
 }
 
 void Image::Assign(const unsigned int p_width, const unsigned int p_height, const unsigned int p_colours, const unsigned int p_subpixelorder, const uint8_t* new_buffer, const size_t buffer_size) {
-  unsigned int new_size = (p_width * p_height) * p_colours;
+  unsigned int new_size = zm_image_size(p_width, p_height, p_colours, p_subpixelorder);
 
   if ( new_buffer == NULL ) {
     Error("Attempt to assign buffer from a NULL pointer");
@@ -611,7 +658,7 @@ void Image::Assign(const unsigned int p_width, const unsigned int p_height, cons
 }
 
 void Image::Assign( const Image &image ) {
-  unsigned int new_size = (image.width * image.height) * image.colours;
+  unsigned int new_size = zm_image_size(image.width, image.height, image.colours, image.subpixelorder);
 
   if ( image.buffer == NULL ) {
     Error("Attempt to assign image with an empty buffer");
@@ -797,15 +844,21 @@ bool Image::WriteRaw( const char *filename ) const {
 
 bool Image::ReadJpeg(const char *filename, unsigned int p_colours, unsigned int p_subpixelorder) {
   unsigned int new_width, new_height, new_colours, new_subpixelorder;
+  // Each call has its own error manager, as an error jumps back to
+  // whichever call set it up and other threads may be using libjpeg
+  struct zm_error_mgr jpg_err;
+  jpeg_std_error( &jpg_err.pub );
+  jpg_err.pub.error_exit = zm_jpeg_error_exit;
+  jpg_err.pub.emit_message = zm_jpeg_emit_message;
+
   struct jpeg_decompress_struct *cinfo = readjpg_dcinfo;
 
   if ( !cinfo ) {
     cinfo = readjpg_dcinfo = new jpeg_decompress_struct;
-    cinfo->err = jpeg_std_error(&jpg_err.pub);
-    jpg_err.pub.error_exit = zm_jpeg_error_exit;
-    jpg_err.pub.emit_message = zm_jpeg_emit_message;
+    cinfo->err = &jpg_err.pub;
     jpeg_create_decompress(cinfo);
   }
+  cinfo->err = &jpg_err.pub;
 
   FILE *infile;
   if ( (infile = fopen(filename, "rb")) == NULL ) {
@@ -941,28 +994,38 @@ bool Image::WriteJpeg(const char *filename, struct timeval timestamp) const {
 }
 
 bool Image::WriteJpeg( const char *filename, int quality_override, struct timeval timestamp  ) const {
-  if ( config.colour_jpeg_files && colours == ZM_COLOUR_GRAY8 ) {
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ? (width % 16) : (config.colour_jpeg_files && colours == ZM_COLOUR_GRAY8) ) {
     Image temp_image( *this );
     temp_image.Colourise( ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB );
     return temp_image.WriteJpeg(filename, quality_override, timestamp);
   }
   int quality = quality_override?quality_override:config.jpeg_file_quality;
 
+  struct zm_error_mgr jpg_err;
+  jpeg_std_error( &jpg_err.pub );
+  jpg_err.pub.error_exit = zm_jpeg_error_exit;
+  jpg_err.pub.emit_message = zm_jpeg_emit_message;
+
   struct jpeg_compress_struct *cinfo = writejpg_ccinfo[quality];
 
   if ( !cinfo ) {
     cinfo = writejpg_ccinfo[quality] = new jpeg_compress_struct;
-    cinfo->err = jpeg_std_error( &jpg_err.pub );
-    jpg_err.pub.error_exit = zm_jpeg_error_exit;
-    jpg_err.pub.emit_message = zm_jpeg_emit_message;
+    cinfo->err = &jpg_err.pub;
     jpeg_create_compress( cinfo );
   }
+  cinfo->err = &jpg_err.pub;
 
   FILE *outfile;
   if ( (outfile = fopen( filename, "wb" )) == NULL ) {
     Error( "Can't open %s: %s", filename, strerror(errno) );
     return( false );
   }
+  if ( setjmp( jpg_err.setjmp_buffer ) ) {
+    jpeg_abort_compress( cinfo );
+    fclose( outfile );
+    return( false );
+  }
+
   jpeg_stdio_dest( cinfo, outfile );
 
   cinfo->image_width = width;   /* image width and height, in pixels */
@@ -971,8 +1034,13 @@ bool Image::WriteJpeg( const char *filename, int quality_override, struct timeva
   switch(colours) {
     case ZM_COLOUR_GRAY8:
       {
-        cinfo->input_components = 1;
-        cinfo->in_color_space = JCS_GRAYSCALE;
+        if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ) {
+          cinfo->input_components = 3;
+          cinfo->in_color_space = JCS_YCbCr;
+        } else {
+          cinfo->input_components = 1;
+          cinfo->in_color_space = JCS_GRAYSCALE;
+        }
         break;
       }
     case ZM_COLOUR_RGB32:
@@ -1028,6 +1096,13 @@ cinfo->out_color_space = JCS_RGB;
   jpeg_set_defaults( cinfo );
   jpeg_set_quality( cinfo, quality, FALSE );
   cinfo->dct_method = JDCT_FASTEST;
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ) {
+    /* The default sampling for YCbCr is already 4:2:0 */
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+  }
 
   jpeg_start_compress( cinfo, TRUE );
   if ( config.add_jpeg_comments && text[0] ) {
@@ -1058,11 +1133,15 @@ cinfo->out_color_space = JCS_RGB;
     jpeg_write_marker( cinfo, EXIF_CODE, (const JOCTET *)exiftimes, sizeof(exiftimes) );
   }
 
-  JSAMPROW row_pointer;  /* pointer to a single row */
-  int row_stride = cinfo->image_width * colours; /* physical row width in buffer */
-  while ( cinfo->next_scanline < cinfo->image_height ) {
-    row_pointer = &buffer[cinfo->next_scanline * row_stride];
-    jpeg_write_scanlines( cinfo, &row_pointer, 1 );
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ) {
+    jpeg_write_yuv420p( cinfo, buffer, width, height );
+  } else {
+    JSAMPROW row_pointer;  /* pointer to a single row */
+    int row_stride = cinfo->image_width * colours; /* physical row width in buffer */
+    while ( cinfo->next_scanline < cinfo->image_height ) {
+      row_pointer = &buffer[cinfo->next_scanline * row_stride];
+      jpeg_write_scanlines( cinfo, &row_pointer, 1 );
+    }
   }
 
   jpeg_finish_compress(cinfo);
@@ -1075,16 +1154,20 @@ cinfo->out_color_space = JCS_RGB;
 bool Image::DecodeJpeg( const JOCTET *inbuffer, int inbuffer_size, unsigned int p_colours, unsigned int p_subpixelorder)
 {
   unsigned int new_width, new_height, new_colours, new_subpixelorder;
+  struct zm_error_mgr jpg_err;
+  jpeg_std_error( &jpg_err.pub );
+  jpg_err.pub.error_exit = zm_jpeg_error_exit;
+  jpg_err.pub.emit_message = zm_jpeg_emit_message;
+
   struct jpeg_decompress_struct *cinfo = decodejpg_dcinfo;
 
   if ( !cinfo )
   {
     cinfo = decodejpg_dcinfo = new jpeg_decompress_struct;
-    cinfo->err = jpeg_std_error( &jpg_err.pub );
-    jpg_err.pub.error_exit = zm_jpeg_error_exit;
-    jpg_err.pub.emit_message = zm_jpeg_emit_message;
+    cinfo->err = &jpg_err.pub;
     jpeg_create_decompress( cinfo );
   }
+  cinfo->err = &jpg_err.pub;
 
   if ( setjmp( jpg_err.setjmp_buffer ) )
   {
@@ -1200,7 +1283,7 @@ cinfo->out_color_space = JCS_RGB;
 
 bool Image::EncodeJpeg( JOCTET *outbuffer, int *outbuffer_size, int quality_override ) const
 {
-  if ( config.colour_jpeg_files && colours == ZM_COLOUR_GRAY8 )
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ? (width % 16) : (config.colour_jpeg_files && colours == ZM_COLOUR_GRAY8) )
   {
     Image temp_image( *this );
     temp_image.Colourise(ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB );
@@ -1209,16 +1292,26 @@ bool Image::EncodeJpeg( JOCTET *outbuffer, int *outbuffer_size, int quality_over
 
   int quality = quality_override?quality_override:config.jpeg_stream_quality;
 
+  struct zm_error_mgr jpg_err;
+  jpeg_std_error( &jpg_err.pub );
+  jpg_err.pub.error_exit = zm_jpeg_error_exit;
+  jpg_err.pub.emit_message = zm_jpeg_emit_message;
+
   struct jpeg_compress_struct *cinfo = encodejpg_ccinfo[quality];
 
   if ( !cinfo )
   {
     cinfo = encodejpg_ccinfo[quality] = new jpeg_compress_struct;
-    cinfo->err = jpeg_std_error( &jpg_err.pub );
-    jpg_err.pub.error_exit = zm_jpeg_error_exit;
-    jpg_err.pub.emit_message = zm_jpeg_emit_message;
+    cinfo->err = &jpg_err.pub;
     jpeg_create_compress( cinfo );
   }
+  cinfo->err = &jpg_err.pub;
+
+  if ( setjmp( jpg_err.setjmp_buffer ) )
+  {
+    jpeg_abort_compress( cinfo );
+    return( false );
+  }
 
   zm_jpeg_mem_dest( cinfo, outbuffer, outbuffer_size );
 
@@ -1228,8 +1321,13 @@ bool Image::EncodeJpeg( JOCTET *outbuffer, int *outbuffer_size, int quality_over
   switch(colours) {
     case ZM_COLOUR_GRAY8:
       {
-        cinfo->input_components = 1;
-        cinfo->in_color_space = JCS_GRAYSCALE;
+        if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ) {
+          cinfo->input_components = 3;
+          cinfo->in_color_space = JCS_YCbCr;
+        } else {
+          cinfo->input_components = 1;
+          cinfo->in_color_space = JCS_GRAYSCALE;
+        }
         break;
       }
     case ZM_COLOUR_RGB32:
@@ -1283,15 +1381,29 @@ cinfo->out_color_space = JCS_RGB;
   jpeg_set_defaults( cinfo );
   jpeg_set_quality( cinfo, quality, FALSE );
   cinfo->dct_method = JDCT_FASTEST;
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ) {
+    /* The default sampling for YCbCr is already 4:2:0 */
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+  }
 
   jpeg_start_compress( cinfo, TRUE );
 
-  JSAMPROW row_pointer;  /* pointer to a single row */
-  int row_stride = cinfo->image_width * colours; /* physical row width in buffer */
-  while ( cinfo->next_scanline < cinfo->image_height )
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+  {
+    jpeg_write_yuv420p( cinfo, buffer, width, height );
+  }
+  else
   {
-    row_pointer = &buffer[cinfo->next_scanline * row_stride];
-    jpeg_write_scanlines( cinfo, &row_pointer, 1 );
+    JSAMPROW row_pointer;  /* pointer to a single row */
+    int row_stride = cinfo->image_width * colours; /* physical row width in buffer */
+    while ( cinfo->next_scanline < cinfo->image_height )
+    {
+      row_pointer = &buffer[cinfo->next_scanline * row_stride];
+      jpeg_write_scanlines( cinfo, &row_pointer, 1 );
+    }
   }
 
   jpeg_finish_compress( cinfo );
@@ -1337,6 +1449,7 @@ bool Image::Crop( unsigned int lo_x, unsigned int lo_y, unsigned int hi_x, unsig
     Error( "Invalid or reversed crop region %d,%d -> %d,%d", lo_x, lo_y, hi_x, hi_y );
     return( false );
   }
+
   if ( hi_x > (width-1) || ( hi_y > (height-1) ) ) {
     Error( "Attempting to crop outside image, %d,%d -> %d,%d not in %d,%d", lo_x, lo_y, hi_x, hi_y, width-1, height-1 );
     return( false );
@@ -1346,6 +1459,10 @@ bool Image::Crop( unsigned int lo_x, unsigned int lo_y, unsigned int hi_x, unsig
     return( true );
   }
 
+  /* Only works on whole pixels, so planar images become RGB */
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+    Colourise( ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB );
+
   unsigned int new_size = new_width*new_height*colours;
   uint8_t *new_buffer = AllocBuffer(new_size);
 
@@ -1381,7 +1498,8 @@ void Image::Overlay( const Image &image )
 
   /* Grayscale ontop of grayscale - complete */
   if ( colours == ZM_COLOUR_GRAY8 && image.colours == ZM_COLOUR_GRAY8 ) {
-    const uint8_t* const max_ptr = buffer+size;
+    /* Just the Y plane if either is YUV420P */
+    const uint8_t* const max_ptr = buffer+pixels;
     const uint8_t* psrc = image.buffer;
     uint8_t* pdest = buffer;
 
@@ -1797,6 +1915,7 @@ void Image::Delta( const Image &image, Image* targetimage) const
         break;
       }
     case ZM_COLOUR_GRAY8:
+      /* Which for YUV420P is just the Y planes */
       (*fptr_delta8_gray8)(buffer, image.buffer, pdiff, pixels);
       break;
     default:
@@ -1843,8 +1962,8 @@ void Image::MaskPrivacy( const unsigned char *p_bitmask, const Rgb pixel_colour
   const uint8_t pixel_r_col = RED_VAL_RGBA(pixel_colour);
   const uint8_t pixel_g_col = GREEN_VAL_RGBA(pixel_colour);
   const uint8_t pixel_b_col = BLUE_VAL_RGBA(pixel_colour);
-  const uint8_t pixel_bw_col = pixel_colour & 0xff;
   const Rgb pixel_rgb_col = rgb_convert(pixel_colour,subpixelorder);
+  const uint8_t pixel_bw_col = subpixelorder == ZM_SUBPIX_ORDER_YUV420P ? pixel_rgb_col & 0xff : pixel_colour & 0xff;
 
   unsigned char *ptr = &buffer[0];
   unsigned int i = 0;
@@ -1888,6 +2007,29 @@ void Image::MaskPrivacy( const unsigned char *p_bitmask, const Rgb pixel_colour
     }
 
   }
+
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+  {
+    /* Mask the colour too, taking each chroma sample from its top left pixel */
+    const uint8_t pixel_u_col = (pixel_rgb_col>>8) & 0xff;
+    const uint8_t pixel_v_col = (pixel_rgb_col>>16) & 0xff;
+    unsigned int chroma_width = (width+1)>>1;
+    unsigned int chroma_height = (height+1)>>1;
+    unsigned char *u_ptr = &buffer[pixels];
+    unsigned char *v_ptr = u_ptr + (chroma_width*chroma_height);
+    for ( unsigned int y = 0; y < chroma_height; y++ )
+    {
+      const unsigned char *p_mask = &p_bitmask[(y<<1)*width];
+      for ( unsigned int x = 0; x < chroma_width; x++, u_ptr++, v_ptr++ )
+      {
+        if ( p_mask[x<<1] )
+        {
+          *u_ptr = pixel_u_col;
+          *v_ptr = pixel_v_col;
+        }
+      }
+    }
+  }
 }
 
 /* RGB32 compatible: complete */
@@ -2083,6 +2225,28 @@ void Image::Colourise(const unsigned int p_reqcolours, const unsigned int p_reqs
     return;
   }
 
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ) {
+    if ( p_reqcolours == ZM_COLOUR_GRAY8 ) {
+      DeColourise();
+      return;
+    }
+#if HAVE_LIBSWSCALE && HAVE_LIBAVUTIL
+    SWScale yuv_convert;
+    yuv_convert.init();
+    size_t new_size = pixels*p_reqcolours;
+    uint8_t *new_buffer = AllocBuffer(new_size);
+    if ( yuv_convert.Convert(buffer, size, new_buffer, new_size, AV_PIX_FMT_YUV420P, GetFFMPEGPixelFormat(p_reqcolours, p_reqsubpixelorder), width, height) < 0 ) {
+      Error("Failed converting YUV420P image to colours %u", p_reqcolours);
+      DumpBuffer(new_buffer, ZM_BUFTYPE_ZM);
+      return;
+    }
+    AssignDirect( width, height, p_reqcolours, p_reqsubpixelorder, new_buffer, new_size, ZM_BUFTYPE_ZM);
+#else
+    Error("Converting YUV420P images needs swscale");
+#endif
+    return;
+  }
+
   if ( p_reqcolours == ZM_COLOUR_RGB32 ) {
     /* RGB32 */
     Rgb* new_buffer = (Rgb*)AllocBuffer(pixels*sizeof(Rgb));
@@ -2137,6 +2301,13 @@ void Image::Colourise(const unsigned int p_reqcolours, const unsigned int p_reqs
 /* RGB32 compatible: complete */
 void Image::DeColourise()
 {
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P ) {
+    /* The Y plane already is the grayscale image */
+    subpixelorder = ZM_SUBPIX_ORDER_NONE;
+    size = pixels;
+    return;
+  }
+
   colours = ZM_COLOUR_GRAY8;
   subpixelorder = ZM_SUBPIX_ORDER_NONE;
   size = width * height;
@@ -2217,6 +2388,18 @@ void Image::Fill( Rgb colour, const Box *limits )
         *p = colour;
       }
     }
+    if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+    {
+      /* The chroma planes too, at half resolution */
+      unsigned int chroma_width = (width+1)>>1;
+      unsigned char *u_plane = &buffer[pixels];
+      unsigned char *v_plane = u_plane + (chroma_width*((height+1)>>1));
+      for ( unsigned int y = lo_y>>1; y <= (hi_y>>1); y++ )
+      {
+        memset( &u_plane[(y*chroma_width)+(lo_x>>1)], (colour>>8)&0xff, (hi_x>>1)-(lo_x>>1)+1 );
+        memset( &v_plane[(y*chroma_width)+(lo_x>>1)], (colour>>16)&0xff, (hi_x>>1)-(lo_x>>1)+1 );
+      }
+    }
   }
   else if ( colours == ZM_COLOUR_RGB24 )
   {
@@ -2583,6 +2766,10 @@ void Image::Rotate( int angle )
     return;
   }
 
+  /* Only works on whole pixels, so planar images become RGB */
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+    Colourise( ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB );
+
   unsigned int new_height = height;
   unsigned int new_width = width;
   uint8_t* rotate_buffer = AllocBuffer(size);
@@ -2700,6 +2887,10 @@ void Image::Rotate( int angle )
 
 /* RGB32 compatible: complete */
 void Image::Flip( bool leftright ) {
+  /* Only works on whole pixels, so planar images become RGB */
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+    Colourise( ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB );
+
   uint8_t* flip_buffer = AllocBuffer(size);
 
   unsigned int line_bytes = width*colours;
@@ -2782,6 +2973,10 @@ void Image::Scale( unsigned int factor )
     return;
   }
 
+  /* Only works on whole pixels, so planar images become RGB */
+  if ( subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+    Colourise( ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB );
+
   unsigned int new_width = (width*factor)/ZM_SCALE_BASE;
   unsigned int new_height = (height*factor)/ZM_SCALE_BASE;
 
@@ -3201,38 +3396,34 @@ __attribute__((noinline,__target__("sse2")))
 #endif
 void sse2_fastblend(const uint8_t* col1, const uint8_t* col2, uint8_t* result, unsigned long count, double blendpercent) {
 #if ((defined(__i386__) || defined(__x86_64__) || defined(ZM_KEEP_SSE)) && !defined(ZM_STRIP_SSE))  
-  static uint32_t divider = 0;
-  static uint32_t clearmask = 0;
-  static double current_blendpercent = 0.0;
-
-  if(current_blendpercent != blendpercent) {
-    /* Attempt to match the blending percent to one of the possible values */
-    if(blendpercent < 2.34375) {
-      // 1.5625% blending
-      divider = 6;
-      clearmask = 0x03030303;
-    } else if(blendpercent < 4.6875) {
-      // 3.125% blending
-      divider = 5;
-      clearmask = 0x07070707;
-    } else if(blendpercent < 9.375) {
-      // 6.25% blending
-      divider = 4;
-      clearmask = 0x0F0F0F0F;
-    } else if(blendpercent < 18.75) {
-      // 12.5% blending
-      divider = 3;
-      clearmask = 0x1F1F1F1F;
-    } else if(blendpercent < 37.5) {
-      // 25% blending
-      divider = 2;
-      clearmask = 0x3F3F3F3F;
-    } else {
-      // 50% blending
-      divider = 1;
-      clearmask = 0x7F7F7F7F;
-    }
-    current_blendpercent = blendpercent;
+  uint32_t divider = 0;
+  uint32_t clearmask = 0;
+
+  /* Attempt to match the blending percent to one of the possible values */
+  if(blendpercent < 2.34375) {
+    // 1.5625% blending
+    divider = 6;
+    clearmask = 0x03030303;
+  } else if(blendpercent < 4.6875) {
+    // 3.125% blending
+    divider = 5;
+    clearmask = 0x07070707;
+  } else if(blendpercent < 9.375) {
+    // 6.25% blending
+    divider = 4;
+    clearmask = 0x0F0F0F0F;
+  } else if(blendpercent < 18.75) {
+    // 12.5% blending
+    divider = 3;
+    clearmask = 0x1F1F1F1F;
+  } else if(blendpercent < 37.5) {
+    // 25% blending
+    divider = 2;
+    clearmask = 0x3F3F3F3F;
+  } else {
+    // 50% blending
+    divider = 1;
+    clearmask = 0x7F7F7F7F;
   }
 
   __asm__ __volatile__(
@@ -3265,32 +3456,28 @@ void sse2_fastblend(const uint8_t* col1, const uint8_t* col2, uint8_t* result, u
 }
 
 __attribute__((noinline)) void std_fastblend(const uint8_t* col1, const uint8_t* col2, uint8_t* result, unsigned long count, double blendpercent) {
-  static int divider = 0;
-  static double current_blendpercent = 0.0;
+  int divider = 0;
   const uint8_t* const max_ptr = result + count;
 
-  if(current_blendpercent != blendpercent) {
-    /* Attempt to match the blending percent to one of the possible values */
-    if(blendpercent < 2.34375) {
-      // 1.5625% blending
-      divider = 6;
-    } else if(blendpercent < 4.6875) {
-      // 3.125% blending
-      divider = 5;
-    } else if(blendpercent < 9.375) {
-      // 6.25% blending
-      divider = 4;
-    } else if(blendpercent < 18.75) {
-      // 12.5% blending
-      divider = 3;
-    } else if(blendpercent < 37.5) {
-      // 25% blending
-      divider = 2;
-    } else {
-      // 50% blending
-      divider = 1;
-    }
-    current_blendpercent = blendpercent;
+  /* Attempt to match the blending percent to one of the possible values */
+  if(blendpercent < 2.34375) {
+    // 1.5625% blending
+    divider = 6;
+  } else if(blendpercent < 4.6875) {
+    // 3.125% blending
+    divider = 5;
+  } else if(blendpercent < 9.375) {
+    // 6.25% blending
+    divider = 4;
+  } else if(blendpercent < 18.75) {
+    // 12.5% blending
+    divider = 3;
+  } else if(blendpercent < 37.5) {
+    // 25% blending
+    divider = 2;
+  } else {
+    // 50% blending
+    divider = 1;
   }
 
 
@@ -3324,34 +3511,30 @@ __attribute__((noinline,__target__("fpu=neon")))
 #endif
 void neon32_armv7_fastblend(const uint8_t* col1, const uint8_t* col2, uint8_t* result, unsigned long count, double blendpercent) {
 #if (defined(__arm__) && !defined(ZM_STRIP_NEON))
-  static int8_t divider = 0;
-  static double current_blendpercent = 0.0;
-
-  if(current_blendpercent != blendpercent) {
-    /* Attempt to match the blending percent to one of the possible values */
-    if(blendpercent < 2.34375) {
-      // 1.5625% blending
-      divider = 6;
-    } else if(blendpercent >= 2.34375 && blendpercent < 4.6875) {
-      // 3.125% blending
-      divider = 5;
-    } else if(blendpercent >= 4.6875 && blendpercent < 9.375) {
-      // 6.25% blending
-      divider = 4;
-    } else if(blendpercent >= 9.375 && blendpercent < 18.75) {
-      // 12.5% blending
-      divider = 3;
-    } else if(blendpercent >= 18.75 && blendpercent < 37.5) {
-      // 25% blending
-      divider = 2;
-    } else if(blendpercent >= 37.5) {
-      // 50% blending
-      divider = 1;
-    }
-    // We only have instruction to shift left by a variable, going negative shifts right :)
-    divider *= -1;
-    current_blendpercent = blendpercent;
-  }
+  int8_t divider = 0;
+
+  /* Attempt to match the blending percent to one of the possible values */
+  if(blendpercent < 2.34375) {
+    // 1.5625% blending
+    divider = 6;
+  } else if(blendpercent >= 2.34375 && blendpercent < 4.6875) {
+    // 3.125% blending
+    divider = 5;
+  } else if(blendpercent >= 4.6875 && blendpercent < 9.375) {
+    // 6.25% blending
+    divider = 4;
+  } else if(blendpercent >= 9.375 && blendpercent < 18.75) {
+    // 12.5% blending
+    divider = 3;
+  } else if(blendpercent >= 18.75 && blendpercent < 37.5) {
+    // 25% blending
+    divider = 2;
+  } else if(blendpercent >= 37.5) {
+    // 50% blending
+    divider = 1;
+  }
+  // We only have instruction to shift left by a variable, going negative shifts right :)
+  divider *= -1;
 
   /* Q0(D0,D1)    = col1+0 */
   /* Q1(D2,D3)    = col1+16 */
@@ -3405,34 +3588,30 @@ void neon32_armv7_fastblend(const uint8_t* col1, const uint8_t* col2, uint8_t* r
 
 __attribute__((noinline)) void neon64_armv8_fastblend(const uint8_t* col1, const uint8_t* col2, uint8_t* result, unsigned long count, double blendpercent) {
 #if (defined(__aarch64__) && !defined(ZM_STRIP_NEON))
-  static int8_t divider = 0;
-  static double current_blendpercent = 0.0;
-
-  if(current_blendpercent != blendpercent) {
-    /* Attempt to match the blending percent to one of the possible values */
-    if(blendpercent < 2.34375) {
-      // 1.5625% blending
-      divider = 6;
-    } else if(blendpercent >= 2.34375 && blendpercent < 4.6875) {
-      // 3.125% blending
-      divider = 5;
-    } else if(blendpercent >= 4.6875 && blendpercent < 9.375) {
-      // 6.25% blending
-      divider = 4;
-    } else if(blendpercent >= 9.375 && blendpercent < 18.75) {
-      // 12.5% blending
-      divider = 3;
-    } else if(blendpercent >= 18.75 && blendpercent < 37.5) {
-      // 25% blending
-      divider = 2;
-    } else if(blendpercent >= 37.5) {
-      // 50% blending
-      divider = 1;
-    }
-    // We only have instruction to shift left by a variable, going negative shifts right :)
-    divider *= -1;
-    current_blendpercent = blendpercent;
-  }
+  int8_t divider = 0;
+
+  /* Attempt to match the blending percent to one of the possible values */
+  if(blendpercent < 2.34375) {
+    // 1.5625% blending
+    divider = 6;
+  } else if(blendpercent >= 2.34375 && blendpercent < 4.6875) {
+    // 3.125% blending
+    divider = 5;
+  } else if(blendpercent >= 4.6875 && blendpercent < 9.375) {
+    // 6.25% blending
+    divider = 4;
+  } else if(blendpercent >= 9.375 && blendpercent < 18.75) {
+    // 12.5% blending
+    divider = 3;
+  } else if(blendpercent >= 18.75 && blendpercent < 37.5) {
+    // 25% blending
+    divider = 2;
+  } else if(blendpercent >= 37.5) {
+    // 50% blending
+    divider = 1;
+  }
+  // We only have instruction to shift left by a variable, going negative shifts right :)
+  divider *= -1;
 
   /* V16 = col1+0     */
   /* V17 = col1+16    */
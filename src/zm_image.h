@@ -132,11 +132,11 @@ protected:
 	static unsigned char *y_r_table;
 	static unsigned char *y_g_table;
 	static unsigned char *y_b_table;
-	static jpeg_compress_struct *writejpg_ccinfo[101];
-	static jpeg_compress_struct *encodejpg_ccinfo[101];
-	static jpeg_decompress_struct *readjpg_dcinfo;
-	static jpeg_decompress_struct *decodejpg_dcinfo;
-	static struct zm_error_mgr jpg_err;
+	// Cached per thread, as several threads may be reading and writing JPEGs
+	static thread_local jpeg_compress_struct *writejpg_ccinfo[101];
+	static thread_local jpeg_compress_struct *encodejpg_ccinfo[101];
+	static thread_local jpeg_decompress_struct *readjpg_dcinfo;
+	static thread_local jpeg_decompress_struct *decodejpg_dcinfo;
 
 	unsigned int width;
 	unsigned int height;
@@ -159,6 +159,7 @@ public:
 	~Image();
 	static void Initialise();
 	static void Deinitialise();
+	static void DeinitialiseThread();
 
 	inline unsigned int Width() const { return( width ); }
 	inline unsigned int Height() const { return( height ); }
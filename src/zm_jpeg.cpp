@@ -32,13 +32,13 @@ static int jpeg_err_count = 0;
 
 void zm_jpeg_error_exit( j_common_ptr cinfo )
 {
-  static char buffer[JMSG_LENGTH_MAX];
+  char buffer[JMSG_LENGTH_MAX];
   zm_error_ptr zmerr = (zm_error_ptr)cinfo->err;
 
   (zmerr->pub.format_message)( cinfo, buffer ); 
 
   Error( "%s", buffer );
-  if ( ++jpeg_err_count == MAX_JPEG_ERRS )
+  if ( __sync_add_and_fetch( &jpeg_err_count, 1 ) == MAX_JPEG_ERRS )
   {
     Fatal( "Maximum number (%d) of JPEG errors reached, exiting", jpeg_err_count );
   }
@@ -48,7 +48,7 @@ void zm_jpeg_error_exit( j_common_ptr cinfo )
 
 void zm_jpeg_emit_message( j_common_ptr cinfo, int msg_level )
 {
-  static char buffer[JMSG_LENGTH_MAX];
+  char buffer[JMSG_LENGTH_MAX];
   zm_error_ptr zmerr = (zm_error_ptr)cinfo->err;
 
   if ( msg_level < 0 )
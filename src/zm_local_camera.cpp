@@ -313,6 +313,16 @@ LocalCamera::LocalCamera(
   channel_index( 0 ),
   extras ( p_extras )
 {
+  captured_jpeg = NULL;
+  captured_jpeg_size = 0;
+#if ZM_HAS_V4L2
+  shared_buffers = NULL;
+  shared_buffer_count = 0;
+  v4l2_userptr = false;
+  next_shared_buffer = 0;
+  shared_buffer_drifted = false;
+#endif // ZM_HAS_V4L2
+
   // If we are the first, or only, input on this device then
   // do the initial opening etc
   device_prime = (camera_count++ == 0);
@@ -813,88 +823,24 @@ void LocalCamera::Initialise()
       }
     }
 
-    Debug( 3, "Setting up request buffers" );
-
-    memset( &v4l2_data.reqbufs, 0, sizeof(v4l2_data.reqbufs) );
-    if ( channel_count > 1 ) {
-      Debug( 3, "Channel count is %d", channel_count );
-      if ( v4l_multi_buffer ){
-        v4l2_data.reqbufs.count = 2*channel_count;
+    bool userptr = false;
+    if ( shared_buffers ) {
+      if ( conversion_type != 0 ) {
+        Debug( 2, "Not capturing into shared memory, captured frames need converting" );
+      } else if ( camera_count > 1 || channel_count > 1 ) {
+        Debug( 2, "Not capturing into shared memory, device is shared by %d monitors", camera_count );
+      } else if ( v4l2_data.fmt.fmt.pix.sizeimage > imagesize ) {
+        Debug( 2, "Not capturing into shared memory, device frame size %d is bigger than image size %d", v4l2_data.fmt.fmt.pix.sizeimage, imagesize );
       } else {
-        v4l2_data.reqbufs.count = 1;
-      }
-    } else {
-      v4l2_data.reqbufs.count = 8;
-    }
-    Debug( 3, "Request buffers count is %d", v4l2_data.reqbufs.count );
-
-    v4l2_data.reqbufs.type = v4l2_data.fmt.type;
-    v4l2_data.reqbufs.memory = V4L2_MEMORY_MMAP;
-
-    if ( vidioctl( vid_fd, VIDIOC_REQBUFS, &v4l2_data.reqbufs ) < 0 )
-    {
-      if ( errno == EINVAL )
-      {
-        Fatal( "Unable to initialise memory mapping, unsupported in device" );
-      }
-      else
-      {
-        Fatal( "Unable to initialise memory mapping: %s", strerror(errno) );
+        userptr = true;
       }
     }
-
-    if ( v4l2_data.reqbufs.count < (v4l_multi_buffer?2:1) )
-      Fatal( "Insufficient buffer memory %d on video device", v4l2_data.reqbufs.count );
-
-    Debug( 3, "Setting up data buffers: Channels %d MultiBuffer %d Buffers: %d", channel_count, v4l_multi_buffer, v4l2_data.reqbufs.count );
-
-    v4l2_data.buffers = new V4L2MappedBuffer[v4l2_data.reqbufs.count];
-#if HAVE_LIBSWSCALE
-    capturePictures = new AVFrame *[v4l2_data.reqbufs.count];
-#endif // HAVE_LIBSWSCALE
-    for ( unsigned int i = 0; i < v4l2_data.reqbufs.count; i++ )
-    {
-      struct v4l2_buffer vid_buf;
-
-      memset( &vid_buf, 0, sizeof(vid_buf) );
-
-      //vid_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      vid_buf.type = v4l2_data.fmt.type;
-      //vid_buf.memory = V4L2_MEMORY_MMAP;
-      vid_buf.memory = v4l2_data.reqbufs.memory;
-      vid_buf.index = i;
-
-      if ( vidioctl( vid_fd, VIDIOC_QUERYBUF, &vid_buf ) < 0 )
-        Fatal( "Unable to query video buffer: %s", strerror(errno) );
-
-      v4l2_data.buffers[i].length = vid_buf.length;
-      v4l2_data.buffers[i].start = mmap( NULL, vid_buf.length, PROT_READ|PROT_WRITE, MAP_SHARED, vid_fd, vid_buf.m.offset );
-
-      if ( v4l2_data.buffers[i].start == MAP_FAILED )
-        Fatal( "Can't map video buffer %u (%u bytes) to memory: %s(%d)", i, vid_buf.length, strerror(errno), errno );
-
-#if HAVE_LIBSWSCALE
-#if LIBAVCODEC_VERSION_CHECK(55, 28, 1, 45, 101)
-      capturePictures[i] = av_frame_alloc();
-#else
-      capturePictures[i] = avcodec_alloc_frame();
-#endif
-      if ( !capturePictures[i] )
-        Fatal( "Could not allocate picture" );
-#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
-      av_image_fill_arrays(capturePictures[i]->data,
-          capturePictures[i]->linesize,
-          (uint8_t*)v4l2_data.buffers[i].start,capturePixFormat,
-          v4l2_data.fmt.fmt.pix.width,
-          v4l2_data.fmt.fmt.pix.height, 1);
-#else
-      avpicture_fill( (AVPicture *)capturePictures[i],
-          (uint8_t*)v4l2_data.buffers[i].start, capturePixFormat,
-          v4l2_data.fmt.fmt.pix.width,
-          v4l2_data.fmt.fmt.pix.height );
-#endif
-#endif // HAVE_LIBSWSCALE
+    if ( userptr && !RequestV4L2Buffers( true ) ) {
+      Info( "Device %s can't capture into user memory, falling back to copying frames", device.c_str() );
+      userptr = false;
     }
+    if ( !userptr )
+      RequestV4L2Buffers( false );
 
     Debug( 3, "Configuring video source" );
 
@@ -1111,6 +1057,223 @@ void LocalCamera::Initialise()
 #endif // ZM_HAS_V4L1
 }
 
+#if ZM_HAS_V4L2
+// Sets up the buffers the driver captures into. Normally these are mapped
+// from the device and each frame is copied out into the image ring. With
+// userptr the ring slots themselves are handed to the driver instead.
+bool LocalCamera::RequestV4L2Buffers( bool userptr ) {
+  Debug( 3, "Setting up request buffers" );
+
+  memset( &v4l2_data.reqbufs, 0, sizeof(v4l2_data.reqbufs) );
+  if ( channel_count > 1 ) {
+    Debug( 3, "Channel count is %d", channel_count );
+    if ( v4l_multi_buffer ){
+      v4l2_data.reqbufs.count = 2*channel_count;
+    } else {
+      v4l2_data.reqbufs.count = 1;
+    }
+  } else {
+    v4l2_data.reqbufs.count = 8;
+  }
+  if ( userptr ) {
+    // Keep enough of the ring out of the driver's hands for readers and the pre-event buffer
+    v4l2_data.reqbufs.count = shared_buffer_count/4;
+    if ( v4l2_data.reqbufs.count > V4L2_USERPTR_BUFFERS )
+      v4l2_data.reqbufs.count = V4L2_USERPTR_BUFFERS;
+    if ( v4l2_data.reqbufs.count < 2 ) {
+      Debug( 2, "Image buffer of %d is too small to capture into", shared_buffer_count );
+      return( false );
+    }
+  }
+  Debug( 3, "Request buffers count is %d", v4l2_data.reqbufs.count );
+
+  v4l2_data.reqbufs.type = v4l2_data.fmt.type;
+  v4l2_data.reqbufs.memory = userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+
+  if ( vidioctl( vid_fd, VIDIOC_REQBUFS, &v4l2_data.reqbufs ) < 0 )
+  {
+    if ( userptr )
+    {
+      Debug( 2, "Unable to request user pointer buffers: %s", strerror(errno) );
+      return( false );
+    }
+    if ( errno == EINVAL )
+    {
+      Fatal( "Unable to initialise memory mapping, unsupported in device" );
+    }
+    else
+    {
+      Fatal( "Unable to initialise memory mapping: %s", strerror(errno) );
+    }
+  }
+
+  if ( userptr && v4l2_data.reqbufs.count < 2 )
+  {
+    Debug( 2, "Device only gave us %d user pointer buffers", v4l2_data.reqbufs.count );
+    v4l2_data.reqbufs.count = 0;
+    vidioctl( vid_fd, VIDIOC_REQBUFS, &v4l2_data.reqbufs );
+    return( false );
+  }
+  if ( v4l2_data.reqbufs.count < (v4l_multi_buffer?2:1) )
+    Fatal( "Insufficient buffer memory %d on video device", v4l2_data.reqbufs.count );
+
+  Debug( 3, "Setting up data buffers: Channels %d MultiBuffer %d Buffers: %d", channel_count, v4l_multi_buffer, v4l2_data.reqbufs.count );
+
+  v4l2_data.buffers = new V4L2MappedBuffer[v4l2_data.reqbufs.count];
+#if HAVE_LIBSWSCALE
+  capturePictures = new AVFrame *[v4l2_data.reqbufs.count];
+#endif // HAVE_LIBSWSCALE
+  for ( unsigned int i = 0; i < v4l2_data.reqbufs.count; i++ )
+  {
+#if HAVE_LIBSWSCALE
+#if LIBAVCODEC_VERSION_CHECK(55, 28, 1, 45, 101)
+    capturePictures[i] = av_frame_alloc();
+#else
+    capturePictures[i] = avcodec_alloc_frame();
+#endif
+    if ( !capturePictures[i] )
+      Fatal( "Could not allocate picture" );
+#endif // HAVE_LIBSWSCALE
+
+    if ( userptr ) {
+      // The ring slot is picked each time the buffer is queued
+      v4l2_data.buffers[i].start = NULL;
+      v4l2_data.buffers[i].length = imagesize;
+      continue;
+    }
+
+    struct v4l2_buffer vid_buf;
+
+    memset( &vid_buf, 0, sizeof(vid_buf) );
+
+    //vid_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vid_buf.type = v4l2_data.fmt.type;
+    //vid_buf.memory = V4L2_MEMORY_MMAP;
+    vid_buf.memory = v4l2_data.reqbufs.memory;
+    vid_buf.index = i;
+
+    if ( vidioctl( vid_fd, VIDIOC_QUERYBUF, &vid_buf ) < 0 )
+      Fatal( "Unable to query video buffer: %s", strerror(errno) );
+
+    v4l2_data.buffers[i].length = vid_buf.length;
+    v4l2_data.buffers[i].start = mmap( NULL, vid_buf.length, PROT_READ|PROT_WRITE, MAP_SHARED, vid_fd, vid_buf.m.offset );
+
+    if ( v4l2_data.buffers[i].start == MAP_FAILED )
+      Fatal( "Can't map video buffer %u (%u bytes) to memory: %s(%d)", i, vid_buf.length, strerror(errno), errno );
+
+#if HAVE_LIBSWSCALE
+#if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
+    av_image_fill_arrays(capturePictures[i]->data,
+        capturePictures[i]->linesize,
+        (uint8_t*)v4l2_data.buffers[i].start,capturePixFormat,
+        v4l2_data.fmt.fmt.pix.width,
+        v4l2_data.fmt.fmt.pix.height, 1);
+#else
+    avpicture_fill( (AVPicture *)capturePictures[i],
+        (uint8_t*)v4l2_data.buffers[i].start, capturePixFormat,
+        v4l2_data.fmt.fmt.pix.width,
+        v4l2_data.fmt.fmt.pix.height );
+#endif
+#endif // HAVE_LIBSWSCALE
+  }
+
+  v4l2_userptr = userptr;
+  if ( userptr )
+    Info( "Capturing directly into shared memory using %d buffers", v4l2_data.reqbufs.count );
+  return( true );
+} // end bool LocalCamera::RequestV4L2Buffers( bool userptr )
+
+// Queues every buffer ready for capture. Only fails, rather than being fatal,
+// when capturing into the image ring so that we can fall back to copying.
+bool LocalCamera::QueueV4L2Buffers() {
+  Debug( 3, "Queueing buffers" );
+  // Buffers come back in the order they are queued, so start from the slot
+  // the monitor will write next and stay in step with it from there on.
+  next_shared_buffer = monitor ? monitor->NextWriteIndex() : 0;
+  for ( unsigned int frame = 0; frame < v4l2_data.reqbufs.count; frame++ ) {
+    struct v4l2_buffer vid_buf;
+
+    memset( &vid_buf, 0, sizeof(vid_buf) );
+
+    vid_buf.type = v4l2_data.fmt.type;
+    vid_buf.memory = v4l2_data.reqbufs.memory;
+    vid_buf.index = frame;
+    if ( v4l2_userptr )
+      SetSharedBuffer( vid_buf );
+
+    if ( vidioctl( vid_fd, VIDIOC_QBUF, &vid_buf ) < 0 ) {
+      if ( !v4l2_userptr )
+        Fatal( "Failed to queue buffer %d: %s", frame, strerror(errno) );
+      Warning( "Failed to queue shared memory buffer %d: %s", frame, strerror(errno) );
+      return( false );
+    }
+  }
+  return( true );
+}
+
+// Points a driver buffer at the next ring slot, which is the slot the
+// monitor will be writing when the buffer comes back.
+void LocalCamera::SetSharedBuffer( struct v4l2_buffer &vid_buf ) {
+  unsigned int slot = next_shared_buffer % shared_buffer_count;
+  next_shared_buffer = (slot+1) % shared_buffer_count;
+  uint8_t *slot_buffer = shared_buffers + ((size_t)slot*imagesize);
+
+  vid_buf.m.userptr = (unsigned long)slot_buffer;
+  vid_buf.length = imagesize;
+  v4l2_data.buffers[vid_buf.index].start = slot_buffer;
+  Debug( 4, "Handing ring slot %d to buffer %d", slot, vid_buf.index );
+}
+
+// Once the driver and the ring have got out of step every frame would need
+// copying anyway, so go back to mapped buffers and stay there. Clearing
+// shared_buffers stops a later Initialise from trying user memory again.
+void LocalCamera::StopSharedBuffers() {
+  Warning( "Device %s is no longer filling the ring slot being written, falling back to copying frames", device.c_str() );
+  enum v4l2_buf_type type = (v4l2_buf_type)v4l2_data.fmt.type;
+  if ( vidioctl( vid_fd, VIDIOC_STREAMOFF, &type ) < 0 )
+    Error( "Failed to stop capture stream: %s", strerror(errno) );
+
+  ReleaseV4L2Buffers();
+  shared_buffers = NULL;
+  shared_buffer_count = 0;
+  shared_buffer_drifted = false;
+  RequestV4L2Buffers( false );
+  QueueV4L2Buffers();
+  v4l2_data.bufptr = NULL;
+
+  if ( vidioctl( vid_fd, VIDIOC_STREAMON, &type ) < 0 )
+    Fatal( "Failed to start capture stream: %s", strerror(errno) );
+}
+
+void LocalCamera::ReleaseV4L2Buffers() {
+  Debug( 3, "Releasing video buffers" );
+  for ( unsigned int i = 0; v4l2_data.buffers && i < v4l2_data.reqbufs.count; i++ ) {
+#if HAVE_LIBSWSCALE
+    /* Free capture pictures */
+#if LIBAVCODEC_VERSION_CHECK(55, 28, 1, 45, 101)
+    av_frame_free(&capturePictures[i]);
+#else
+    av_freep(&capturePictures[i]);
+#endif
+#endif
+    if ( !v4l2_userptr && munmap(v4l2_data.buffers[i].start, v4l2_data.buffers[i].length) < 0 )
+      Error("Failed to munmap buffer %d: %s", i, strerror(errno));
+  }
+#if HAVE_LIBSWSCALE
+  delete[] capturePictures;
+  capturePictures = 0;
+#endif
+  delete[] v4l2_data.buffers;
+  v4l2_data.buffers = NULL;
+
+  // Hand the buffers back to the driver so that the memory type can be changed
+  v4l2_data.reqbufs.count = 0;
+  if ( vidioctl( vid_fd, VIDIOC_REQBUFS, &v4l2_data.reqbufs ) < 0 )
+    Debug( 2, "Failed to release video buffers: %s", strerror(errno) );
+  v4l2_userptr = false;
+} // end void LocalCamera::ReleaseV4L2Buffers()
+#endif // ZM_HAS_V4L2
+
 void LocalCamera::Terminate() {
 #if ZM_HAS_V4L2
   if ( v4l_version == 2 ) {
@@ -1121,19 +1284,7 @@ void LocalCamera::Terminate() {
     if ( vidioctl(vid_fd, VIDIOC_STREAMOFF, &type) < 0 )
       Error("Failed to stop capture stream: %s", strerror(errno));
 
-    Debug(3, "Unmapping video buffers");
-    for ( unsigned int i = 0; i < v4l2_data.reqbufs.count; i++ ) {
-#if HAVE_LIBSWSCALE
-      /* Free capture pictures */
-#if LIBAVCODEC_VERSION_CHECK(55, 28, 1, 45, 101)
-      av_frame_free(&capturePictures[i]);
-#else
-      av_freep(&capturePictures[i]);
-#endif
-#endif
-      if ( munmap(v4l2_data.buffers[i].start, v4l2_data.buffers[i].length) < 0 )
-        Error("Failed to munmap buffer %d: %s", i, strerror(errno));
-    }
+    ReleaseV4L2Buffers();
   } else
 #endif // ZM_HAS_V4L2
 
@@ -1986,18 +2137,12 @@ int LocalCamera::PrimeCapture() {
   Debug( 2, "Priming capture" );
 #if ZM_HAS_V4L2
   if ( v4l_version == 2 ) {
-    Debug( 3, "Queueing buffers" );
-    for ( unsigned int frame = 0; frame < v4l2_data.reqbufs.count; frame++ ) {
-      struct v4l2_buffer vid_buf;
-
-      memset( &vid_buf, 0, sizeof(vid_buf) );
-
-      vid_buf.type = v4l2_data.fmt.type;
-      vid_buf.memory = v4l2_data.reqbufs.memory;
-      vid_buf.index = frame;
-
-      if ( vidioctl( vid_fd, VIDIOC_QBUF, &vid_buf ) < 0 )
-        Fatal( "Failed to queue buffer %d: %s", frame, strerror(errno) );
+    if ( !QueueV4L2Buffers() ) {
+      // Some drivers only find out at this point that they can't use our memory
+      Info( "Device %s can't capture into shared memory, falling back to copying frames", device.c_str() );
+      ReleaseV4L2Buffers();
+      RequestV4L2Buffers( false );
+      QueueV4L2Buffers();
     }
     v4l2_data.bufptr = NULL;
 
@@ -2024,6 +2169,28 @@ int LocalCamera::PrimeCapture() {
   return( 0 );
 }
 
+bool LocalCamera::UseSharedBuffers( uint8_t *p_buffers, unsigned int p_count ) {
+#if ZM_HAS_V4L2
+  if ( v4l_version == 2 ) {
+    // Whether the device can actually do it is only found out when it is opened
+    shared_buffers = p_buffers;
+    shared_buffer_count = p_count;
+    return( true );
+  }
+#endif // ZM_HAS_V4L2
+  return( false );
+}
+
+unsigned int LocalCamera::SharedBuffersAhead() const {
+#if ZM_HAS_V4L2
+  // After a frame is dequeued the rest of the driver's buffers are queued on
+  // the following slots and the one we requeue will go after those
+  if ( v4l2_userptr )
+    return( v4l2_data.reqbufs.count );
+#endif // ZM_HAS_V4L2
+  return( 0 );
+}
+
 int LocalCamera::PreCapture() {
   Debug( 5, "Pre-capturing" );
   return( 0 );
@@ -2035,6 +2202,9 @@ int LocalCamera::Capture( Image &image ) {
   int buffer_bytesused = 0;
   int capture_frame = -1;
 
+  captured_jpeg = NULL;
+  captured_jpeg_size = 0;
+
   int captures_per_frame = 1;
   if ( channel_count > 1 )
     captures_per_frame = v4l_captures_per_frame;
@@ -2152,11 +2322,18 @@ int LocalCamera::Capture( Image &image ) {
     } else if ( conversion_type == 3 ) {
       Debug( 9, "Decoding the JPEG image" );
       /* JPEG decoding */
-      image.DecodeJpeg(buffer, buffer_bytesused, colours, subpixelorder);
+      if ( image.DecodeJpeg(buffer, buffer_bytesused, colours, subpixelorder) ) {
+        captured_jpeg = buffer;
+        captured_jpeg_size = buffer_bytesused;
+      }
     }
 
+  } else if ( buffer == image.Buffer() ) {
+    Debug( 4, "Frame was captured straight into the shared memory" );
   } else {
     Debug( 3, "No format conversion performed. Assigning the image" );
+    if ( v4l2_userptr )
+      shared_buffer_drifted = true;
 
     /* No conversion was performed, the image is in the V4L buffers and needs to be copied into the shared memory */
     image.Assign( width, height, colours, subpixelorder, buffer, imagesize);
@@ -2191,8 +2368,12 @@ int LocalCamera::PostCapture()
           return( -1 );
         }
       }
-      if ( v4l2_data.bufptr ) {
+      if ( shared_buffer_drifted ) {
+        StopSharedBuffers();
+      } else if ( v4l2_data.bufptr ) {
         Debug( 3, "Requeueing buffer %d", v4l2_data.bufptr->index );
+        if ( v4l2_userptr )
+          SetSharedBuffer( *v4l2_data.bufptr );
         if ( vidioctl( vid_fd, VIDIOC_QBUF, v4l2_data.bufptr ) < 0 )
         {
           Error( "Unable to requeue buffer %d: %s", v4l2_data.bufptr->index, strerror(errno) )
@@ -44,6 +44,9 @@
 
 #include "zm_ffmpeg.h"
 
+// Most buffers handed to the driver when capturing straight into the image ring
+#define V4L2_USERPTR_BUFFERS 4
+
 //
 // Class representing 'local' cameras, i.e. those which are
 // directly connect to the host machine and which are accessed
@@ -92,6 +95,8 @@ protected:
   
   unsigned int conversion_type; /* 0 = no conversion needed, 1 = use libswscale, 2 = zm internal conversion, 3 = jpeg decoding */
   convert_fptr_t conversion_fptr; /* Pointer to conversion function used */
+  const uint8_t *captured_jpeg; /* The MJPEG frame last decoded, held in the driver's buffer until it is requeued */
+  unsigned int captured_jpeg_size;
   
   uint32_t AutoSelectFormat(int p_colours);
 
@@ -106,6 +111,19 @@ protected:
 
 #if ZM_HAS_V4L2
   static V4L2Data         v4l2_data;
+
+  // The monitor's image ring, which the driver can capture straight into
+  uint8_t *shared_buffers;
+  unsigned int shared_buffer_count;
+  bool v4l2_userptr;                 // Whether the driver is writing into the ring slots
+  unsigned int next_shared_buffer;   // Ring slot the next queued buffer will be filled into
+  bool shared_buffer_drifted;        // The driver filled a slot other than the monitor's
+
+  bool RequestV4L2Buffers( bool userptr );
+  void ReleaseV4L2Buffers();
+  bool QueueV4L2Buffers();
+  void SetSharedBuffer( struct v4l2_buffer &vid_buf );
+  void StopSharedBuffers();
 #endif // ZM_HAS_V4L2
 #if ZM_HAS_V4L1
   static V4L1Data         v4l1_data;
@@ -158,10 +176,15 @@ public:
   int Colour( int p_colour=-1 );
   int Contrast( int p_contrast=-1 );
 
+  bool UseSharedBuffers( uint8_t *p_buffers, unsigned int p_count );
+  unsigned int SharedBuffersAhead() const;
+
   int PrimeCapture();
   int PreCapture();
   int Capture( Image &image );
   int PostCapture();
+  bool CapturesJpeg() const { return( conversion_type == 3 ); }
+  const uint8_t *CapturedJpeg( unsigned int &p_size ) const { p_size = captured_jpeg_size; return( captured_jpeg ); }
   int CaptureAndRecord( Image &image, timeval recording, char* event_directory ) {return(0);};
   int Close() { return 0; };
 
@@ -22,6 +22,7 @@
 #include <arpa/inet.h>
 #include <glob.h>
 #include <cinttypes>
+#include <math.h>
 
 #include "zm.h"
 #include "zm_db.h"
@@ -51,6 +52,19 @@
 #include "zm_curl_camera.h"
 #endif // HAVE_LIBCURL
 
+#if HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#endif
+
+#if HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
 #if ZM_MEM_MAPPED
 #include <sys/mman.h>
 #include <fcntl.h>
@@ -355,6 +369,9 @@ Monitor::Monitor(
   zones( p_zones ),
   timestamps( 0 ),
   images( 0 ),
+  pre_event_copies( 0 ),
+  decode_reader( false ),
+  reader_slot( -1 ),
   privacy_bitmask( NULL ),
   event_delete_thread(NULL)
 {
@@ -394,6 +411,13 @@ Monitor::Monitor(
     alarm_frame_count = MAX_PRE_ALARM_FRAMES;
 
   auto_resume_time = 0;
+  last_section_mod = 0;
+  last_signal = false;
+  analysis_cost_usec = 0.0;
+  capture_interval_usec = 0.0;
+  last_analysed_time.tv_sec = last_analysed_time.tv_usec = 0;
+  pre_alarm_count = 0;
+  memset( pre_alarm_data, 0, sizeof(pre_alarm_data) );
 
   if ( strcmp( config.event_close_mode, "time" ) == 0 )
     event_close_mode = CLOSE_TIME;
@@ -404,13 +428,32 @@ Monitor::Monitor(
 
   Debug( 1, "monitor purpose=%d", purpose );
 
+  // Planar images can't be rotated or deinterlaced in place in the ring
+  if ( config.shm_planar_yuv && orientation == ROTATE_0 && !(deinterlacing & 0xff) && camera->CapturePlanarYUV() ) {
+    ref_image.WriteBuffer( width, height, camera->Colours(), camera->SubpixelOrder() );
+    Debug( 1, "Keeping planar YUV images in shared memory" );
+  }
+
   mem_size = sizeof(SharedData)
        + sizeof(TriggerData)
        + sizeof(VideoStoreData) //Information to pass back to the capture process
+       + (READER_SLOTS*sizeof(ReaderSlot))
        + (image_buffer_count*sizeof(struct timeval))
+       + (image_buffer_count*sizeof(int32_t))
+       + (image_buffer_count*sizeof(uint32_t))
        + (image_buffer_count*camera->ImageSize())
        + 64; /* Padding used to permit aligning the images buffer to 64 byte boundary */
 
+  jpeg_slot_size = 0;
+  jpeg_slots = NULL;
+  jpeg_data = NULL;
+  if ( config.shm_jpeg_slot_size && camera->CapturesJpeg() ) {
+    jpeg_slot_size = config.shm_jpeg_slot_size*1024;
+    mem_size += (image_buffer_count*sizeof(JpegSlot))
+      + ((off_t)image_buffer_count*jpeg_slot_size)
+      + 64;
+  }
+
   Debug( 1, "mem.size=%d", mem_size );
   mem_ptr = NULL;
 
@@ -457,6 +500,22 @@ Monitor::Monitor(
     shared_data->format = camera->SubpixelOrder();
     shared_data->imagesize = camera->ImageSize();
     shared_data->alarm_cause[0] = 0;
+    shared_data->decode_readers = 0;
+    shared_data->last_decode_read_time = 0;
+    shared_data->reconnects = 0;
+    shared_data->reconnect_first_frame_msec = 0;
+    shared_data->capture_latency_usec = 0;
+    shared_data->capture_latency_avg_usec = 0;
+    shared_data->capture_seq = 0;
+    shared_data->capture_waiters = 0;
+    shared_data->torn_reads = 0;
+    shared_data->analysis_step = 0;
+    shared_data->overrun_eta_msec = 0;
+    shared_data->analysis_cost_avg_usec = 0;
+    shared_data->source_frames_dropped = 0;
+    shared_data->source_recv_calls_per_100_frames = 0;
+    for ( int i = 0; i < image_buffer_count; i++ )
+      activity_scores[i] = -1;
     trigger_data->size = sizeof(TriggerData);
     trigger_data->trigger_state = TRIGGER_CANCEL;
     trigger_data->trigger_score = 0;
@@ -511,6 +570,9 @@ Debug(2,"last_write_index(%d), last_write_time(%d)", shared_data->last_write_ind
     }
     ref_image.Assign( width, height, camera->Colours(), camera->SubpixelOrder(), image_buffer[shared_data->last_write_index].image->Buffer(), camera->ImageSize());
     adaptive_skip = true;
+    SetDecodeReader( AnalysisNeedsImages() );
+    // Only an analysing monitor needs to keep up with capture
+    RegisterReader( function > MONITOR );
 
     ReloadLinkedMonitors( p_linked_monitors );
   }
@@ -528,6 +590,18 @@ bool Monitor::connect() {
     Debug(3, "Success opening mmap file at (%s)", mem_file );
   }
 
+#if HAVE_SYS_VFS_H
+  struct statfs map_statfs;
+  if ( fstatfs( map_fd, &map_statfs ) == 0 && map_statfs.f_type == HUGETLBFS_MAGIC ) {
+    // Files on hugetlbfs are always a whole number of huge pages
+    off_t huge_page_size = map_statfs.f_bsize;
+    if ( mem_size % huge_page_size ) {
+      mem_size += huge_page_size - (mem_size % huge_page_size);
+      Debug( 1, "Memory map file %s is on hugetlbfs, rounded size up to %" PRIu64 " bytes", mem_file, (uint64_t)mem_size );
+    }
+  }
+#endif
+
   struct stat map_stat;
   if ( fstat( map_fd, &map_stat ) < 0 )
     Fatal( "Can't stat memory map file %s: %s, is the zmc process for this monitor running?", mem_file, strerror(errno) );
@@ -540,29 +614,39 @@ bool Monitor::connect() {
       }
     } else if ( map_stat.st_size == 0 ) {
       Error( "Got empty memory map file size %ld, is the zmc process for this monitor running?", map_stat.st_size, mem_size );
+      close( map_fd );
+      map_fd = -1;
       return false;
     } else {
       Error( "Got unexpected memory map file size %ld, expected %d", map_stat.st_size, mem_size );
+      close( map_fd );
+      map_fd = -1;
       return false;
     }
   }
 
   Debug(3, "MMap file size is %ld", map_stat.st_size );
+  bool want_huge_pages = false;
+#ifdef MADV_HUGEPAGE
+  want_huge_pages = config.shm_hugepages;
+#endif
+  // Mapping locked faults in every page straight away, before the huge page
+  // hint could apply, so in that case the memory is locked afterwards instead
+  int map_flags = MAP_SHARED;
 #ifdef MAP_LOCKED
-  mem_ptr = (unsigned char *)mmap( NULL, mem_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, map_fd, 0 );
-  if ( mem_ptr == MAP_FAILED ) {
+  if ( !want_huge_pages )
+    map_flags |= MAP_LOCKED;
+#endif
+  mem_ptr = (unsigned char *)mmap( NULL, mem_size, PROT_READ|PROT_WRITE, map_flags, map_fd, 0 );
+  if ( mem_ptr == MAP_FAILED && map_flags != MAP_SHARED ) {
     if ( errno == EAGAIN ) {
       Debug( 1, "Unable to map file %s (%d bytes) to locked memory, trying unlocked", mem_file, mem_size );
-
-#endif
       mem_ptr = (unsigned char *)mmap( NULL, mem_size, PROT_READ|PROT_WRITE, MAP_SHARED, map_fd, 0 );
       Debug( 1, "Mapped file %s (%d bytes) to unlocked memory", mem_file, mem_size );
-#ifdef MAP_LOCKED
     } else {
       Error( "Unable to map file %s (%d bytes) to locked memory (%s)", mem_file, mem_size , strerror(errno) );
     }
   }
-#endif
   if ( mem_ptr == MAP_FAILED )
     Fatal( "Can't map file %s (%d bytes) to memory: %s(%d)", mem_file, mem_size, strerror(errno), errno );
   if ( mem_ptr == NULL ) {
@@ -570,8 +654,32 @@ bool Monitor::connect() {
   } else {
     Debug(3, "mmapped to %p", mem_ptr );
   }
+#ifdef MADV_HUGEPAGE
+  if ( want_huge_pages ) {
+    // Only a hint, the kernel uses normal pages if it can't or won't do better
+    if ( madvise( mem_ptr, mem_size, MADV_HUGEPAGE ) < 0 ) {
+      Warning( "Unable to use transparent huge pages for %s: %s", mem_file, strerror(errno) );
+    } else {
+      Debug( 1, "Asked for transparent huge pages for %s", mem_file );
+    }
+    if ( mlock( mem_ptr, mem_size ) < 0 )
+      Debug( 1, "Unable to lock file %s (%d bytes) in memory: %s", mem_file, mem_size, strerror(errno) );
+  }
+#endif
 #else // ZM_MEM_MAPPED
-  shm_id = shmget( (config.shm_key&0xffff0000)|id, mem_size, IPC_CREAT|0700 );
+  shm_id = -1;
+#ifdef SHM_HUGETLB
+  if ( config.shm_hugepages ) {
+    shm_id = shmget( (config.shm_key&0xffff0000)|id, mem_size, IPC_CREAT|SHM_HUGETLB|0700 );
+    if ( shm_id < 0 ) {
+      Warning( "Unable to get huge page shared memory, using normal pages: %s", strerror(errno) );
+    } else {
+      Debug( 1, "Using huge page shared memory" );
+    }
+  }
+#endif
+  if ( shm_id < 0 )
+    shm_id = shmget( (config.shm_key&0xffff0000)|id, mem_size, IPC_CREAT|0700 );
   if ( shm_id < 0 ) {
     Error( "Can't shmget, probably not enough shared memory space free: %s", strerror(errno));
     exit( -1 );
@@ -585,8 +693,15 @@ bool Monitor::connect() {
   shared_data = (SharedData *)mem_ptr;
   trigger_data = (TriggerData *)((char *)shared_data + sizeof(SharedData));
   video_store_data = (VideoStoreData *)((char *)trigger_data + sizeof(TriggerData));
-  struct timeval *shared_timestamps = (struct timeval *)((char *)video_store_data + sizeof(VideoStoreData));
-  unsigned char *shared_images = (unsigned char *)((char *)shared_timestamps + (image_buffer_count*sizeof(struct timeval)));
+  reader_slots = (ReaderSlot *)((char *)video_store_data + sizeof(VideoStoreData));
+  struct timeval *shared_timestamps = (struct timeval *)((char *)reader_slots + (READER_SLOTS*sizeof(ReaderSlot)));
+  activity_scores = (int32_t *)((char *)shared_timestamps + (image_buffer_count*sizeof(struct timeval)));
+  image_seqs = (uint32_t *)((char *)activity_scores + (image_buffer_count*sizeof(int32_t)));
+  unsigned char *shared_images = (unsigned char *)((char *)image_seqs + (image_buffer_count*sizeof(uint32_t)));
+  if ( jpeg_slot_size ) {
+    jpeg_slots = (JpegSlot *)shared_images;
+    shared_images += image_buffer_count*sizeof(JpegSlot);
+  }
 
 
   if ( ((unsigned long)shared_images % 64) != 0 ) {
@@ -601,21 +716,39 @@ bool Monitor::connect() {
       image_buffer[i].image = new Image( width, height, camera->Colours(), camera->SubpixelOrder(), &(shared_images[i*camera->ImageSize()]) );
       image_buffer[i].image->HoldBuffer(true); /* Don't release the internal buffer or replace it with another */
     }
+    if ( purpose == CAPTURE && config.v4l_userptr && (deinterlacing & 0xff) != 4 ) {
+      // Four field deinterlacing captures into next_buffer so gets no benefit
+      if ( camera->UseSharedBuffers( shared_images, image_buffer_count ) )
+        Debug( 1, "Offered the image ring to the camera to capture into" );
+    }
     if ( (deinterlacing & 0xff) == 4) {
       /* Four field motion adaptive deinterlacing in use */
       /* Allocate a buffer for the next image */
       next_buffer.image = new Image( width, height, camera->Colours(), camera->SubpixelOrder());
       next_buffer.timestamp = new struct timeval;
     }
+  uint8_t *shared_end = shared_images + (image_buffer_count*camera->ImageSize());
+  if ( jpeg_slot_size ) {
+    if ( ((unsigned long)shared_end % 64) != 0 )
+      shared_end = (uint8_t*)((unsigned long)shared_end + (64 - ((unsigned long)shared_end % 64)));
+    Debug( 3, "Keeping up to %d bytes of original JPEG for each image", jpeg_slot_size );
+    jpeg_data = shared_end;
+    shared_end += (size_t)image_buffer_count*jpeg_slot_size;
+  }
   if ( ( purpose == ANALYSIS ) && analysis_fps ) {
     // Size of pre event buffer must be greater than pre_event_count
     // if alarm_frame_count > 1, because in this case the buffer contains
     // alarmed images that must be discarded when event is created
     pre_event_buffer_count = pre_event_count + alarm_frame_count - 1;
     pre_event_buffer = new Snapshot[pre_event_buffer_count];
+    pre_event_slots = new int[pre_event_buffer_count];
+    pre_event_seqs = new uint32_t[pre_event_buffer_count];
     for ( int i = 0; i < pre_event_buffer_count; i++ ) {
       pre_event_buffer[i].timestamp = new struct timeval;
-      pre_event_buffer[i].image = new Image( width, height, camera->Colours(), camera->SubpixelOrder());
+      pre_event_buffer[i].timestamp->tv_sec = pre_event_buffer[i].timestamp->tv_usec = 0;
+      pre_event_buffer[i].image = NULL;
+      pre_event_slots[i] = -1;
+      pre_event_seqs[i] = 0;
     }
   }
 Debug(3, "Success connecting");
@@ -623,14 +756,7 @@ Debug(3, "Success connecting");
 }
 
 Monitor::~Monitor() {
-  if ( timestamps ) {
-    delete[] timestamps;
-    timestamps = 0;
-  }
-  if ( images ) {
-    delete[] images;
-    images = 0;
-  }
+  DeletePreEventArrays();
   if ( privacy_bitmask ) {
     delete[] privacy_bitmask;
     privacy_bitmask = NULL;
@@ -663,11 +789,15 @@ Monitor::~Monitor() {
   }
   delete[] zones;
 
+  EmptyPreAlarmFrames();
+
   delete camera;
   delete storage;
 
   if ( mem_ptr ) {
+    UnregisterReader();
     if ( purpose == ANALYSIS ) {
+      SetDecodeReader( false );
       shared_data->state = state = IDLE;
       shared_data->last_read_index = image_buffer_count;
       shared_data->last_read_time = 0;
@@ -678,6 +808,8 @@ Monitor::~Monitor() {
           delete pre_event_buffer[i].timestamp;
         }
         delete[] pre_event_buffer;
+        delete[] pre_event_slots;
+        delete[] pre_event_seqs;
       }
     } else if ( purpose == CAPTURE ) {
       shared_data->valid = false;
@@ -895,6 +1027,252 @@ void Monitor::UpdateAdaptiveSkip() {
   }
 }
 
+// Whether the analysis daemon needs every captured frame decoded, rather than
+// being able to make do with the keyframes when passthrough recording.
+bool Monitor::AnalysisNeedsImages() const {
+  if ( function <= MONITOR )
+    return false;
+  if ( function == MODECT || function == MOCORD )
+    return true;
+  // Event frames are stored from the decoded images unless we are passing the video through
+  return ( !videoRecording ) || ( savejpegs & 1 );
+}
+
+void Monitor::SetDecodeReader( bool p_decode_reader ) {
+  if ( p_decode_reader == decode_reader )
+    return;
+  decode_reader = p_decode_reader;
+  if ( decode_reader ) {
+    shared_data->last_decode_read_time = time(0);
+    __sync_fetch_and_add( &shared_data->decode_readers, 1 );
+  } else if ( shared_data->decode_readers ) {
+    __sync_fetch_and_sub( &shared_data->decode_readers, 1 );
+  }
+  Debug( 1, "%s decode reader, now %d attached", decode_reader?"Registered":"Unregistered", shared_data->decode_readers );
+}
+
+// Used by the capture daemon to decide whether it can skip decoding non-keyframes
+bool Monitor::DecodingRequired() const {
+  if ( !config.opt_decode_on_demand )
+    return true;
+  if ( !shared_data->decode_readers )
+    return false;
+  // A reader which died without unregistering stops updating the heartbeat
+  return ( time(0) - shared_data->last_decode_read_time ) <= DECODE_READER_TIMEOUT;
+}
+
+// Called by the camera once a reconnect has produced an image
+void Monitor::ReconnectDone( unsigned int first_frame_msec ) {
+  shared_data->reconnects++;
+  shared_data->reconnect_first_frame_msec = first_frame_msec;
+}
+
+// Called by cameras which receive frames on a thread of their own
+void Monitor::SourceStats( uint32_t frames_dropped, uint32_t recv_calls_per_100_frames ) {
+  shared_data->source_frames_dropped = frames_dropped;
+  shared_data->source_recv_calls_per_100_frames = recv_calls_per_100_frames;
+}
+
+void Monitor::BeginImageWrite( unsigned int index ) {
+  if ( !(image_seqs[index] & 1) ) {
+    image_seqs[index]++;
+    __sync_synchronize();
+  }
+}
+
+void Monitor::EndImageWrite( unsigned int index ) {
+  if ( image_seqs[index] & 1 ) {
+    __sync_synchronize();
+    image_seqs[index]++;
+  }
+}
+
+uint32_t Monitor::BeginImageRead( unsigned int index ) const {
+  uint32_t seq = image_seqs[index];
+  __sync_synchronize();
+  return( seq );
+}
+
+bool Monitor::ImageUnchanged( unsigned int index, uint32_t seq ) const {
+  __sync_synchronize();
+  return( !(seq & 1) && image_seqs[index] == seq );
+}
+
+bool Monitor::EndImageRead( unsigned int index, uint32_t seq ) const {
+  if ( ImageUnchanged( index, seq ) )
+    return( true );
+  __sync_add_and_fetch( &shared_data->torn_reads, 1 );
+  return( false );
+}
+
+bool Monitor::RegisterReader( bool critical ) {
+  if ( reader_slot >= 0 )
+    UnregisterReader();
+  pid_t pid = getpid();
+  for ( int i = 0; i < READER_SLOTS; i++ ) {
+    ReaderSlot *reader = &reader_slots[i];
+    if ( reader->pid || !__sync_bool_compare_and_swap( &reader->pid, 0, pid ) )
+      continue;
+    reader->flags = critical ? READER_CRITICAL : 0;
+    reader->cursor = shared_data->last_write_index;
+    reader->drops = 0;
+    reader->reads = 0;
+    reader->heartbeat = time(0);
+    reader_slot = i;
+    Debug( 1, "Registered as %s reader %d", critical?"critical":"non-critical", i );
+    return true;
+  }
+  Warning( "No free reader slots for monitor %d, images dropped for this reader won't be counted", id );
+  return false;
+}
+
+void Monitor::UnregisterReader() {
+  if ( reader_slot < 0 )
+    return;
+  ReaderSlot *reader = &reader_slots[reader_slot];
+  Debug( 1, "Unregistering reader %d, %" PRIu64 " images read, %d dropped", reader_slot, reader->reads, reader->drops );
+  __sync_bool_compare_and_swap( &reader->pid, getpid(), 0 );
+  reader_slot = -1;
+}
+
+// Records that this reader has finished with the given ring index
+void Monitor::ReaderAt( unsigned int index ) {
+  if ( reader_slot < 0 )
+    return;
+  ReaderSlot *reader = &reader_slots[reader_slot];
+  if ( reader->pid != getpid() ) {
+    // The capture daemon gave up on us, or was restarted
+    bool critical = reader->flags & READER_CRITICAL;
+    reader_slot = -1;
+    if ( !RegisterReader( critical ) )
+      return;
+    reader = &reader_slots[reader_slot];
+  }
+  reader->cursor = index;
+  reader->heartbeat = time(0);
+  reader->reads++;
+}
+
+// Bytes of the shared memory that the kernel has actually backed with huge
+// pages, which can be none even when they were asked for
+uint64_t Monitor::HugePageBytes() const {
+  ::FILE *smaps = fopen( "/proc/self/smaps", "r" );
+  if ( !smaps ) {
+    Debug( 1, "Can't open /proc/self/smaps: %s", strerror(errno) );
+    return( 0 );
+  }
+  uint64_t huge_kb = 0, rss_kb = 0, page_kb = 0;
+  bool in_mapping = false;
+  char line[256];
+  while ( fgets( line, sizeof(line), smaps ) ) {
+    unsigned long start, end;
+    unsigned long long kb;
+    if ( sscanf( line, "%lx-%lx ", &start, &end ) == 2 ) {
+      if ( in_mapping )
+        break;
+      in_mapping = (unsigned long)mem_ptr >= start && (unsigned long)mem_ptr < end;
+    } else if ( !in_mapping ) {
+      continue;
+    } else if ( sscanf( line, "Rss: %llu kB", &kb ) == 1 ) {
+      rss_kb = kb;
+    } else if ( sscanf( line, "KernelPageSize: %llu kB", &kb ) == 1 ) {
+      page_kb = kb;
+    } else if ( sscanf( line, "AnonHugePages: %llu kB", &kb ) == 1
+        || sscanf( line, "ShmemPmdMapped: %llu kB", &kb ) == 1 ) {
+      huge_kb += kb;
+    }
+  }
+  fclose( smaps );
+  // hugetlbfs and SHM_HUGETLB mappings are made of nothing but huge pages
+  if ( page_kb > 4 )
+    huge_kb = rss_kb;
+  return( huge_kb*1024 );
+}
+
+double Monitor::BenchmarkDelta( unsigned int passes ) {
+  Image delta_image;
+  struct timeval start;
+  gettimeofday( &start, NULL );
+  for ( unsigned int pass = 0; pass < passes; pass++ ) {
+    for ( int i = 0; i < image_buffer_count; i++ )
+      image_buffer[i].image->Delta( *image_buffer[(i+1)%image_buffer_count].image, &delta_image );
+  }
+  int elapsed = tvDiffUsec( start );
+  if ( elapsed <= 0 )
+    return( 0.0 );
+  // Each comparison reads two ring images, and bytes per usec is MB/s
+  return( (2.0*passes*image_buffer_count*camera->ImageSize())/elapsed );
+}
+
+// Counts the image about to be overwritten as dropped for any registered
+// reader that hasn't had it yet, and warns if that reader is critical
+void Monitor::CheckReaders( unsigned int index, unsigned int slots_ahead ) {
+  time_t now = time(0);
+  // Not yet updated for this image. A reader that has read since then is
+  // keeping up however slowly the camera captures.
+  time_t last_capture_time = shared_data->last_write_time;
+  for ( int i = 0; i < READER_SLOTS; i++ ) {
+    ReaderSlot *reader = &reader_slots[i];
+    pid_t pid = reader->pid;
+    if ( !pid )
+      continue;
+    if ( now - reader->heartbeat > READER_TIMEOUT && reader->heartbeat < last_capture_time ) {
+      // A paused viewer is expected to stop reading, but analysis isn't
+      if ( reader->flags & READER_CRITICAL ) {
+        Warning( "Reader %d (pid %d) last read an image %ld seconds ago and may have gone away, releasing its slot", i, pid, now - reader->heartbeat );
+      } else {
+        Debug( 1, "Reader %d (pid %d) last read an image %ld seconds ago, releasing its slot", i, pid, now - reader->heartbeat );
+      }
+      __sync_bool_compare_and_swap( &reader->pid, pid, 0 );
+      continue;
+    }
+    unsigned int cursor = reader->cursor;
+    if ( cursor >= (unsigned int)image_buffer_count )
+      continue;
+    if ( ((cursor + image_buffer_count - index) % image_buffer_count) <= slots_ahead ) {
+      __sync_add_and_fetch( &reader->drops, 1 );
+      if ( reader->flags & READER_CRITICAL ) {
+        Warning( "Buffer overrun at index %d, image %d, for reader %d (pid %d), slow down capture, speed up analysis or increase ring buffer size", index, image_count, i, pid );
+      }
+    }
+  }
+}
+
+// Wakes any readers waiting for an image
+void Monitor::NotifyCapture() {
+  __sync_add_and_fetch( &shared_data->capture_seq, 1 );
+#if HAVE_LINUX_FUTEX_H
+  // Waiters register before checking capture_seq, so if there are none now
+  // any that come along will see the new value and not sleep
+  if ( shared_data->capture_waiters )
+    syscall( SYS_futex, &shared_data->capture_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+#endif
+}
+
+// Sleeps until an image is captured after p_capture_seq was taken, or for
+// at most timeout_usec. Returns whether there is a new image.
+bool Monitor::WaitForCapture( uint32_t p_capture_seq, unsigned int timeout_usec ) const {
+  if ( shared_data->capture_seq != p_capture_seq )
+    return true;
+#if HAVE_LINUX_FUTEX_H
+  struct timespec timeout;
+  timeout.tv_sec = timeout_usec/1000000;
+  timeout.tv_nsec = (timeout_usec%1000000)*1000;
+  __sync_add_and_fetch( &shared_data->capture_waiters, 1 );
+  // Only sleeps if capture_seq still has the value we were given
+  if ( syscall( SYS_futex, &shared_data->capture_seq, FUTEX_WAIT, p_capture_seq, &timeout, NULL, 0 ) < 0
+      && errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR ) {
+    Warning( "Failed waiting for capture: %s", strerror(errno) );
+    usleep( timeout_usec );
+  }
+  __sync_sub_and_fetch( &shared_data->capture_waiters, 1 );
+#else
+  for ( unsigned int waited = 0; waited < timeout_usec && shared_data->capture_seq == p_capture_seq; waited += ZM_SAMPLE_RATE )
+    usleep( ZM_SAMPLE_RATE );
+#endif
+  return( shared_data->capture_seq != p_capture_seq );
+}
+
 void Monitor::ForceAlarmOn( int force_score, const char *force_cause, const char *force_text ) {
   trigger_data->trigger_state = TRIGGER_ON;
   trigger_data->trigger_score = force_score;
@@ -1176,7 +1554,10 @@ bool Monitor::CheckSignal( const Image *image ) {
       red_val = RED_VAL_BGRA(signal_check_colour);
       green_val = GREEN_VAL_BGRA(signal_check_colour);
       blue_val = BLUE_VAL_BGRA(signal_check_colour);
-      grayscale_val = signal_check_colour & 0xff; /* Clear all bytes but lowest byte */
+      if ( usedsubpixorder == ZM_SUBPIX_ORDER_YUV420P )
+        grayscale_val = colour_val & 0xff; /* The Y value, as the signal loss image is filled with */
+      else
+        grayscale_val = signal_check_colour & 0xff; /* Clear all bytes but lowest byte */
     }
 
     const uint8_t *buffer = image->Buffer();
@@ -1229,50 +1610,45 @@ bool Monitor::CheckSignal( const Image *image ) {
   return true;
 }
 
-bool Monitor::Analyse() {
-  if ( shared_data->last_read_index == shared_data->last_write_index ) {
-    // I wonder how often this happens. Maybe if this happens we should sleep or something?
-    return( false );
-  }
-
-  struct timeval now;
-  gettimeofday( &now, NULL );
-
-  if ( image_count && fps_report_interval && !(image_count%fps_report_interval) ) {
-    if ( now.tv_sec != last_fps_time ) {
-      double new_fps = double(fps_report_interval)/(now.tv_sec - last_fps_time);
-      Info("%s: %d - Analysing at %.2f fps", name, image_count, new_fps);
-      if ( fps != new_fps ) {
-        fps = new_fps;
-        static char sql[ZM_SQL_SML_BUFSIZ];
-        snprintf(sql, sizeof(sql), "INSERT INTO Monitor_Status (MonitorId,AnalysisFPS) VALUES (%d, %.2lf) ON DUPLICATE KEY UPDATE AnalysisFPS = %.2lf", id, fps, fps);
-        db_mutex.lock();
-        if ( mysql_query(&dbconn, sql) ) {
-          Error("Can't run query: %s", mysql_error(&dbconn));
-        }
-        db_mutex.unlock();
-      } // end if fps != new_fps
+// Picks how many ring slots to move on by. At the measured cost of analysis
+// and rate of capture it is the smallest step which gets the free space in
+// the ring back up to ADAPTIVE_SKIP_HEADROOM percent within
+// ADAPTIVE_SKIP_RECOVERY images and then keeps it there, so that as many
+// images as possible get analysed. Until both have been measured analysis
+// is assumed to take as long as a capture.
+int Monitor::AdaptiveSkipStep( int headroom ) const {
+  int target = (image_buffer_count * ADAPTIVE_SKIP_HEADROOM) / 100;
+  if ( headroom >= target )
+    return( 1 );
+
+  // Images captured while one is analysed
+  double captured_per_image = 1.0;
+  if ( analysis_cost_usec > 0.0 && capture_interval_usec > 0.0 )
+    captured_per_image = analysis_cost_usec / capture_interval_usec;
+
+  int step = (int)ceil( captured_per_image + (double)(target - headroom) / ADAPTIVE_SKIP_RECOVERY );
+  return( step < 1 ? 1 : step );
+}
 
-      last_fps_time = now.tv_sec;
-    }
-  }
+// Picks the ring index to analyse next, skipping images if adaptive skip
+// thinks we are falling behind, and publishes the step taken and how long
+// capture would take to catch us up at it. Only called when there is
+// something to read.
+int Monitor::NextAnalysisIndex() {
+  int pending_frames = shared_data->last_write_index - shared_data->last_read_index;
+  if ( pending_frames < 0 ) pending_frames += image_buffer_count;
 
   int index;
+  int step;
   if ( adaptive_skip ) {
-    int read_margin = shared_data->last_read_index - shared_data->last_write_index;
-    if ( read_margin < 0 ) read_margin += image_buffer_count;
+    // Free slots before capture overwrites images we haven't analysed
+    int headroom = shared_data->last_read_index - shared_data->last_write_index;
+    if ( headroom < 0 ) headroom += image_buffer_count;
 
-    int step = 1;
-    // Isn't read_margin always > 0 here?
-    if ( read_margin > 0 ) {
-      // TODO explain this so... 90% of image buffer / 50% of read margin?
-      step = (9*image_buffer_count)/(5*read_margin);
-    }
+    step = AdaptiveSkipStep( headroom );
 
-    int pending_frames = shared_data->last_write_index - shared_data->last_read_index;
-    if ( pending_frames < 0 ) pending_frames += image_buffer_count;
-
-    Debug( 4, "ReadIndex:%d, WriteIndex: %d, PendingFrames = %d, ReadMargin = %d, Step = %d", shared_data->last_read_index, shared_data->last_write_index, pending_frames, read_margin, step );
+    Debug( 4, "ReadIndex:%d, WriteIndex: %d, PendingFrames = %d, Headroom = %d, Cost = %.0fus, Interval = %.0fus, Step = %d",
+        shared_data->last_read_index, shared_data->last_write_index, pending_frames, headroom, analysis_cost_usec, capture_interval_usec, step );
     if ( step <= pending_frames ) {
       index = (shared_data->last_read_index+step)%image_buffer_count;
     } else {
@@ -1280,14 +1656,52 @@ bool Monitor::Analyse() {
         Warning( "Approaching buffer overrun, consider slowing capture, simplifying analysis or increasing ring buffer size" );
       }
       index = shared_data->last_write_index%image_buffer_count;
+      step = pending_frames;
+    }
+
+    // Capture fills the ring at one slot per interval while we empty it at
+    // step slots per analysis, so if that is slower we will be overrun once
+    // the free slots are used up
+    uint32_t eta_msec = 0;
+    if ( analysis_cost_usec > 0.0 && capture_interval_usec > 0.0 ) {
+      double fill_per_usec = (1.0 / capture_interval_usec) - (step / analysis_cost_usec);
+      if ( fill_per_usec > 0.0 ) {
+        double eta = (headroom / fill_per_usec) / 1000.0;
+        eta_msec = eta < 1.0 ? 1 : (eta > UINT32_MAX ? UINT32_MAX : (uint32_t)eta);
+      }
     }
+    shared_data->overrun_eta_msec = eta_msec;
   } else {
     index = shared_data->last_write_index%image_buffer_count;
+    step = pending_frames;
+    shared_data->overrun_eta_msec = 0;
   }
+  shared_data->analysis_step = step;
 
-  Snapshot *snap = &image_buffer[index];
-  struct timeval *timestamp = snap->timestamp;
-  Image *snap_image = snap->image;
+  return( index );
+}
+
+int Monitor::Analyse() {
+  if ( shared_data->last_read_index == shared_data->last_write_index ) {
+    // I wonder how often this happens. Maybe if this happens we should sleep or something?
+    return( 0 );
+  }
+
+  struct timeval now;
+  gettimeofday( &now, NULL );
+
+  // In batch mode every frame pending now is analysed, stepping over them
+  // as adaptive skip decides, so that actions, the clock and read times are
+  // only dealt with once per call. Frames captured meanwhile are left for
+  // the next call, so a fast camera can't keep us here indefinitely.
+  int batch_slots = 1;
+  if ( config.opt_analysis_batch && adaptive_skip ) {
+    batch_slots = shared_data->last_write_index - shared_data->last_read_index;
+    if ( batch_slots < 0 ) batch_slots += image_buffer_count;
+  }
+
+  int index = NextAnalysisIndex();
+  Image *snap_image = image_buffer[index].image;
 
   if ( shared_data->action ) {
     // Can there be more than 1 bit set in the action?  Shouldn't these be elseifs?
@@ -1329,18 +1743,94 @@ bool Monitor::Analyse() {
     auto_resume_time = 0;
   }
 
-  static bool static_undef = true;
-  static int last_section_mod = 0;
-  static bool last_signal;
-
-  if ( static_undef ) {
-// Sure would be nice to be able to assume that these were already initialized.  It's just 1 compare/branch, but really not neccessary.
-    static_undef = false;
+  // Per monitor rather than static, as one process may analyse several monitors
+  if ( !timestamps ) {
     timestamps = new struct timeval *[pre_event_count];
     images = new Image *[pre_event_count];
+    pre_event_copies = new Snapshot[pre_event_count];
+    for ( int i = 0; i < pre_event_count; i++ ) {
+      pre_event_copies[i].timestamp = new struct timeval;
+      pre_event_copies[i].image = NULL;
+    }
     last_signal = shared_data->signal;
   }
 
+  struct timespec analysis_start, analysis_end;
+  clock_gettime( CLOCK_MONOTONIC, &analysis_start );
+
+  int analysed = 0;
+  while ( true ) {
+    int slots = index - shared_data->last_read_index;
+    if ( slots <= 0 ) slots += image_buffer_count;
+
+    // The capture interval is measured across the images we step over
+    const struct timeval *captured = image_buffer[index].timestamp;
+    if ( last_analysed_time.tv_sec ) {
+      int interval = tvDiffUsec( last_analysed_time, *captured );
+      if ( interval > 0 ) {
+        interval /= slots;
+        if ( capture_interval_usec > 0.0 )
+          capture_interval_usec = ( 7 * capture_interval_usec + interval ) / 8;
+        else
+          capture_interval_usec = interval;
+      }
+    }
+    last_analysed_time = *captured;
+
+    AnalyseImage( index, now );
+    analysed++;
+
+    batch_slots -= slots;
+    if ( batch_slots <= 0 || shared_data->action || shared_data->last_read_index == shared_data->last_write_index )
+      break;
+    index = NextAnalysisIndex();
+  }
+  if ( analysed > 1 )
+    Debug( 3, "%s: Analysed a batch of %d images", name, analysed );
+
+  clock_gettime( CLOCK_MONOTONIC, &analysis_end );
+  double cost = ( ((analysis_end.tv_sec - analysis_start.tv_sec) * 1000000.0) + ((analysis_end.tv_nsec - analysis_start.tv_nsec) / 1000.0) ) / analysed;
+  if ( analysis_cost_usec > 0.0 )
+    analysis_cost_usec = ( 7 * analysis_cost_usec + cost ) / 8;
+  else
+    analysis_cost_usec = cost;
+  shared_data->analysis_cost_avg_usec = (uint32_t)analysis_cost_usec;
+
+  //shared_data->last_read_time = image_buffer[index].timestamp->tv_sec;
+  shared_data->last_read_time = now.tv_sec;
+  if ( decode_reader )
+    shared_data->last_decode_read_time = now.tv_sec;
+
+  return( analysed );
+}
+
+// Analyses the image in the given ring slot, which becomes our read position
+void Monitor::AnalyseImage( int index, const struct timeval &now ) {
+  if ( image_count && fps_report_interval && !(image_count%fps_report_interval) ) {
+    if ( now.tv_sec != last_fps_time ) {
+      double new_fps = double(fps_report_interval)/(now.tv_sec - last_fps_time);
+      Info("%s: %d - Analysing at %.2f fps", name, image_count, new_fps);
+      if ( fps != new_fps ) {
+        fps = new_fps;
+        char sql[ZM_SQL_SML_BUFSIZ];
+        snprintf(sql, sizeof(sql), "INSERT INTO Monitor_Status (MonitorId,AnalysisFPS) VALUES (%d, %.2lf) ON DUPLICATE KEY UPDATE AnalysisFPS = %.2lf", id, fps, fps);
+        db_mutex.lock();
+        if ( mysql_query(&dbconn, sql) ) {
+          Error("Can't run query: %s", mysql_error(&dbconn));
+        }
+        db_mutex.unlock();
+      } // end if fps != new_fps
+
+      last_fps_time = now.tv_sec;
+    }
+  }
+
+  Snapshot *snap = &image_buffer[index];
+  struct timeval *timestamp = snap->timestamp;
+  Image *snap_image = snap->image;
+  uint32_t image_seq = BeginImageRead( index );
+  bool image_torn = false;
+
   if ( Enabled() ) {
     bool signal = shared_data->signal;
     bool signal_change = (signal != last_signal);
@@ -1393,9 +1883,21 @@ bool Monitor::Analyse() {
         } else if ( signal && Active() && (function == MODECT || function == MOCORD) ) {
           Event::StringSet zoneSet;
           int motion_score = last_motion_score;
-          if ( !(image_count % (motion_frame_skip+1) ) ) {
+          int activity = activity_scores[index];
+          if ( config.motion_activity_floor && ( activity >= 0 ) && ( activity < config.motion_activity_floor ) ) {
+            // The camera says nothing much changed, so don't pay for a full pixel comparison
+            Debug( 3, "Activity %d below floor %d, skipping motion detection", activity, config.motion_activity_floor );
+            motion_score = last_motion_score = 0;
+          } else if ( !(image_count % (motion_frame_skip+1) ) ) {
             // Get new score.
             motion_score = DetectMotion( *snap_image, zoneSet );
+            if ( !EndImageRead( index, image_seq ) ) {
+              // Capture has caught up with us, so the score is for a mix of two images
+              Debug( 1, "Image %d was overwritten during motion detection, ignoring its score", index );
+              image_torn = true;
+              motion_score = last_motion_score;
+              zoneSet.clear();
+            }
 
             Debug( 3, "After motion detection, last_motion_score(%d), new motion score(%d)", last_motion_score, motion_score );
             // Why are we updating the last_motion_score too?
@@ -1496,6 +1998,7 @@ bool Monitor::Analyse() {
               if ( analysis_fps ) {
                 // If analysis fps is set,
                 // compute the index for pre event images in the dedicated buffer
+                KeepPreEventFrames( true );
                 pre_index = pre_event_buffer_count ? image_count%pre_event_buffer_count : 0;
 
                 // Seek forward the next filled slot in to the buffer (oldest data)
@@ -1528,8 +2031,7 @@ bool Monitor::Analyse() {
                   }
                 } else {
                   for ( int i = 0; i < pre_event_images; i++ ) {
-                    timestamps[i] = image_buffer[pre_index].timestamp;
-                    images[i] = image_buffer[pre_index].image;
+                    CopyPreEventFrame( i, pre_index );
                     pre_index = (pre_index + 1)%image_buffer_count;
                   }
                 }
@@ -1541,7 +2043,7 @@ bool Monitor::Analyse() {
         }
         if ( score ) {
           if ( (state == IDLE || state == TAPE || state == PREALARM ) ) {
-            if ( Event::PreAlarmCount() >= (alarm_frame_count-1) ) {
+            if ( pre_alarm_count >= (alarm_frame_count-1) ) {
               Info( "%s: %03d - Gone into alarm state", name, image_count );
               shared_data->state = state = ALARM;
               if ( signal_change || (function != MOCORD && state != ALERT) ) {
@@ -1551,6 +2053,7 @@ bool Monitor::Analyse() {
                 if ( analysis_fps ) {
                   // If analysis fps is set,
                   // compute the index for pre event images in the dedicated buffer
+                  KeepPreEventFrames( true );
                   pre_index = pre_event_buffer_count ? image_count%pre_event_buffer_count : 0;
 
                   // Seek forward the next filled slot in to the buffer (oldest data)
@@ -1608,8 +2111,7 @@ bool Monitor::Analyse() {
                     }
                   } else {
                     for ( int i = 0; i < pre_event_images; i++ ) {
-                      timestamps[i] = image_buffer[pre_index].timestamp;
-                      images[i] = image_buffer[pre_index].image;
+                      CopyPreEventFrame( i, pre_index );
                       pre_index = (pre_index + 1)%image_buffer_count;
                     }
                   }
@@ -1617,7 +2119,7 @@ bool Monitor::Analyse() {
                   event->AddFrames( pre_event_images, images, timestamps );
                 }
                 if ( alarm_frame_count ) {
-                  event->SavePreAlarmFrames();
+                  SavePreAlarmFrames();
                 }
               }
             } else if ( state != PREALARM ) {
@@ -1653,68 +2155,77 @@ bool Monitor::Analyse() {
               shared_data->state = state = TAPE;
             }
           }
-          if ( Event::PreAlarmCount() )
-            Event::EmptyPreAlarmFrames();
+          if ( pre_alarm_count )
+            EmptyPreAlarmFrames();
         }
         if ( state != IDLE ) {
-          if ( state == PREALARM || state == ALARM ) {
-            if ( config.create_analysis_images ) {
-              bool got_anal_image = false;
-              alarm_image.Assign( *snap_image );
-              for( int i = 0; i < n_zones; i++ ) {
-                if ( zones[i]->Alarmed() ) {
-                  if ( zones[i]->AlarmImage() ) {
-                    alarm_image.Overlay( *(zones[i]->AlarmImage()) );
-                    got_anal_image = true;
-                  }
-                  if ( config.record_event_stats && state == ALARM ) {
-                    zones[i]->RecordStats( event );
+          // Events and the pre alarm frames keep what they are given, so copy
+          // the image and only keep the copy if capture left the slot alone
+          event_image.Assign( *snap_image );
+          struct timeval event_time = *timestamp;
+          if ( image_torn || !EndImageRead( index, image_seq ) ) {
+            image_torn = true;
+            Debug( 1, "%s: %03d - Image in slot %d was overwritten while being analysed, not keeping it", name, image_count, index );
+          } else {
+            if ( state == PREALARM || state == ALARM ) {
+              if ( config.create_analysis_images ) {
+                bool got_anal_image = false;
+                alarm_image.Assign( event_image );
+                for( int i = 0; i < n_zones; i++ ) {
+                  if ( zones[i]->Alarmed() ) {
+                    if ( zones[i]->AlarmImage() ) {
+                      alarm_image.Overlay( *(zones[i]->AlarmImage()) );
+                      got_anal_image = true;
+                    }
+                    if ( config.record_event_stats && state == ALARM ) {
+                      zones[i]->RecordStats( event );
+                    }
                   }
                 }
-              }
-              if ( got_anal_image ) {
-                if ( state == PREALARM )
-                  Event::AddPreAlarmFrame( snap_image, *timestamp, score, &alarm_image );
-                else
-                  event->AddFrame( snap_image, *timestamp, score, &alarm_image );
+                if ( got_anal_image ) {
+                  if ( state == PREALARM )
+                    AddPreAlarmFrame( &event_image, event_time, score, &alarm_image );
+                  else
+                    event->AddFrame( &event_image, event_time, score, &alarm_image );
+                } else {
+                  if ( state == PREALARM )
+                    AddPreAlarmFrame( &event_image, event_time, score );
+                  else
+                    event->AddFrame( &event_image, event_time, score );
+                }
               } else {
+                for( int i = 0; i < n_zones; i++ ) {
+                  if ( zones[i]->Alarmed() ) {
+                    if ( config.record_event_stats && state == ALARM ) {
+                      zones[i]->RecordStats( event );
+                    }
+                  }
+                }
                 if ( state == PREALARM )
-                  Event::AddPreAlarmFrame( snap_image, *timestamp, score );
+                  AddPreAlarmFrame( &event_image, event_time, score );
                 else
-                  event->AddFrame( snap_image, *timestamp, score );
+                  event->AddFrame( &event_image, event_time, score );
               }
-            } else {
-              for( int i = 0; i < n_zones; i++ ) {
-                if ( zones[i]->Alarmed() ) {
-                  if ( config.record_event_stats && state == ALARM ) {
-                    zones[i]->RecordStats( event );
-                  }
+              if ( event && noteSetMap.size() > 0 )
+                event->updateNotes( noteSetMap );
+            } else if ( state == ALERT ) {
+              event->AddFrame( &event_image, event_time );
+              if ( noteSetMap.size() > 0 )
+                event->updateNotes( noteSetMap );
+            } else if ( state == TAPE ) {
+              //Video Storage: activate only for supported cameras. Event::AddFrame knows whether or not we are recording video and saves frames accordingly
+              //if((GetOptVideoWriter() == 2) && camera->SupportsNativeVideo()) {
+                // I don't think this is required, and causes problems, as the event file hasn't been setup yet.
+                //Warning("In state TAPE,
+                //video_store_data->recording = event->StartTime();
+              //}
+              if ( !(image_count%(frame_skip+1)) ) {
+                if ( config.bulk_frame_interval > 1 ) {
+                  event->AddFrame( &event_image, event_time, (event->Frames()<pre_event_count?0:-1) );
+                } else {
+                  event->AddFrame( &event_image, event_time );
                 }
               }
-              if ( state == PREALARM )
-                Event::AddPreAlarmFrame( snap_image, *timestamp, score );
-              else
-                event->AddFrame( snap_image, *timestamp, score );
-            }
-            if ( event && noteSetMap.size() > 0 )
-              event->updateNotes( noteSetMap );
-          } else if ( state == ALERT ) {
-            event->AddFrame( snap_image, *timestamp );
-            if ( noteSetMap.size() > 0 )
-              event->updateNotes( noteSetMap );
-          } else if ( state == TAPE ) {
-            //Video Storage: activate only for supported cameras. Event::AddFrame knows whether or not we are recording video and saves frames accordingly
-            //if((GetOptVideoWriter() == 2) && camera->SupportsNativeVideo()) {
-              // I don't think this is required, and causes problems, as the event file hasn't been setup yet.
-              //Warning("In state TAPE,
-              //video_store_data->recording = event->StartTime();
-            //}
-            if ( !(image_count%(frame_skip+1)) ) {
-              if ( config.bulk_frame_interval > 1 ) {
-                event->AddFrame( snap_image, *timestamp, (event->Frames()<pre_event_count?0:-1) );
-              } else {
-                event->AddFrame( snap_image, *timestamp );
-              }
             }
           }
         } // end if ! IDLE
@@ -1728,30 +2239,101 @@ bool Monitor::Analyse() {
       last_section_mod = 0;
     } // end if ( trigger_data->trigger_state != TRIGGER_OFF )
 
-    if ( (!signal_change && signal) && (function == MODECT || function == MOCORD) ) {
+    if ( (!signal_change && signal) && !image_torn && (function == MODECT || function == MOCORD) ) {
+      // Blend from the checked copy if one was taken
+      Image *blend_image = state != IDLE ? &event_image : snap_image;
       if ( state == ALARM ) {
-         ref_image.Blend( *snap_image, alarm_ref_blend_perc );
+         ref_image.Blend( *blend_image, alarm_ref_blend_perc );
       } else {
-         ref_image.Blend( *snap_image, ref_blend_perc );
+         ref_image.Blend( *blend_image, ref_blend_perc );
       }
     }
     last_signal = signal;
   } // end if Enabled()
 
   shared_data->last_read_index = index % image_buffer_count;
-  //shared_data->last_read_time = image_buffer[index].timestamp->tv_sec;
-  shared_data->last_read_time = now.tv_sec;
+  ReaderAt( index % image_buffer_count );
 
   if ( analysis_fps && pre_event_buffer_count ) {
-    // If analysis fps is set, add analysed image to dedicated pre event buffer
+    // If analysis fps is set, add analysed image to dedicated pre event buffer,
+    // leaving it in the ring for as long as capture does
     int pre_index = image_count%pre_event_buffer_count;
-    pre_event_buffer[pre_index].image->Assign(*snap->image);
+    pre_event_slots[pre_index] = index;
+    pre_event_seqs[pre_index] = image_seq;
     memcpy( pre_event_buffer[pre_index].timestamp, snap->timestamp, sizeof(struct timeval) );
+    KeepPreEventFrames( false );
   }
 
   image_count++;
+}
 
-  return( true );
+
+// Copies pre event images which are still only in the ring into the pre
+// event buffer, either all of them, as an event is about to use them, or
+// just those capture may overwrite before we next analyse. So until an event
+// starts they needn't be copied at all if the ring is big enough.
+void Monitor::KeepPreEventFrames( bool all ) {
+  int margin = image_buffer_count;
+  if ( !all && capture_interval_usec > 0.0 ) {
+    // Images captured before we next analyse, twice over in case we are held up
+    margin = 2 * (int)ceil( (1000000.0 / analysis_fps) / capture_interval_usec ) + camera->SharedBuffersAhead() + 1;
+  }
+  for ( int i = 0; i < pre_event_buffer_count; i++ ) {
+    int slot = pre_event_slots[i];
+    if ( slot < 0 )
+      continue;
+    // Images capture will write before it gets to this slot
+    int distance = slot - shared_data->last_write_index;
+    if ( distance <= 0 ) distance += image_buffer_count;
+    if ( distance > margin )
+      continue;
+
+    if ( !pre_event_buffer[i].image )
+      pre_event_buffer[i].image = new Image( width, height, camera->Colours(), camera->SubpixelOrder() );
+    pre_event_buffer[i].image->Assign( *image_buffer[slot].image );
+    if ( !ImageUnchanged( slot, pre_event_seqs[i] ) ) {
+      // An empty timestamp leaves it out of any event
+      Debug( 1, "Pre event image in slot %d was overwritten before it could be kept", slot );
+      pre_event_buffer[i].timestamp->tv_sec = 0;
+    }
+    pre_event_slots[i] = -1;
+  }
+}
+
+// Copies a pre event image out of the ring for a new event to write out,
+// leaving it out of the event if capture rewrote the slot meanwhile
+void Monitor::CopyPreEventFrame( int i, int slot ) {
+  uint32_t seq = BeginImageRead( slot );
+  if ( !pre_event_copies[i].image )
+    pre_event_copies[i].image = new Image( width, height, camera->Colours(), camera->SubpixelOrder() );
+  pre_event_copies[i].image->Assign( *image_buffer[slot].image );
+  *(pre_event_copies[i].timestamp) = *(image_buffer[slot].timestamp);
+  if ( !EndImageRead( slot, seq ) ) {
+    Debug( 1, "Pre event image in slot %d was overwritten while it was copied", slot );
+    pre_event_copies[i].timestamp->tv_sec = 0;
+  }
+  timestamps[i] = pre_event_copies[i].timestamp;
+  images[i] = pre_event_copies[i].image;
+}
+
+// Sized by pre_event_count, so Analyse makes them again once that changes
+void Monitor::DeletePreEventArrays() {
+  if ( timestamps ) {
+    delete[] timestamps;
+    timestamps = 0;
+  }
+  if ( images ) {
+    delete[] images;
+    images = 0;
+  }
+  if ( pre_event_copies ) {
+    for ( int i = 0; i < pre_event_count; i++ ) {
+      delete pre_event_copies[i].image;
+      delete pre_event_copies[i].timestamp;
+    }
+    delete[] pre_event_copies;
+    pre_event_copies = 0;
+  }
 }
 
 void Monitor::Reload() {
@@ -1762,7 +2344,7 @@ void Monitor::Reload() {
     closeEvent();
   }
 
-  static char sql[ZM_SQL_MED_BUFSIZ];
+  char sql[ZM_SQL_MED_BUFSIZ];
   // This seems to have fallen out of date.
   snprintf( sql, sizeof(sql), "select Function+0, Enabled, LinkedMonitors, EventPrefix, LabelFormat, LabelX, LabelY, LabelSize, WarmupCount, PreEventCount, PostEventCount, AlarmFrameCount, SectionLength, FrameSkip, MotionFrameSkip, AnalysisFPSLimit, AnalysisUpdateDelay, MaxFPS, AlarmMaxFPS, FPSReportInterval, RefBlendPerc, AlarmRefBlendPerc, TrackMotion, SignalCheckColour from Monitors where Id = '%d'", id );
 
@@ -1791,7 +2373,11 @@ void Monitor::Reload() {
     label_coord = Coord( atoi(dbrow[index]), atoi(dbrow[index+1]) ); index += 2;
     label_size = atoi(dbrow[index++]);
     warmup_count = atoi(dbrow[index++]);
-    pre_event_count = atoi(dbrow[index++]);
+    int new_pre_event_count = atoi(dbrow[index++]);
+    if ( new_pre_event_count != pre_event_count ) {
+      DeletePreEventArrays();
+      pre_event_count = new_pre_event_count;
+    }
     post_event_count = atoi(dbrow[index++]);
     alarm_frame_count = atoi(dbrow[index++]);
     section_length = atoi(dbrow[index++]);
@@ -1820,6 +2406,11 @@ void Monitor::Reload() {
       shared_data->active = true;
     ready_count = image_count+warmup_count;
 
+    if ( purpose == ANALYSIS ) {
+      SetDecodeReader( AnalysisNeedsImages() );
+      RegisterReader( function > MONITOR );
+    }
+
     ReloadLinkedMonitors( p_linked_monitors );
     delete row;
   } // end if row
@@ -1896,16 +2487,10 @@ void Monitor::ReloadLinkedMonitors( const char *p_linked_monitors ) {
       for ( int i = 0; i < n_link_ids; i++ ) {
         Debug( 1, "Checking linked monitor %d", link_ids[i] );
 
-        static char sql[ZM_SQL_SML_BUFSIZ];
+        char sql[ZM_SQL_SML_BUFSIZ];
         snprintf( sql, sizeof(sql), "select Id, Name from Monitors where Id = %d and Function != 'None' and Function != 'Monitor' and Enabled = 1", link_ids[i] );
-        if ( mysql_query( &dbconn, sql ) ) {
-          Error( "Can't run query: %s", mysql_error( &dbconn ) );
-          exit( mysql_errno( &dbconn ) );
-        }
-
-        MYSQL_RES *result = mysql_store_result( &dbconn );
+        MYSQL_RES *result = zmDbFetch( sql );
         if ( !result ) {
-          Error( "Can't use query result: %s", mysql_error( &dbconn ) );
           exit( mysql_errno( &dbconn ) );
         }
         int n_monitors = mysql_num_rows( result );
@@ -2335,6 +2920,11 @@ int Monitor::Capture() {
 
   unsigned int deinterlacing_value = deinterlacing & 0xff;
 
+  // Let readers know that this slot, and any the camera may already be
+  // filling after it, are changing
+  for ( unsigned int ahead = 0; ahead <= camera->SharedBuffersAhead(); ahead++ )
+    BeginImageWrite( (index+ahead)%image_buffer_count );
+
   if ( deinterlacing_value == 4 ) {
     if ( FirstCapture != 1 ) {
       /* Copy the next image into the shared memory */
@@ -2355,6 +2945,7 @@ int Monitor::Capture() {
 
     if ( FirstCapture ) {
       FirstCapture = 0;
+      EndImageWrite( index );
       return 0;
     }
 
@@ -2381,6 +2972,9 @@ int Monitor::Capture() {
     Rgb signalcolor;
     signalcolor = rgb_convert(signal_check_colour, ZM_SUBPIX_ORDER_BGR); /* HTML colour code is actually BGR in memory, we want RGB */
     capture_image->Fill(signalcolor);
+    if ( jpeg_slots )
+      jpeg_slots[index].size = 0;
+    EndImageWrite( index );
   } else if ( captureResult > 0 ) {
     Debug(4, "Return from Capture (%d)", captureResult);
 
@@ -2419,32 +3013,43 @@ int Monitor::Capture() {
 
     if ( capture_image->Size() > camera->ImageSize() ) {
       Error( "Captured image %d does not match expected size %d check width, height and colour depth",capture_image->Size(),camera->ImageSize() );
+      EndImageWrite( index );
       return -1;
     }
 
-    if ( (index == shared_data->last_read_index) && (function > MONITOR) ) {
-      Warning( "Buffer overrun at index %d, image %d, slow down capture, speed up analysis or increase ring buffer size", index, image_count );
-      time_t now = time(0);
-      double approxFps = double(image_buffer_count)/double(now-image_buffer[index].timestamp->tv_sec);
-      time_t last_read_delta = now - shared_data->last_read_time;
-      if ( last_read_delta > (image_buffer_count/approxFps) ) {
-        Warning( "Last image read from shared memory %ld seconds ago, zma may have gone away", last_read_delta )
-        shared_data->last_read_index = image_buffer_count;
-      }
-    }
+    // A camera capturing straight into the ring may already be filling the slots after this one
+    CheckReaders( index, camera->SharedBuffersAhead() );
 
     if ( privacy_bitmask )
       capture_image->MaskPrivacy( privacy_bitmask );
 
+    activity_scores[index] = camera->Activity();
+
     // Might be able to remove this call, when we start passing around ZMPackets, which will already have a timestamp
     gettimeofday( image_buffer[index].timestamp, NULL );
     if ( config.timestamp_on_capture ) {
       TimestampImage( capture_image, image_buffer[index].timestamp );
     }
+    if ( jpeg_slots )
+      StoreCapturedJpeg( index, deinterlacing_value );
     // Maybe we don't need to do this on all camera types
     shared_data->signal = signal_check_points ? CheckSignal(capture_image) : true;
+    EndImageWrite( index );
     shared_data->last_write_index = index;
     shared_data->last_write_time = image_buffer[index].timestamp->tv_sec;
+    NotifyCapture();
+
+    struct timeval arrival;
+    if ( camera->CaptureArrival( arrival ) ) {
+      int latency = tvDiffUsec( arrival, *image_buffer[index].timestamp );
+      if ( latency >= 0 ) {
+        shared_data->capture_latency_usec = latency;
+        if ( shared_data->capture_latency_avg_usec )
+          shared_data->capture_latency_avg_usec = ( 7 * (uint64_t)shared_data->capture_latency_avg_usec + latency ) / 8;
+        else
+          shared_data->capture_latency_avg_usec = latency;
+      }
+    }
 
     image_count++;
 
@@ -2470,6 +3075,8 @@ int Monitor::Capture() {
         } // end if new_fps != fps
       } // end if time has changed since last update
     } // end if it might be time to report the fps
+  } else {
+    EndImageWrite( index );
   } // end if captureResult
 
   // Icon: I'm not sure these should be here. They have nothing to do with capturing
@@ -2490,6 +3097,67 @@ int Monitor::Capture() {
   return captureResult;
 }
 
+// Keep the JPEG the camera sent for a ring slot, if the decoded image hasn't been changed from it
+void Monitor::StoreCapturedJpeg( unsigned int index, unsigned int deinterlacing_value ) {
+  JpegSlot *jpeg_slot = &jpeg_slots[index];
+
+  // Readers check the size is unchanged after copying, so clear it before touching the data
+  jpeg_slot->size = 0;
+  __sync_synchronize();
+
+  unsigned int jpeg_size = 0;
+  const uint8_t *jpeg = camera->CapturedJpeg( jpeg_size );
+  if ( !jpeg || !jpeg_size )
+    return;
+  if ( deinterlacing_value || orientation != ROTATE_0 || privacy_bitmask || label_format[0] || camera->Colours() == ZM_COLOUR_GRAY8 ) {
+    // The stored and streamed images would no longer match the camera's
+    return;
+  }
+  if ( jpeg_size > jpeg_slot_size ) {
+    Debug( 3, "Captured JPEG of %d bytes is larger than the %d bytes kept for it", jpeg_size, jpeg_slot_size );
+    return;
+  }
+
+  memcpy( jpeg_data+((size_t)index*jpeg_slot_size), jpeg, jpeg_size );
+  jpeg_slot->timestamp_sec = image_buffer[index].timestamp->tv_sec;
+  jpeg_slot->timestamp_usec = image_buffer[index].timestamp->tv_usec;
+  __sync_synchronize();
+  jpeg_slot->size = jpeg_size;
+}
+
+unsigned int Monitor::GetCapturedJpeg( const Image *image, const struct timeval &timestamp, uint8_t *buffer, unsigned int buffer_size ) const {
+  if ( !jpeg_slots )
+    return( 0 );
+
+  // Only images in the shared ring have a JPEG kept for them
+  const uint8_t *first = image_buffer[0].image->Buffer();
+  if ( image->Buffer() < first )
+    return( 0 );
+  size_t offset = image->Buffer() - first;
+  unsigned int index = offset / camera->ImageSize();
+  if ( (offset % camera->ImageSize()) || index >= (unsigned int)image_buffer_count )
+    return( 0 );
+
+  const JpegSlot *jpeg_slot = &jpeg_slots[index];
+  unsigned int jpeg_size = jpeg_slot->size;
+  __sync_synchronize();
+  if ( !jpeg_size || jpeg_size > buffer_size )
+    return( 0 );
+  if ( jpeg_slot->timestamp_sec != timestamp.tv_sec || jpeg_slot->timestamp_usec != timestamp.tv_usec )
+    return( 0 );
+
+  memcpy( buffer, jpeg_data+((size_t)index*jpeg_slot_size), jpeg_size );
+
+  // If the capture process started rewriting the slot while we copied, either
+  // the size will have been cleared or the timestamp will have moved on
+  __sync_synchronize();
+  if ( jpeg_slot->size != jpeg_size || jpeg_slot->timestamp_sec != timestamp.tv_sec || jpeg_slot->timestamp_usec != timestamp.tv_usec ) {
+    Debug( 3, "JPEG for image %d was overwritten while being read", index );
+    return( 0 );
+  }
+  return( jpeg_size );
+}
+
 void Monitor::TimestampImage( Image *ts_image, const struct timeval *ts_time ) const {
   if ( label_format[0] ) {
     // Expand the strftime macros first
@@ -2551,6 +3219,35 @@ bool Monitor::closeEvent() {
   return false;
 }
 
+void Monitor::EmptyPreAlarmFrames() {
+  if ( pre_alarm_count > 0 ) {
+    for ( int i = 0; i < MAX_PRE_ALARM_FRAMES; i++ ) {
+      delete pre_alarm_data[i].image;
+      delete pre_alarm_data[i].alarm_frame;
+    }
+    memset( pre_alarm_data, 0, sizeof(pre_alarm_data) );
+  }
+  pre_alarm_count = 0;
+}
+
+void Monitor::AddPreAlarmFrame( Image *image, struct timeval timestamp, int score, Image *alarm_frame ) {
+  pre_alarm_data[pre_alarm_count].image = new Image( *image );
+  pre_alarm_data[pre_alarm_count].timestamp = timestamp;
+  pre_alarm_data[pre_alarm_count].score = score;
+  if ( alarm_frame ) {
+    pre_alarm_data[pre_alarm_count].alarm_frame = new Image( *alarm_frame );
+  }
+  pre_alarm_count++;
+}
+
+// Moves the prealarm frames into the current event
+void Monitor::SavePreAlarmFrames() {
+  for ( int i = 0; i < pre_alarm_count; i++ ) {
+    event->AddFrame( pre_alarm_data[i].image, pre_alarm_data[i].timestamp, pre_alarm_data[i].score, pre_alarm_data[i].alarm_frame );
+  }
+  EmptyPreAlarmFrames();
+}
+
 unsigned int Monitor::DetectMotion( const Image &comp_image, Event::StringSet &zoneSet ) {
   bool alarm = false;
   unsigned int score = 0;
@@ -2560,20 +3257,16 @@ unsigned int Monitor::DetectMotion( const Image &comp_image, Event::StringSet &z
   Storage *storage = this->getStorage();
 
   if ( config.record_diag_images ) {
-    static char diag_path[PATH_MAX] = "";
-    if ( !diag_path[0] ) {
-      snprintf( diag_path, sizeof(diag_path), "%s/%d/diag-r.jpg", storage->Path(), id );
-    }
+    char diag_path[PATH_MAX];
+    snprintf( diag_path, sizeof(diag_path), "%s/%d/diag-r.jpg", storage->Path(), id );
     ref_image.WriteJpeg( diag_path );
   }
 
   ref_image.Delta( comp_image, &delta_image );
 
   if ( config.record_diag_images ) {
-    static char diag_path[PATH_MAX] = "";
-    if ( !diag_path[0] ) {
-      snprintf( diag_path, sizeof(diag_path), "%s/%d/diag-d.jpg", storage->Path(), id );
-    }
+    char diag_path[PATH_MAX];
+    snprintf( diag_path, sizeof(diag_path), "%s/%d/diag-d.jpg", storage->Path(), id );
     delta_image.WriteJpeg( diag_path );
   }
 
@@ -44,6 +44,20 @@ class Monitor;
 #define MOTION_CAUSE "Motion"
 #define LINKED_CAUSE "Linked"
 
+// Seconds without a heartbeat after which decode readers are assumed to have gone away
+#define DECODE_READER_TIMEOUT 10
+
+// Ring readers which can register their position with the capture daemon
+#define READER_SLOTS 8
+// Seconds without reading an image after which a registered reader's slot is
+// released, provided it has also missed an image captured since it last read
+#define READER_TIMEOUT 10
+
+// Free ring space, as a percentage of the ring, that adaptive skip tries to keep
+#define ADAPTIVE_SKIP_HEADROOM 50
+// Number of analysed images over which adaptive skip makes up a shortfall in free ring space
+#define ADAPTIVE_SKIP_RECOVERY 4
+
 //
 // This is the main class for monitors. Each monitor is associated
 // with a camera and is effectively a collector for events.
@@ -106,7 +120,7 @@ protected:
 
   typedef enum { CLOSE_TIME, CLOSE_IDLE, CLOSE_ALARM } EventCloseMode;
 
-  /* sizeof(SharedData) expected to be 336 bytes on 32bit and 64bit */
+  /* sizeof(SharedData) expected to be 672 bytes on 32bit and 64bit */
   typedef struct {
     uint32_t size;              /* +0    */
     uint32_t last_write_index;  /* +4    */ 
@@ -145,8 +159,28 @@ protected:
     };
     uint8_t control_state[256];  /* +88   */
 
-    char alarm_cause[256];
-    
+    char alarm_cause[256];      /* +344  */
+
+    uint32_t decode_readers;    /* +600  Number of attached processes that need every frame decoded */
+    uint32_t epadding3;         /* +604  */
+    union {                     /* +608  */
+      time_t last_decode_read_time;  /* Heartbeat of the decode readers, so a crashed reader doesn't keep full decoding on */
+      uint64_t extrapad4;
+    };
+    uint32_t reconnects;        /* +616  Reconnects to the camera which have produced an image */
+    uint32_t reconnect_first_frame_msec; /* +620  Time from starting the last reconnect to its first image */
+    uint32_t capture_latency_usec;     /* +624  Time from the last image's data arriving to it being in the ring */
+    uint32_t capture_latency_avg_usec; /* +628  Moving average of the above */
+    uint32_t capture_seq;       /* +632  Bumped for each captured image, readers wait on it as a futex */
+    uint32_t capture_waiters;   /* +636  Number of readers waiting on capture_seq */
+    uint32_t torn_reads;        /* +640  Reads of ring images found to have been overwritten while in use */
+    uint32_t analysis_step;     /* +644  Ring slots analysis last moved on by, 1 if no images were skipped */
+    uint32_t overrun_eta_msec;  /* +648  Predicted time until capture overruns analysis, 0 if analysis is keeping up */
+    uint32_t analysis_cost_avg_usec; /* +652  Moving average of the time taken to analyse an image */
+    uint32_t source_frames_dropped;  /* +656  Frames the camera's receive thread dropped because capture didn't take them in time */
+    uint32_t source_recv_calls_per_100_frames; /* +660  System calls the receive thread made per 100 frames, over its last stats interval */
+    uint32_t epadding5;         /* +664  */
+    uint32_t epadding6;         /* +668  */
   } SharedData;
 
   typedef enum { TRIGGER_CANCEL, TRIGGER_ON, TRIGGER_OFF } TriggerState;
@@ -169,6 +203,29 @@ protected:
     void* padding;
   };
 
+  // Frame kept while in prealarm state, until an event is opened or the alarm passes
+  struct PreAlarmData {
+    Image *image;
+    struct timeval timestamp;
+    unsigned int score;
+    Image *alarm_frame;
+  };
+
+  typedef enum { READER_CRITICAL=0x1 } ReaderFlags;
+
+  /* sizeof(ReaderSlot) expected to be 32 bytes on 32bit and 64bit */
+  typedef struct {
+    volatile int32_t pid;       /* +0   Process holding the slot, 0 if free */
+    uint32_t flags;             /* +4   ReaderFlags */
+    volatile uint32_t cursor;   /* +8   Last ring index the reader has finished with */
+    volatile uint32_t drops;    /* +12  Images overwritten before the reader got to them */
+    union {                     /* +16  */
+      time_t heartbeat;         /* When the reader last read an image */
+      uint64_t extrapad1;
+    };
+    uint64_t reads;             /* +24  Images read */
+  } ReaderSlot;
+
   //TODO: Technically we can't exclude this struct when people don't have avformat as the Memory.pm module doesn't know about avformat
 #if 1
   //sizeOf(VideoStoreData) expected to be 4104 bytes on 32bit and 64bit
@@ -182,6 +239,14 @@ protected:
 
 #endif // HAVE_LIBAVFORMAT
 
+  /* Describes the original JPEG kept for a ring slot, sizeof(JpegSlot) expected to be 24 bytes on 32bit and 64bit */
+  typedef struct {
+    volatile uint32_t size;     /* 0 while the slot has no JPEG or it is being rewritten */
+    uint32_t padding;
+    int64_t timestamp_sec;      /* Capture time of the image it was decoded into */
+    int64_t timestamp_usec;
+  } JpegSlot;
+
   class MonitorLink {
   protected:
     unsigned int  id;
@@ -273,6 +338,9 @@ protected:
   int        stream_replay_buffer;   // How many frames to store to support DVR functions, IGNORED from this object, passed directly into zms now
   int        section_length;      // How long events should last in continuous modes
   bool      adaptive_skip;        // Whether to use the newer adaptive algorithm for this monitor
+  double    analysis_cost_usec;   // Moving average of the time taken to analyse an image
+  double    capture_interval_usec; // Moving average of the time between captured images
+  struct timeval last_analysed_time; // When the last image analysed was captured
   int        frame_skip;        // How many frames to skip in continuous modes
   int        motion_frame_skip;      // How many frames to skip in motion detection
   double      analysis_fps;  // Target framerate for video analysis
@@ -292,6 +360,7 @@ protected:
   Image      delta_image;
   Image      ref_image;
   Image       alarm_image;  // Used in creating analysis images, will be initialized in Analysis
+  Image       event_image;  // Copy of the analysed image taken before it is kept, as the ring slot may be rewritten
   Image       write_image;    // Used when creating snapshot images
 
   Purpose      purpose;        // What this monitor has been created to do
@@ -307,6 +376,8 @@ protected:
   time_t      last_fps_time;
   time_t      auto_resume_time;
   unsigned int      last_motion_score;
+  int        last_section_mod;
+  bool       last_signal;
 
   EventCloseMode  event_close_mode;
 
@@ -318,25 +389,40 @@ protected:
 #endif // ZM_MEM_MAPPED
   off_t        mem_size;
   unsigned char  *mem_ptr;
+  uint32_t     jpeg_slot_size;  // Bytes kept for each slot's original JPEG, 0 if not kept
   Storage      *storage;
 
   SharedData    *shared_data;
   TriggerData    *trigger_data;
   VideoStoreData  *video_store_data;
+  ReaderSlot      *reader_slots;
 
   Snapshot    *image_buffer;
+  int32_t     *activity_scores; // Per ring slot activity estimate from the camera, -1 if unknown
+  volatile uint32_t *image_seqs; // Per ring slot sequence counter, odd while the slot is being written
+  JpegSlot    *jpeg_slots;      // Per ring slot original JPEG from the camera, if kept
+  uint8_t     *jpeg_data;
   Snapshot    next_buffer; /* Used by four field deinterlacing */
-  Snapshot    *pre_event_buffer;
+  Snapshot    *pre_event_buffer;   // Image is only allocated once needed
+  int         *pre_event_slots;    // Ring slot each pre event image is still in, -1 once kept in the pre event buffer
+  uint32_t    *pre_event_seqs;     // Sequence of that ring slot when the image was analysed
 
   Camera      *camera;
 
   Event      *event;
+  // Per monitor, as one process may analyse several
+  int           pre_alarm_count;
+  PreAlarmData  pre_alarm_data[MAX_PRE_ALARM_FRAMES];
 
   int      n_zones;
   Zone      **zones;
 
   struct timeval    **timestamps;
   Image      **images;
+  Snapshot    *pre_event_copies;  // Pre event images copied out of the ring for a new event when analysing every image
+
+  bool      decode_reader;      // Whether this process has registered as needing decoded images
+  int       reader_slot;        // Our slot in reader_slots, -1 if not registered
 
   const unsigned char  *privacy_bitmask;
   std::thread   *event_delete_thread; // Used to close events, but continue processing.
@@ -344,6 +430,12 @@ protected:
   int      n_linked_monitors;
   MonitorLink    **linked_monitors;
 
+  void StoreCapturedJpeg( unsigned int index, unsigned int deinterlacing_value );
+  void NotifyCapture();
+  void CheckReaders( unsigned int index, unsigned int slots_ahead );
+  void BeginImageWrite( unsigned int index );
+  void EndImageWrite( unsigned int index );
+
 public:
   explicit Monitor( int p_id );
 
@@ -425,6 +517,10 @@ public:
   inline const char *EventPrefix() const {
     return event_prefix;
   }
+  // The ring slot the next captured frame will be written into
+  inline unsigned int NextWriteIndex() const {
+    return( image_count%image_buffer_count );
+  }
   inline bool Ready() {
     if ( function <= MONITOR )
       return false;
@@ -457,6 +553,38 @@ public:
   Snapshot *getSnapshot() const;
   struct timeval GetTimestamp( int index=-1 ) const;
   void UpdateAdaptiveSkip();
+  bool AnalysisNeedsImages() const;
+  void SetDecodeReader( bool p_decode_reader );
+  bool DecodingRequired() const;
+  void ReconnectDone( unsigned int first_frame_msec );
+  void SourceStats( uint32_t frames_dropped, uint32_t recv_calls_per_100_frames );
+  // For readers to sleep until the next image is captured, rather than polling.
+  // Take CaptureSeq() before looking for new images, then wait with it.
+  uint32_t CaptureSeq() const { return( shared_data->capture_seq ); }
+  bool WaitForCapture( uint32_t p_capture_seq, unsigned int timeout_usec ) const;
+  // Whether anything has been captured that analysis hasn't yet looked at
+  bool HasPendingImages() const { return( shared_data->last_read_index != shared_data->last_write_index ); }
+  // Ring images can be overwritten while they are being read. Take
+  // BeginImageRead() before using one and check EndImageRead() afterwards,
+  // which returns false, and counts a torn read, if it changed meanwhile.
+  uint32_t BeginImageRead( unsigned int index ) const;
+  bool EndImageRead( unsigned int index, uint32_t seq ) const;
+  // The same check without counting, for images that weren't being read
+  bool ImageUnchanged( unsigned int index, uint32_t seq ) const;
+  // Readers can register so that the capture daemon knows how far behind
+  // they are. Critical readers get overrun warnings, all get drops counted.
+  bool RegisterReader( bool critical );
+  void UnregisterReader();
+  void ReaderAt( unsigned int index );
+  // Megabytes per second of ring images compared by Image::Delta, to
+  // measure how the memory backing the ring performs
+  double BenchmarkDelta( unsigned int passes );
+  uint64_t HugePageBytes() const;
+  off_t MemSize() const { return( mem_size ); }
+  // Copy out the JPEG the camera sent for a ring image, if it was kept and the image
+  // has not been altered or overwritten since. Returns its size, or 0 if there isn't one.
+  unsigned int GetCapturedJpeg( const Image *image, const struct timeval &timestamp, uint8_t *buffer, unsigned int buffer_size ) const;
+  unsigned int CapturedJpegMaxSize() const { return( jpeg_slots ? jpeg_slot_size : 0 ); }
   useconds_t GetAnalysisRate();
   unsigned int GetAnalysisUpdateDelay() const { return analysis_update_delay; }
   int GetCaptureDelay() const { return capture_delay; }
@@ -493,10 +621,20 @@ public:
    // DetectBlack seems to be unused. Check it on zm_monitor.cpp for more info.
    //unsigned int DetectBlack( const Image &comp_image, Event::StringSet &zoneSet );
   bool CheckSignal( const Image *image );
-  bool Analyse();
+  // Analyses the next image, or all pending ones in batch mode, returning how many
+  int Analyse();
+  int AdaptiveSkipStep( int headroom ) const;
+  int NextAnalysisIndex();
+  void AnalyseImage( int index, const struct timeval &now );
+  void KeepPreEventFrames( bool all );
+  void CopyPreEventFrame( int i, int slot );
+  void DeletePreEventArrays();
   void DumpImage( Image *dump_image ) const;
   void TimestampImage( Image *ts_image, const struct timeval *ts_time ) const;
   bool closeEvent();
+  void EmptyPreAlarmFrames();
+  void AddPreAlarmFrame( Image *image, struct timeval timestamp, int score=0, Image *alarm_frame=NULL );
+  void SavePreAlarmFrames();
 
   void Reload();
   void ReloadZones();
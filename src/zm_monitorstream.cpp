@@ -27,6 +27,16 @@
 #include <arpa/inet.h>
 #include <glob.h>
 
+// Raw and zipped images are taken to be RGB, so planar ones are converted for them
+static Image *rgbImage( Image *image ) {
+  if ( image->SubpixelOrder() != ZM_SUBPIX_ORDER_YUV420P )
+    return image;
+  static Image rgb_image;
+  rgb_image.Assign( *image );
+  rgb_image.Colourise( ZM_COLOUR_RGB24, ZM_SUBPIX_ORDER_RGB );
+  return &rgb_image;
+}
+
 bool MonitorStream::checkSwapPath(const char *path, bool create_path) {
 
   struct stat stat_buf;
@@ -352,7 +362,16 @@ bool MonitorStream::sendFrame(const char *filepath, struct timeval *timestamp) {
   return false;
 } // end bool MonitorStream::sendFrame(const char *filepath, struct timeval *timestamp)
 
-bool MonitorStream::sendFrame(Image *image, struct timeval *timestamp) {
+bool MonitorStream::sendFrame(Image *image, struct timeval *timestamp, int ring_index) {
+  uint32_t image_seq = 0;
+  if ( ring_index >= 0 ) {
+    image_seq = monitor->BeginImageRead(ring_index);
+    if ( image_seq & 1 ) {
+      // Being captured into, a newer image will be along shortly
+      Debug(2, "Image %d is being written, skipping it", ring_index);
+      return true;
+    }
+  }
   Image *send_image = prepareImage(image);
   if ( !config.timestamp_on_capture && timestamp )
     monitor->TimestampImage(send_image, timestamp);
@@ -382,20 +401,26 @@ bool MonitorStream::sendFrame(Image *image, struct timeval *timestamp) {
     struct timeval frameStartTime;
     gettimeofday(&frameStartTime, NULL);
     
-    fputs("--ZoneMinderFrame\r\n", stdout);
+    const char *content_type;
     switch( type ) {
       case STREAM_JPEG :
-        send_image->EncodeJpeg(img_buffer, &img_buffer_size);
-        fputs("Content-Type: image/jpeg\r\n", stdout);
+        // Unscaled ring images can go out as the JPEG the camera sent, if it was kept
+        if ( send_image == image && timestamp )
+          img_buffer_size = monitor->GetCapturedJpeg(image, *timestamp, img_buffer, sizeof(temp_img_buffer));
+        if ( !img_buffer_size )
+          send_image->EncodeJpeg(img_buffer, &img_buffer_size);
+        content_type = "image/jpeg";
         break;
       case STREAM_RAW :
-        fputs("Content-Type: image/x-rgb\r\n", stdout);
+        content_type = "image/x-rgb";
+        send_image = rgbImage(send_image);
         img_buffer = (uint8_t*)send_image->Buffer();
         img_buffer_size = send_image->Size();
         break;
       case STREAM_ZIP :
-        fputs("Content-Type: image/x-rgbz\r\n",stdout);
+        content_type = "image/x-rgbz";
         unsigned long zip_buffer_size;
+        send_image = rgbImage(send_image);
         send_image->Zip(img_buffer, &zip_buffer_size);
         img_buffer_size = zip_buffer_size;
         break;
@@ -403,6 +428,15 @@ bool MonitorStream::sendFrame(Image *image, struct timeval *timestamp) {
         Error("Unexpected frame type %d", type);
         return false;
     }
+    // Anything made from a ring image which was overwritten meanwhile is
+    // garbage, so leave it for the next image. Raw images are sent straight
+    // from the ring so can only be checked this far.
+    if ( ring_index >= 0 && !monitor->EndImageRead(ring_index, image_seq) ) {
+      Debug(2, "Image %d was overwritten while being encoded, skipping it", ring_index);
+      return true;
+    }
+    fputs("--ZoneMinderFrame\r\n", stdout);
+    fprintf(stdout, "Content-Type: %s\r\n", content_type);
     fprintf(stdout, "Content-Length: %d\r\n\r\n", img_buffer_size);
     if ( fwrite(img_buffer, img_buffer_size, 1, stdout) != 1 ) {
       if ( !zm_terminate ){ 
@@ -443,6 +477,10 @@ void MonitorStream::runStream() {
 
   updateFrameRate(monitor->GetFPS());
 
+  // Let the capture daemon know that we want every frame decoded
+  monitor->SetDecodeReader(true);
+  monitor->RegisterReader(false);
+
   if ( type == STREAM_JPEG )
     fputs("Content-Type: multipart/x-mixed-replace;boundary=ZoneMinderFrame\r\n\r\n", stdout);
 
@@ -523,7 +561,11 @@ void MonitorStream::runStream() {
       break;
     }
 
+    // Taken before looking for an image so that one captured meanwhile still wakes us
+    uint32_t capture_seq = monitor->CaptureSeq();
+
     gettimeofday(&now, NULL);
+    monitor->shared_data->last_decode_read_time = now.tv_sec;
 
     bool was_paused = paused;
     if ( connkey ) {
@@ -634,10 +676,11 @@ Debug(2, "Have checking command Queue for connkey: %d", connkey );
           Monitor::Snapshot *snap = &monitor->image_buffer[index];
 
             //Debug(2, "sending Frame.");
-          if ( !sendFrame(snap->image, snap->timestamp) ) {
+          if ( !sendFrame(snap->image, snap->timestamp, index) ) {
             Debug(2, "sendFrame failed, quiting.");
             zm_terminate = true;
           }
+          monitor->ReaderAt(index);
           // Perhaps we should use NOW instead. 
           memcpy(&last_frame_timestamp, snap->timestamp, sizeof(last_frame_timestamp));
           //frame_sent = true;
@@ -691,8 +734,8 @@ Debug(2, "Have checking command Queue for connkey: %d", connkey );
     } // end if ( (unsigned int)last_read_index != monitor->shared_data->last_write_index ) 
 
     unsigned long sleep_time = (unsigned long)((1000000 * ZM_RATE_BASE)/((base_fps?base_fps:1)*abs(replay_rate*2)));
-    Debug(4, "Sleeping for (%d)", sleep_time);
-    usleep(sleep_time);
+    Debug(4, "Waiting for up to (%d)", sleep_time);
+    monitor->WaitForCapture(capture_seq, sleep_time);
     if ( ttl ) {
       if ( (now.tv_sec - stream_start_time) > ttl ) {
         Debug(2, "now(%d) - start(%d) > ttl(%d) break", now.tv_sec, stream_start_time, ttl);
@@ -709,6 +752,9 @@ Debug(2, "Have checking command Queue for connkey: %d", connkey );
     }
   } // end while
 
+  monitor->SetDecodeReader(false);
+  monitor->UnregisterReader();
+
   if ( buffered_playback ) {
     Debug(1, "Cleaning swap files from %s", swap_path.c_str());
     struct stat stat_buf;
@@ -782,6 +828,7 @@ void MonitorStream::SingleImageRaw( int scale ) {
   if ( !config.timestamp_on_capture ) {
     monitor->TimestampImage( snap_image, snap->timestamp );
   }
+  snap_image = rgbImage( snap_image );
   
   fprintf( stdout, "Content-Length: %d\r\n", snap_image->Size() );
   fprintf( stdout, "Content-Type: image/x-rgb\r\n\r\n" );
@@ -804,6 +851,7 @@ void MonitorStream::SingleImageZip( int scale ) {
   if ( !config.timestamp_on_capture ) {
     monitor->TimestampImage( snap_image, snap->timestamp );
   }
+  snap_image = rgbImage( snap_image );
   snap_image->Zip( img_buffer, &img_buffer_size );
   
   fprintf( stdout, "Content-Length: %ld\r\n", img_buffer_size );
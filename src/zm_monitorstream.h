@@ -51,7 +51,8 @@ class MonitorStream : public StreamBase {
     bool checkSwapPath( const char *path, bool create_path );
 
     bool sendFrame( const char *filepath, struct timeval *timestamp );
-    bool sendFrame( Image *image, struct timeval *timestamp );
+    // ring_index is the ring slot the image is in, if it is one of the monitor's
+    bool sendFrame( Image *image, struct timeval *timestamp, int ring_index=-1 );
     void processCommand( const CmdMsg *msg );
     void SingleImage( int scale=100 );
     void SingleImageRaw( int scale=100 );
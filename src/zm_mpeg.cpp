@@ -145,7 +145,11 @@ void VideoStream::SetupCodec( int colours, int subpixelorder, int width, int hei
 	    }
 	    break;
 	  case ZM_COLOUR_GRAY8:
-	    pf = AV_PIX_FMT_GRAY8;
+	    if(subpixelorder == ZM_SUBPIX_ORDER_YUV420P) {
+	      pf = AV_PIX_FMT_YUV420P;
+	    } else {
+	      pf = AV_PIX_FMT_GRAY8;
+	    }
 	    break;
 	  default:
 	    Panic("Unexpected colours: %d",colours);
@@ -24,6 +24,15 @@
 
 using namespace std;
 
+ZMPacket::ZMPacket() {
+  frame = NULL;
+  image = NULL;
+  av_init_packet( &packet );
+  packet.data = NULL;
+  packet.size = 0;
+  timestamp.tv_sec = timestamp.tv_usec = 0;
+}
+
 ZMPacket::ZMPacket( AVPacket *p ) {
   frame = NULL;
   image = NULL;
@@ -38,6 +38,7 @@ class ZMPacket {
     struct timeval timestamp;
   public:
     AVPacket *av_packet() { return &packet; }
+    ZMPacket();
     ZMPacket( AVPacket *packet, struct timeval *timestamp );
     explicit ZMPacket( AVPacket *packet );
     ~ZMPacket();
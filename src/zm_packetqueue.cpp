@@ -21,169 +21,176 @@
 #include "zm_ffmpeg.h"
 #include <sys/time.h>
 
-#define VIDEO_QUEUESIZE 200
-#define AUDIO_QUEUESIZE 50
-
-zm_packetqueue::zm_packetqueue(){
-
+zm_packetqueue::zm_packetqueue( unsigned int p_max_packets, size_t p_max_bytes ) :
+  max_packets( p_max_packets ),
+  max_bytes( p_max_bytes ),
+  video_stream_id( -1 ),
+  head( 0 ),
+  tail( 0 ),
+  video_count( 0 ),
+  queued_bytes( 0 ),
+  popped( NULL ),
+  keyframe_head( 0 ),
+  keyframe_tail( 0 )
+{
+  packets = new ZMPacket[max_packets];
+  video_counts = new uint64_t[max_packets];
+  keyframes = new uint64_t[max_packets];
 }
 
 zm_packetqueue::~zm_packetqueue() {
   clearQueue();
+  delete[] packets;
+  delete[] video_counts;
+  delete[] keyframes;
 }
 
-bool zm_packetqueue::queuePacket( ZMPacket* zm_packet ) {
-	pktQueue.push_back( zm_packet );
-
-	return true;
-}
 bool zm_packetqueue::queuePacket( AVPacket* av_packet ) {
-    
-  ZMPacket *zm_packet = new ZMPacket( av_packet );
- 
-	pktQueue.push_back( zm_packet );
+  struct timeval now;
+  gettimeofday( &now, NULL );
+  return queuePacket( av_packet, &now );
+}
+
+bool zm_packetqueue::queuePacket( AVPacket* av_packet, struct timeval *timestamp ) {
+  bool is_video = ( av_packet->stream_index == video_stream_id );
+  bool keyframe = is_video && ( av_packet->flags & AV_PKT_FLAG_KEY );
 
-	return true;
+  while ( ( tail - head >= max_packets ) || ( ( tail != head ) && ( queued_bytes + av_packet->size > max_bytes ) ) ) {
+    if ( !dropOldestGop() )
+      break;
+  }
+  if ( ( head == tail ) && !keyframe ) {
+    // The queue must start with a video keyframe
+    Debug(3, "Not queuing packet from stream %d on an empty queue, not a video keyframe", av_packet->stream_index );
+    return false;
+  }
+
+  unsigned int slot = tail % max_packets;
+  ZMPacket *zm_packet = &packets[slot];
+  if ( zm_packet == popped )
+    popped = NULL;
+  zm_av_packet_unref( &zm_packet->packet );
+  if ( zm_av_packet_ref( &zm_packet->packet, av_packet ) < 0 ) {
+    Error("error refing packet");
+    return false;
+  }
+  zm_packet->timestamp = *timestamp;
+
+  video_counts[slot] = video_count;
+  if ( is_video )
+    video_count++;
+  if ( keyframe )
+    keyframes[keyframe_tail++ % max_packets] = tail;
+
+  queued_bytes += zm_packet->packet.size;
+  tail++;
+
+  return true;
 }
 
 ZMPacket* zm_packetqueue::popPacket( ) {
-	if ( pktQueue.empty() ) {
-		return NULL;
-	}
+  if ( popped ) {
+    zm_av_packet_unref( &popped->packet );
+    popped = NULL;
+  }
+  if ( head == tail ) {
+    return NULL;
+  }
 
-	ZMPacket *packet = pktQueue.front();
-	pktQueue.pop_front();
+  popped = &packets[head % max_packets];
+  queued_bytes -= popped->packet.size;
+  head++;
+  while ( ( keyframe_head != keyframe_tail ) && ( keyframes[keyframe_head % max_packets] < head ) )
+    keyframe_head++;
 
-	return packet;
+  return popped;
 }
 
-unsigned int zm_packetqueue::clearQueue( unsigned int frames_to_keep, int stream_id ) {
-  
-  Debug(3, "Clearing all but %d frames, queue has %d", frames_to_keep, pktQueue.size() );
+// Releases all packets before seq, which must be within the queue.
+unsigned int zm_packetqueue::trimTo( uint64_t seq ) {
+  unsigned int delete_count = 0;
+  while ( head < seq ) {
+    ZMPacket *zm_packet = &packets[head % max_packets];
+    queued_bytes -= zm_packet->packet.size;
+    zm_av_packet_unref( &zm_packet->packet );
+    head++;
+    delete_count++;
+  }
+  while ( ( keyframe_head != keyframe_tail ) && ( keyframes[keyframe_head % max_packets] < head ) )
+    keyframe_head++;
+  return delete_count;
+}
+
+// Makes room by dropping everything before the second keyframe.  Returns false
+// if the queue had to be emptied because it only holds a single GOP.
+bool zm_packetqueue::dropOldestGop() {
+  if ( keyframe_tail - keyframe_head < 2 ) {
+    Warning("Packet queue full with a single GOP of %d packets, %zu bytes, clearing it", size(), queued_bytes );
+    clearQueue();
+    return false;
+  }
+  unsigned int deleted = trimTo( keyframes[(keyframe_head+1) % max_packets] );
+  Debug(3, "Packet queue full, dropped %d packets, now %d packets, %zu bytes", deleted, size(), queued_bytes );
+  return true;
+}
+
+unsigned int zm_packetqueue::clearQueue( unsigned int frames_to_keep ) {
+  Debug(3, "Clearing all but %d frames, queue has %d", frames_to_keep, size() );
   frames_to_keep += 1;
 
-	if ( pktQueue.empty() ) {
+  if ( head == tail ) {
     Debug(3, "Queue is empty");
     return 0;
   }
 
-  std::list<ZMPacket *>::reverse_iterator it;
-  ZMPacket *packet = NULL;
-
-  for ( it = pktQueue.rbegin(); it != pktQueue.rend() && frames_to_keep; ++it ) {
-    ZMPacket *zm_packet = *it;
-    AVPacket *av_packet = &(zm_packet->packet);
-       
-    Debug(4, "Looking at packet with stream index (%d) with keyframe (%d), frames_to_keep is (%d)", av_packet->stream_index, ( av_packet->flags & AV_PKT_FLAG_KEY ), frames_to_keep );
-    
-    // Want frames_to_keep video keyframes.  Otherwise, we may not have enough
-    if ( ( av_packet->stream_index == stream_id) ) {
-      //&& ( av_packet->flags & AV_PKT_FLAG_KEY ) ) {
-      frames_to_keep --;
-    }
-  }
-
-    // Make sure we start on a keyframe
-  for ( ; it != pktQueue.rend(); ++it ) {
-    ZMPacket *zm_packet = *it;
-    AVPacket *av_packet = &(zm_packet->packet);
-       
-    Debug(5, "Looking for keyframe at packet with stream index (%d) with keyframe (%d), frames_to_keep is (%d)", av_packet->stream_index, ( av_packet->flags & AV_PKT_FLAG_KEY ), frames_to_keep );
-    
-    // Want frames_to_keep video keyframes.  Otherwise, we may not have enough
-    if ( ( av_packet->stream_index == stream_id) && ( av_packet->flags & AV_PKT_FLAG_KEY ) ) {
-    Debug(4, "Found keyframe at packet with stream index (%d) with keyframe (%d), frames_to_keep is (%d)", av_packet->stream_index, ( av_packet->flags & AV_PKT_FLAG_KEY ), frames_to_keep );
-      break;
+  // Find the newest keyframe that still leaves us frames_to_keep video frames
+  for ( uint64_t i = keyframe_tail; i != keyframe_head; i-- ) {
+    uint64_t seq = keyframes[(i-1) % max_packets];
+    if ( video_count - video_counts[seq % max_packets] >= frames_to_keep ) {
+      unsigned int delete_count = trimTo( seq );
+      Debug(3, "Deleted (%d) packets", delete_count );
+      return delete_count;
     }
   }
-  if ( frames_to_keep ) {
-    Debug(3, "Hit end of queue, still need (%d) video frames", frames_to_keep );
-  }
-  if ( it != pktQueue.rend() ) {
-    // We want to keep this packet, so advance to the next
-    ++it;
-  }
-  unsigned int delete_count = 0;
-  while ( it != pktQueue.rend() ) {
-    Debug(4, "Deleting a packet from the front, count is (%d)", delete_count );
-
-    packet = pktQueue.front();
-    pktQueue.pop_front();
-    delete packet;
-
-    delete_count += 1;
-  }    
-  Debug(3, "Deleted (%d) packets", delete_count );
-  return delete_count; 
-} // end unsigned int zm_packetqueue::clearQueue( unsigned int frames_to_keep, int stream_id )
+  Debug(3, "Hit start of queue, keeping all %d packets", size() );
+  return 0;
+} // end unsigned int zm_packetqueue::clearQueue( unsigned int frames_to_keep )
 
 void zm_packetqueue::clearQueue() {
-  ZMPacket *packet = NULL;
-	while(!pktQueue.empty()) {
-    packet = pktQueue.front();
-    pktQueue.pop_front();
-    delete packet;
-	}
+  if ( popped ) {
+    zm_av_packet_unref( &popped->packet );
+    popped = NULL;
+  }
+  trimTo( tail );
 }
 
 unsigned int zm_packetqueue::size() {
-  return pktQueue.size();
+  return tail - head;
 }
 
-
-void zm_packetqueue::clear_unwanted_packets( timeval *recording_started, int mVideoStreamId ) {
+void zm_packetqueue::clear_unwanted_packets( timeval *recording_started ) {
   // Need to find the keyframe <= recording_started.  Can get rid of audio packets.
-	if ( pktQueue.empty() ) {
-		return;
-	}
-
-  // Step 1 - find keyframe < recording_started.
-  // Step 2 - pop packets until we get to the packet in step 2
-  std::list<ZMPacket *>::reverse_iterator it;
-
-  Debug(3, "Looking for keyframe after start recording stream id (%d)", mVideoStreamId );
-  for ( it = pktQueue.rbegin(); it != pktQueue.rend(); ++ it ) {
-    ZMPacket *zm_packet = *it;
-    AVPacket *av_packet = &(zm_packet->packet);
-    if ( 
-        ( av_packet->flags & AV_PKT_FLAG_KEY ) 
-        && 
-        ( av_packet->stream_index == mVideoStreamId )
-        && 
-        timercmp( &(zm_packet->timestamp), recording_started, < )
-       ) {
-    Debug(3, "Found keyframe before start with stream index (%d) with keyframe (%d)", av_packet->stream_index, ( av_packet->flags & AV_PKT_FLAG_KEY ) );
-      break;
+  if ( head == tail ) {
+    return;
+  }
+
+  // Keyframes are queued in time order, so find the first one at or after
+  // the start of recording, we want the one before it.
+  uint64_t low = keyframe_head;
+  uint64_t high = keyframe_tail;
+  while ( low < high ) {
+    uint64_t mid = low + (high-low)/2;
+    if ( timercmp( &(packets[keyframes[mid % max_packets] % max_packets].timestamp), recording_started, < ) ) {
+      low = mid + 1;
+    } else {
+      high = mid;
     }
   }
-  if ( it == pktQueue.rend() ) {
+  if ( low == keyframe_head ) {
     Debug(1, "Didn't find a keyframe before event starttime. keeping all" );
     return;
   }
 
-  ZMPacket *zm_packet = *it;
-  AVPacket *av_packet = &(zm_packet->packet);
-  Debug(3, "Found packet before start with stream index (%d) with keyframe (%d), distance(%d), size(%d)", 
-      av_packet->stream_index, 
-      ( av_packet->flags & AV_PKT_FLAG_KEY ), 
-      distance( it, pktQueue.rend() ),
-      pktQueue.size() );
-
-  unsigned int deleted_frames = 0;
-  ZMPacket *packet = NULL;
-  while ( distance( it, pktQueue.rend() ) > 1 ) {
-  //while ( pktQueue.rend() != it ) {
-    packet = pktQueue.front();
-    pktQueue.pop_front();
-    delete packet;
-    deleted_frames += 1;
-  }
-
-  zm_packet = pktQueue.front();
-  av_packet = &(zm_packet->packet);
-  if ( ( ! ( av_packet->flags & AV_PKT_FLAG_KEY ) ) || ( av_packet->stream_index != mVideoStreamId ) ) {
-    Error( "Done looking for keyframe.  Deleted %d frames. Remaining frames in queue: %d stream of head packet is (%d), keyframe (%d), distance(%d), packets(%d)", deleted_frames, pktQueue.size(), av_packet->stream_index, ( av_packet->flags & AV_PKT_FLAG_KEY ), distance( it, pktQueue.rend() ), pktQueue.size() );
-  } else {
-    Debug(1, "Done looking for keyframe.  Deleted %d frames. Remaining frames in queue: %d stream of head packet is (%d), keyframe (%d), distance(%d), packets(%d)", deleted_frames, pktQueue.size(), av_packet->stream_index, ( av_packet->flags & AV_PKT_FLAG_KEY ), distance( it, pktQueue.rend() ), pktQueue.size() );
-  }
+  unsigned int deleted_frames = trimTo( keyframes[(low-1) % max_packets] );
+  Debug(1, "Done looking for keyframe.  Deleted %d frames. Remaining frames in queue: %d", deleted_frames, size() );
 }
@@ -23,30 +23,57 @@
 //#include <boost/interprocess/managed_shared_memory.hpp>
 //#include <boost/interprocess/containers/map.hpp>
 //#include <boost/interprocess/allocators/allocator.hpp>
-#include <list>
 #include "zm_packet.h"
 
 extern "C" {
 #include <libavformat/avformat.h>
 }
 
+#define PACKETQUEUE_MAX_PACKETS 2048                // Slots in the ring, covers video and audio
+#define PACKETQUEUE_MAX_BYTES   (64*1024*1024)      // Compressed bytes we are prepared to hold
+
+//
+// Pre-event queue of compressed packets.  Packets are held in a preallocated
+// ring, referencing (not copying) the demuxer's buffers, and the positions of
+// the video keyframes are indexed so that trimming the queue back to a
+// keyframe doesn't have to walk it.  When either limit would be exceeded the
+// oldest GOP is dropped, so the queue always starts on a video keyframe.
+//
 class zm_packetqueue {
 public:
-    zm_packetqueue();
+    zm_packetqueue( unsigned int p_max_packets=PACKETQUEUE_MAX_PACKETS, size_t p_max_bytes=PACKETQUEUE_MAX_BYTES );
     virtual ~zm_packetqueue();
+    void setVideoStreamId( int p_video_stream_id ) { video_stream_id = p_video_stream_id; }
     bool queuePacket( AVPacket* packet, struct timeval *timestamp );
-    bool queuePacket( ZMPacket* packet );
     bool queuePacket( AVPacket* packet );
+    // The returned packet still belongs to the queue and is valid until the next call
     ZMPacket * popPacket( );
-    bool popVideoPacket(ZMPacket* packet);
-    bool popAudioPacket(ZMPacket* packet);
-    unsigned int clearQueue( unsigned int video_frames_to_keep, int stream_id );
+    unsigned int clearQueue( unsigned int video_frames_to_keep );
     void clearQueue( );
     unsigned int size();
-    void clear_unwanted_packets( timeval *recording, int mVideoStreamId );
+    size_t bytes() const { return queued_bytes; }
+    void clear_unwanted_packets( timeval *recording );
 private:
-    std::list<ZMPacket *>    pktQueue;
+    unsigned int trimTo( uint64_t seq );
+    bool dropOldestGop();
+
+    // Packets are addressed by an ever increasing sequence number, seq % max_packets is the slot
+    ZMPacket      *packets;
+    uint64_t      *video_counts;    // Number of video packets queued before each slot
+    unsigned int  max_packets;
+    size_t        max_bytes;
+    int           video_stream_id;
+
+    uint64_t      head;             // Sequence of the oldest queued packet
+    uint64_t      tail;             // Sequence the next packet will be queued at
+    uint64_t      video_count;      // Video packets ever queued
+    size_t        queued_bytes;
+    ZMPacket      *popped;          // Last popped packet, released on the next call
 
+    // Sequence numbers of the queued video keyframes, oldest first
+    uint64_t      *keyframes;
+    uint64_t      keyframe_head;
+    uint64_t      keyframe_tail;
 };
 
 #endif /* ZM_PACKETQUEUE_H */
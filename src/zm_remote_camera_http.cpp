@@ -21,11 +21,13 @@
 #include "zm_rtsp_auth.h"
 
 #include "zm_mem_utils.h"
+#include "zm_time.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #ifdef SOLARIS
 #include <sys/filio.h> // FIONREAD and friends
@@ -65,6 +67,11 @@ RemoteCameraHttp::RemoteCameraHttp(
     p_record_audio )
 {
   sd = -1;
+  keep_alive = false;
+  request_pending = false;
+  reused = false;
+  captured_jpeg = NULL;
+  captured_jpeg_size = 0;
 
   timeout.tv_sec = 0;
   timeout.tv_usec = 0;
@@ -160,6 +167,8 @@ int RemoteCameraHttp::Disconnect()
 {
   close( sd );
   sd = -1;
+  keep_alive = false;
+  request_pending = false;
   Debug( 3, "Disconnected from host" );
   return( 0 );
 }
@@ -173,8 +182,8 @@ int RemoteCameraHttp::SendRequest()
     Disconnect();
     return( -1 );
   }
-  format = UNDEF;
   state = HEADER;
+  parser.Reset();
   Debug( 3, "Request sent" );
   return( 0 );
 }
@@ -223,6 +232,11 @@ int RemoteCameraHttp::ReadData( Buffer &buffer, unsigned int bytes_expected ) {
     }
 
     if ( total_bytes_to_read == 0 ) {
+      if ( keep_alive ) {
+        // The camera has closed the connection we kept open from the last image
+        Debug( 3, "Kept alive connection closed remotely" );
+        return( -1 );
+      }
       if ( mode == SINGLE_IMAGE ) {
         int error = 0;
         socklen_t len = sizeof (error);
@@ -294,6 +308,7 @@ int RemoteCameraHttp::GetResponse()
     const char *content_boundary = "";
     const char *subheader = 0;
     int subheader_len = 0;
+    bool content_length_given = false;
     //int subcontent_length = 0;
     //const char *subcontent_type = "";
 
@@ -309,6 +324,13 @@ int RemoteCameraHttp::GetResponse()
             static RegExpr *content_length_expr = 0;
             static RegExpr *content_type_expr = 0;
 
+            // Drop any line end left over from the previous response on this connection
+            unsigned int skip = 0;
+            while ( skip < buffer.size() && ( buffer[skip] == '\r' || buffer[skip] == '\n' ) )
+              skip++;
+            if ( skip )
+              buffer.consume( skip );
+
             while ( ! ( buffer_len = ReadData( buffer ) ) ) {
 							Debug(4, "Timeout waiting for REGEXP HEADER");
             }
@@ -520,6 +542,7 @@ int RemoteCameraHttp::GetResponse()
               return( -1 );
             }
 
+            content_length_given = content_length > 0;
             if ( content_length )
             {
               while ( (long)buffer.size() < content_length )
@@ -563,7 +586,13 @@ int RemoteCameraHttp::GetResponse()
             if ( mode == SINGLE_IMAGE )
             {
               state = HEADER;
-              Disconnect();
+              // Content delimited by length leaves the connection usable, unless the server says otherwise
+              if ( http_version && !strcmp( http_version, "1.1" ) )
+                keep_alive = strcasecmp( connection_type, "close" ) != 0;
+              else
+                keep_alive = strcasecmp( connection_type, "keep-alive" ) == 0;
+              if ( !content_length_given || !keep_alive )
+                Disconnect();
             }
             else
             {
@@ -584,478 +613,99 @@ int RemoteCameraHttp::GetResponse()
   else
 #endif // HAVE_LIBPCRE
   {
-    static const char *http_match = "HTTP/";
-    static const char *connection_match = "Connection:";
-    static const char *content_length_match = "Content-length:";
-    static const char *content_type_match = "Content-type:";
-    static const char *boundary_match = "boundary=";
-    static const char *authenticate_match = "WWW-Authenticate:";
-    static int http_match_len = 0;
-    static int connection_match_len = 0;
-    static int content_length_match_len = 0;
-    static int content_type_match_len = 0;
-    static int boundary_match_len = 0;
-    static int authenticate_match_len = 0;
-
-    if ( !http_match_len )
-      http_match_len = strlen( http_match );
-    if ( !connection_match_len )
-      connection_match_len = strlen( connection_match );
-    if ( !content_length_match_len )
-      content_length_match_len = strlen( content_length_match );
-    if ( !content_type_match_len )
-      content_type_match_len = strlen( content_type_match );
-    if ( !boundary_match_len )
-      boundary_match_len = strlen( boundary_match );
-    if ( !authenticate_match_len )
-      authenticate_match_len = strlen( authenticate_match );
-
-    static int n_headers;
-    //static char *headers[32];
-
-    static int n_subheaders;
-    //static char *subheaders[32];
-
-    static char *http_header;
-    static char *connection_header;
-    static char *content_length_header;
-    static char *content_type_header;
-    static char *boundary_header;
-    static char *authenticate_header;
-    static char subcontent_length_header[32];
-    static char subcontent_type_header[64];
-
-    static char http_version[16];
-    static char status_code[16];
-    static char status_mesg[256];
-    static char connection_type[32];
-    static int content_length;
-    static char content_type[32];
-    static char content_boundary[64];
-    static int content_boundary_len;
-
     while ( true ) {
-      switch( state ) {
-        case HEADER :
-          {
-            n_headers = 0;
-            http_header = 0;
-            connection_header = 0;
-            content_length_header = 0;
-            content_type_header = 0;
-            authenticate_header = 0;
-
-            http_version[0] = '\0';
-            status_code [0]= '\0';
-            status_mesg [0]= '\0';
-            connection_type [0]= '\0';
-            content_length = 0;
-            content_type[0] = '\0';
-            content_boundary[0] = '\0';
-            content_boundary_len = 0;
-          }
-        case HEADERCONT :
-          {
-            while ( ! ( buffer_len = ReadData( buffer ) ) ) {
-								Debug(4, "Timeout waiting for HEADERCONT");
-            }
-            if ( buffer_len < 0 ) {
-              Error( "Unable to read header" );
-              return( -1 );
-            }
-
-            char *crlf = 0;
-            char *header_ptr = (char *)buffer;
-            int header_len = buffer.size();
-            bool all_headers = false;
-
-            while( true ) {
-              int crlf_len = memspn( header_ptr, "\r\n", header_len );
-              if ( n_headers ) {
-                if ( (crlf_len == 2 && !strncmp( header_ptr, "\n\n", crlf_len )) || (crlf_len == 4 && !strncmp( header_ptr, "\r\n\r\n", crlf_len )) ) {
-                  *header_ptr = '\0';
-                  header_ptr += crlf_len;
-                  header_len -= buffer.consume( header_ptr-(char *)buffer );
-                  all_headers = true;
-                  break;
-                }
-              }
-              if ( crlf_len ) {
-                if ( header_len == crlf_len ) {
-                  break;
-                } else {
-                  *header_ptr = '\0';
-                  header_ptr += crlf_len;
-                  header_len -= buffer.consume( header_ptr-(char *)buffer );
-                }
-              }
-
-              Debug( 6, "%s", header_ptr );
-              if ( (crlf = mempbrk( header_ptr, "\r\n", header_len )) ) {
-                //headers[n_headers++] = header_ptr;
-                n_headers++;
-
-                if ( !http_header && (strncasecmp( header_ptr, http_match, http_match_len ) == 0) ) {
-                  http_header = header_ptr+http_match_len;
-                  Debug( 6, "Got http header '%s'", header_ptr );
-                } else if ( !connection_header && (strncasecmp( header_ptr, connection_match, connection_match_len) == 0) ) {
-                  connection_header = header_ptr+connection_match_len;
-                  Debug( 6, "Got connection header '%s'", header_ptr );
-                } else if ( !content_length_header && (strncasecmp( header_ptr, content_length_match, content_length_match_len) == 0) ) {
-                  content_length_header = header_ptr+content_length_match_len;
-                  Debug( 6, "Got content length header '%s'", header_ptr );
-                } else if ( !authenticate_header && (strncasecmp( header_ptr, authenticate_match, authenticate_match_len) == 0) ) {
-                  authenticate_header = header_ptr;
-                  Debug( 6, "Got authenticate header '%s'", header_ptr );
-                } else if ( !content_type_header && (strncasecmp( header_ptr, content_type_match, content_type_match_len) == 0) ) {
-                  content_type_header = header_ptr+content_type_match_len;
-                  Debug( 6, "Got content type header '%s'", header_ptr );
-                } else {
-                  Debug( 6, "Got ignored header '%s'", header_ptr );
-                }
-                header_ptr = crlf;
-                header_len -= buffer.consume( header_ptr-(char *)buffer );
-              } else {
-                // No end of line found
-                break;
-              }
-            } // end while search for headers
-
-            if ( all_headers ) {
-              char *start_ptr, *end_ptr;
-
-              if ( !http_header ) {
-                Error( "Unable to extract HTTP status from header" );
-                return( -1 );
-              }
-
-              start_ptr = http_header;
-              end_ptr = start_ptr+strspn( start_ptr, "10." );
-
-              // FIXME WHy are we memsetting every time?  Can we not do it once?
-              memset( http_version, 0, sizeof(http_version) );
-              strncpy( http_version, start_ptr, end_ptr-start_ptr );
-
-              start_ptr = end_ptr;
-              start_ptr += strspn( start_ptr, " " );
-              end_ptr = start_ptr+strspn( start_ptr, "0123456789" );
-
-              memset( status_code, 0, sizeof(status_code) );
-              strncpy( status_code, start_ptr, end_ptr-start_ptr );
-              int status = atoi( status_code );
-
-              start_ptr = end_ptr;
-              start_ptr += strspn( start_ptr, " " );
-              strcpy( status_mesg, start_ptr );
-
-              if ( status == 401 ) {
-                if ( mNeedAuth ) {
-                  Error( "Failed authentication: " );
-                  return( -1 );
-                }
-                if ( ! authenticate_header ) {
-                  Error( "Failed authentication, but don't have an authentication header: " );
-                  return( -1 );
-                }
-                mNeedAuth = true;
-                std::string Header = authenticate_header;
-                Debug(2, "Checking for digest auth in %s", authenticate_header );
-
-                mAuthenticator->checkAuthResponse(Header);
-                if ( mAuthenticator->auth_method() == zm::AUTH_DIGEST ) {
-                  Debug( 2, "Need Digest Authentication" );
-                  request = stringtf( "GET %s HTTP/%s\r\n", path.c_str(), config.http_version );
-                  request += stringtf( "User-Agent: %s/%s\r\n", config.http_ua, ZM_VERSION );
-                  request += stringtf( "Host: %s\r\n", host.c_str());
-                  if ( strcmp( config.http_version, "1.0" ) == 0 )
-                    request += stringtf( "Connection: Keep-Alive\r\n" );
-                  request += mAuthenticator->getAuthHeader( "GET", path.c_str() );
-                  request += "\r\n";
-
-                  Debug( 2, "New request header: %s", request.c_str() );
-                  return( 0 );
-                } else {
-                  Debug( 2, "Need some other kind of Authentication" );
-                }
-              } else if ( status < 200 || status > 299 ) {
-                Error( "Invalid response status %s: %s", status_code, status_mesg );
-                return( -1 );
-              }
-              Debug( 3, "Got status '%d' (%s), http version %s", status, status_mesg, http_version );
-
-              if ( connection_header ) {
-                memset( connection_type, 0, sizeof(connection_type) );
-                start_ptr = connection_header + strspn( connection_header, " " );
-                // FIXME Should we not use strncpy?
-                strcpy( connection_type, start_ptr );
-                Debug( 3, "Got connection '%s'", connection_type );
-              }
-              if ( content_length_header ) {
-                start_ptr = content_length_header + strspn( content_length_header, " " );
-                content_length = atoi( start_ptr );
-                Debug( 3, "Got content length '%d'", content_length );
-              }
-              if ( content_type_header ) {
-                memset( content_type, 0, sizeof(content_type) );
-                start_ptr = content_type_header + strspn( content_type_header, " " );
-                if ( (end_ptr = strchr( start_ptr, ';' )) ) {
-                  strncpy( content_type, start_ptr, end_ptr-start_ptr );
-                  Debug( 3, "Got content type '%s'", content_type );
-
-                  start_ptr = end_ptr + strspn( end_ptr, "; " );
-
-                  if ( strncasecmp( start_ptr, boundary_match, boundary_match_len ) == 0 ) {
-                    start_ptr += boundary_match_len;
-                    start_ptr += strspn( start_ptr, "-" );
-                    content_boundary_len = sprintf( content_boundary, "--%s", start_ptr );
-                    Debug( 3, "Got content boundary '%s'", content_boundary );
-                  } else {
-                    Error( "No content boundary found in header '%s'", content_type_header );
-                  }
-                } else {
-                  strcpy( content_type, start_ptr );
-                  Debug( 3, "Got content type '%s'", content_type );
-                }
-              }
-
-              if ( !strcasecmp( content_type, "image/jpeg" ) || !strcasecmp( content_type, "image/jpg" ) ) {
-                // Single image
-                mode = SINGLE_IMAGE;
-                format = JPEG;
-                state = CONTENT;
-              } else if ( !strcasecmp( content_type, "image/x-rgb" ) ) {
-                // Single image
-                mode = SINGLE_IMAGE;
-                format = X_RGB;
-                state = CONTENT;
-              } else if ( !strcasecmp( content_type, "image/x-rgbz" ) ) {
-                // Single image
-                mode = SINGLE_IMAGE;
-                format = X_RGBZ;
-                state = CONTENT;
-              } else if ( !strcasecmp( content_type, "multipart/x-mixed-replace" ) ) {
-                // Image stream, so start processing
-                if ( !content_boundary[0] ) {
-                  Error( "No content boundary found in header '%s'", content_type_header );
-                  return( -1 );
-                }
-                mode = MULTI_IMAGE;
-                state = SUBHEADER;
-              }
-              //else if ( !strcasecmp( content_type, "video/mpeg" ) || !strcasecmp( content_type, "video/mpg" ) )
-              //{
-              //// MPEG stream, coming soon!
-              //}
-              else {
-                Error( "Unrecognised content type '%s'", content_type );
-                return( -1 );
-              }
-            } else {
-              Debug( 3, "Unable to extract entire header from stream, continuing" );
-              state = HEADERCONT;
-              //return( -1 );
-            }
-            break;
-          }
-        case SUBHEADER :
-          {
-            n_subheaders = 0;
-            boundary_header = 0;
-            subcontent_length_header[0] = '\0';
-            subcontent_type_header[0] = '\0';
-            content_length = 0;
-            content_type[0] = '\0';
-          }
-        case SUBHEADERCONT :
-          {
-            char *crlf = 0;
-            char *subheader_ptr = (char *)buffer;
-            int subheader_len = buffer.size();
-            bool all_headers = false;
-
-            while( true ) {
-              int crlf_len = memspn( subheader_ptr, "\r\n", subheader_len );
-              if ( n_subheaders ) {
-                if ( (crlf_len == 2 && !strncmp( subheader_ptr, "\n\n", crlf_len )) || (crlf_len == 4 && !strncmp( subheader_ptr, "\r\n\r\n", crlf_len )) ) {
-                  *subheader_ptr = '\0';
-                  subheader_ptr += crlf_len;
-                  subheader_len -= buffer.consume( subheader_ptr-(char *)buffer );
-                  all_headers = true;
-                  break;
-                }
-              }
-              if ( crlf_len ) {
-                if ( subheader_len == crlf_len ) {
-                  break;
-                } else {
-                  *subheader_ptr = '\0';
-                  subheader_ptr += crlf_len;
-                  subheader_len -= buffer.consume( subheader_ptr-(char *)buffer );
-                }
-              }
-
-              Debug( 6, "%d: %s", subheader_len, subheader_ptr );
-
-              if ( (crlf = mempbrk( subheader_ptr, "\r\n", subheader_len )) ) {
-                //subheaders[n_subheaders++] = subheader_ptr;
-                n_subheaders++;
-
-                if ( !boundary_header && (strncasecmp( subheader_ptr, content_boundary, content_boundary_len ) == 0) ) {
-                  boundary_header = subheader_ptr;
-                  Debug( 4, "Got boundary subheader '%s'", subheader_ptr );
-                } else if ( !subcontent_length_header[0] && (strncasecmp( subheader_ptr, content_length_match, content_length_match_len) == 0) ) {
-                  strncpy( subcontent_length_header, subheader_ptr+content_length_match_len, sizeof(subcontent_length_header) );
-                  *(subcontent_length_header+strcspn( subcontent_length_header, "\r\n" )) = '\0';
-                  Debug( 4, "Got content length subheader '%s'", subcontent_length_header );
-                } else if ( !subcontent_type_header[0] && (strncasecmp( subheader_ptr, content_type_match, content_type_match_len) == 0) ) {
-                  strncpy( subcontent_type_header, subheader_ptr+content_type_match_len, sizeof(subcontent_type_header) );
-                  *(subcontent_type_header+strcspn( subcontent_type_header, "\r\n" )) = '\0';
-                  Debug( 4, "Got content type subheader '%s'", subcontent_type_header );
-                } else {
-                  Debug( 6, "Got ignored subheader '%s' found", subheader_ptr );
-                }
-                subheader_ptr = crlf;
-                subheader_len -= buffer.consume( subheader_ptr-(char *)buffer );
-              } else {
-                // No line end found
-                break;
-              }
-            }
-
-            if ( all_headers && boundary_header ) {
-              char *start_ptr/*, *end_ptr*/;
-
-              Debug( 3, "Got boundary '%s'", boundary_header );
-
-              if ( subcontent_length_header[0] ) {
-                start_ptr = subcontent_length_header + strspn( subcontent_length_header, " " );
-                content_length = atoi( start_ptr );
-                Debug( 3, "Got subcontent length '%d'", content_length );
-              }
-              if ( subcontent_type_header[0] ) {
-                memset( content_type, 0, sizeof(content_type) );
-                start_ptr = subcontent_type_header + strspn( subcontent_type_header, " " );
-                strcpy( content_type, start_ptr );
-                Debug( 3, "Got subcontent type '%s'", content_type );
-              }
-              state = CONTENT;
-            } else {
-              Debug( 3, "Unable to extract subheader from stream, retrying" );
-              while ( ! ( buffer_len = ReadData( buffer ) ) ) {
-								Debug(1, "Timeout waiting to extra subheader non regexp");
-              }
-              if ( buffer_len < 0 ) {
-                Error( "Unable to read subheader" );
-                return( -1 );
-              }
-              state = SUBHEADERCONT;
-            }
-            break;
-          }
-        case CONTENT : {
+      HttpParser::Result result = parser.Parse( buffer );
+      mode = parser.Multipart() ? MULTI_IMAGE : SINGLE_IMAGE;
+
+      if ( result == HttpParser::NEED_DATA ) {
+        buffer_len = ReadData( buffer );
+        if ( buffer_len < 0 ) {
+          Error( "Unable to read response" );
+          return( -1 );
+        }
+        if ( buffer_len > 0 )
+          continue;
+        if ( !parser.AwaitingClose() ) {
+          Debug( 4, "Timeout waiting for response" );
+          continue;
+        }
+        result = parser.Finish( buffer );
+      }
 
-            // if content_type is something like image/jpeg;size=, this will strip the ;size=
-            char * semicolon = strchr( content_type, ';' );
-            if ( semicolon ) {
-              *semicolon = '\0';
-            }
+      if ( result == HttpParser::AUTH_REQUIRED ) {
+        if ( mNeedAuth ) {
+          Error( "Failed authentication: " );
+          return( -1 );
+        }
+        if ( parser.AuthenticateHeader().empty() ) {
+          Error( "Failed authentication, but don't have an authentication header: " );
+          return( -1 );
+        }
+        mNeedAuth = true;
+        std::string Header = parser.AuthenticateHeader();
+        Debug( 2, "Checking for digest auth in %s", Header.c_str() );
+
+        mAuthenticator->checkAuthResponse(Header);
+        if ( mAuthenticator->auth_method() == zm::AUTH_DIGEST ) {
+          Debug( 2, "Need Digest Authentication" );
+          request = stringtf( "GET %s HTTP/%s\r\n", path.c_str(), config.http_version );
+          request += stringtf( "User-Agent: %s/%s\r\n", config.http_ua, ZM_VERSION );
+          request += stringtf( "Host: %s\r\n", host.c_str());
+          if ( strcmp( config.http_version, "1.0" ) == 0 )
+            request += stringtf( "Connection: Keep-Alive\r\n" );
+          request += mAuthenticator->getAuthHeader( "GET", path.c_str() );
+          request += "\r\n";
+
+          Debug( 2, "New request header: %s", request.c_str() );
+        } else {
+          Debug( 2, "Need some other kind of Authentication" );
+        }
+        // Start again on a fresh connection rather than try to skip the rest of this response
+        Disconnect();
+        return( 0 );
+      }
 
-            if ( !strcasecmp( content_type, "image/jpeg" ) || !strcasecmp( content_type, "image/jpg" ) ) {
-              format = JPEG;
-            } else if ( !strcasecmp( content_type, "image/x-rgb" ) ) {
-              format = X_RGB;
-            } else if ( !strcasecmp( content_type, "image/x-rgbz" ) ) {
-              format = X_RGBZ;
-            } else {
-              Error( "Found unsupported content type '%s'", content_type );
-              return( -1 );
-            }
+      if ( result != HttpParser::HAVE_CONTENT ) {
+        Error( "Unable to parse response" );
+        return( -1 );
+      }
 
-            // This is an early test for jpeg content, so we can bail early
-            if ( format == JPEG && buffer.size() >= 2 ) {
-              if ( buffer[0] != 0xff || buffer[1] != 0xd8 ) {
-                Error( "Found bogus jpeg header '%02x%02x'", buffer[0], buffer[1] );
-                return( -1 );
-              }
-            }
+      // if content_type is something like image/jpeg;size=, the parser has already stripped the ;size=
+      const char *content_type = parser.ContentType();
+      if ( !strcasecmp( content_type, "image/jpeg" ) || !strcasecmp( content_type, "image/jpg" ) ) {
+        format = JPEG;
+      } else if ( !strcasecmp( content_type, "image/x-rgb" ) ) {
+        format = X_RGB;
+      } else if ( !strcasecmp( content_type, "image/x-rgbz" ) ) {
+        format = X_RGBZ;
+      } else {
+        Error( "Found unsupported content type '%s'", content_type );
+        return( -1 );
+      }
 
-            if ( content_length ) {
-              while ( (long)buffer.size() < content_length ) {
-                //int buffer_len = ReadData( buffer, content_length-buffer.size() );
-								Debug(4, "getting more data");
-                if ( ReadData( buffer ) < 0 ) {
-                  Error( "Unable to read content" );
-                  return( -1 );
-                }
-              }
-              Debug( 3, "Got end of image by length, content-length = %d", content_length );
-            } else {
-              // Read until we find the end of image or the stream closes.
-              while ( !content_length ) {
-								Debug(4, "!content_length, ReadData");
-                buffer_len = ReadData( buffer );
-                if ( buffer_len < 0 )
-                {
-                  Error( "Unable to read content" );
-                  return( -1 );
-                }
-                int buffer_size = buffer.size();
-                if ( buffer_len ) {
-                  // Got some data
-
-                  if ( mode == MULTI_IMAGE ) {
-                    // Look for the boundary marker, determine content length using it's position
-                    if ( char *start_ptr = (char *)memstr( (char *)buffer, "\r\n--", buffer_size ) ) {
-                      content_length = start_ptr - (char *)buffer;
-                      Debug( 2, "Got end of image by pattern (crlf--), content-length = %d", content_length );
-                    } else {
-                      Debug( 2, "Did not find end of image by patten (crlf--) yet, content-length = %d", content_length );
-                    }
-                  } // end if MULTI_IMAGE
-                } else {
-                  content_length = buffer_size;
-                  Debug( 2, "Got end of image by closure, content-length = %d", content_length );
-                  if ( mode == SINGLE_IMAGE ) {
-                    char *end_ptr = (char *)buffer+buffer_size;
-
-                    // strip off any last line feeds
-                    while( *end_ptr == '\r' || *end_ptr == '\n' ) {
-                      content_length--;
-                      end_ptr--;
-                    }
-
-                    if ( end_ptr != ((char *)buffer+buffer_size) ) {
-                      Debug( 2, "Trimmed end of image, new content-length = %d", content_length );
-                    }
-                  } // end if SINGLE_IMAGE
-                } // end if read some data
-              } // end while ! content_length
-            } // end if content_length
-
-            if ( mode == SINGLE_IMAGE ) {
-              state = HEADER;
-              Disconnect();
-            } else {
-              state = SUBHEADER;
-            }
+      int content_length = parser.ContentLength();
+      if ( format == JPEG && content_length >= 2 ) {
+        if ( buffer[0] != 0xff || buffer[1] != 0xd8 ) {
+          Error( "Found bogus jpeg header '%02x%02x'", buffer[0], buffer[1] );
+          return( -1 );
+        }
+      }
 
-            if ( format == JPEG && buffer.size() >= 2 ) {
-              if ( buffer[0] != 0xff || buffer[1] != 0xd8 ) {
-                Error( "Found bogus jpeg header '%02x%02x'", buffer[0], buffer[1] );
-                return( -1 );
-              }
-            }
+      if ( mode == SINGLE_IMAGE ) {
+        keep_alive = parser.KeepAlive();
+        if ( !keep_alive )
+          Disconnect();
+      }
 
-            Debug( 3, "Returning %d bytes, buffer size: (%d) bytes of captured content", content_length, buffer.size() );
-            return( content_length );
-          } // end cast CONTENT
-      } // end switch
-    }
+      Debug( 3, "Returning %d bytes, buffer size: (%d) bytes of captured content", content_length, buffer.size() );
+      return( content_length );
+    } // end while
   }
   return( 0 );
 }
 
 int RemoteCameraHttp::PreCapture() {
+  reused = ( sd >= 0 );
   if ( sd < 0 ) {
     Connect();
     if ( sd < 0 ) {
@@ -1066,7 +716,10 @@ int RemoteCameraHttp::PreCapture() {
     buffer.clear();
   }
   if ( mode == SINGLE_IMAGE ) {
-    if ( SendRequest() < 0 ) {
+    if ( request_pending ) {
+      // Already asked for this one while decoding the last
+      request_pending = false;
+    } else if ( SendRequest() < 0 ) {
       Error( "Unable to send request" );
       Disconnect();
       return( -1 );
@@ -1076,7 +729,16 @@ int RemoteCameraHttp::PreCapture() {
 }
 
 int RemoteCameraHttp::Capture( Image &image ) {
+  captured_jpeg = NULL;
+  captured_jpeg_size = 0;
   int content_length = GetResponse();
+  if ( content_length < 0 && reused && mode == SINGLE_IMAGE ) {
+    // The server may have timed out the idle connection, so try once on a fresh one
+    Debug( 2, "Request on reused connection failed, reconnecting" );
+    Disconnect();
+    if ( PreCapture() == 0 )
+      content_length = GetResponse();
+  }
   if ( content_length == 0 ) {
     Warning( "Unable to capture image, retrying" );
     return 0;
@@ -1086,14 +748,23 @@ int RemoteCameraHttp::Capture( Image &image ) {
     Disconnect();
     return -1;
   }
+  if ( mode == SINGLE_IMAGE && keep_alive && config.http_pipeline ) {
+    // Have the camera get on with the next image while we decode this one
+    if ( SendRequest() == 0 )
+      request_pending = true;
+  }
   switch( format ) {
     case JPEG :
       {
-        if ( !image.DecodeJpeg( buffer.extract( content_length ), content_length, colours, subpixelorder ) ) {
+        const uint8_t *jpeg = buffer.extract( content_length );
+        if ( !image.DecodeJpeg( jpeg, content_length, colours, subpixelorder ) ) {
           Error( "Unable to decode jpeg" );
           Disconnect();
           return -1;
         }
+        // Extracting leaves the bytes where they are until more data is read
+        captured_jpeg = jpeg;
+        captured_jpeg_size = content_length;
         break;
       }
     case X_RGB :
@@ -1103,7 +774,7 @@ int RemoteCameraHttp::Capture( Image &image ) {
           Disconnect();
           return -1;
         }
-        image.Assign( width, height, colours, subpixelorder, buffer, imagesize );
+        image.Assign( width, height, colours, subpixelorder, buffer.extract( content_length ), imagesize );
         break;
       }
     case X_RGBZ :
@@ -1129,3 +800,109 @@ int RemoteCameraHttp::Capture( Image &image ) {
 int RemoteCameraHttp::PostCapture() {
   return 0;
 }
+
+struct ResponseFeed {
+  int sd;
+  const std::string *response;
+};
+
+// Writes a recorded response into one end of a socket pair, then closes it
+static void *feed_response( void *arg ) {
+  ResponseFeed *feed = (ResponseFeed *)arg;
+  const char *data = feed->response->data();
+  size_t remaining = feed->response->size();
+  while ( remaining ) {
+    ssize_t sent = send( feed->sd, data, remaining, MSG_NOSIGNAL );
+    if ( sent < 0 && errno == EINTR )
+      continue;
+    if ( sent <= 0 )
+      break;
+    data += sent;
+    remaining -= sent;
+  }
+  close( feed->sd );
+  return( NULL );
+}
+
+// Counts the images in a recorded response, so that a benchmark knows how many
+// to ask for without running into whatever was cut off at the end
+static int count_response_parts( const std::string &response ) {
+  Buffer buffer;
+  buffer.append( response.data(), response.size() );
+  HttpParser parser;
+  int parts = 0;
+  while ( true ) {
+    HttpParser::Result result = parser.Parse( buffer );
+    if ( result == HttpParser::NEED_DATA && parser.AwaitingClose() )
+      result = parser.Finish( buffer );
+    if ( result != HttpParser::HAVE_CONTENT )
+      break;
+    buffer.consume( parser.ContentLength() );
+    parts++;
+    if ( !parser.Multipart() )
+      break;
+  }
+  return( parts );
+}
+
+double RemoteCameraHttp::BenchmarkResponse( const std::string &response, unsigned int passes ) {
+  int parts = count_response_parts( response );
+  if ( !parts ) {
+    Error( "No complete image found in recorded response" );
+    return( -1.0 );
+  }
+  Debug( 1, "Recorded response of %zu bytes holds %d images", response.size(), parts );
+
+  timeout.tv_sec = 1;
+  timeout.tv_usec = 0;
+
+  struct timeval start;
+  gettimeofday( &start, NULL );
+  for ( unsigned int pass = 0; pass < passes; pass++ ) {
+    int sds[2];
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sds ) < 0 ) {
+      Error( "Can't create socket pair: %s", strerror(errno) );
+      return( -1.0 );
+    }
+    sd = sds[0];
+    ResponseFeed feed = { sds[1], &response };
+    pthread_t feeder;
+    if ( pthread_create( &feeder, NULL, feed_response, &feed ) != 0 ) {
+      Error( "Can't start thread to feed recorded response" );
+      close( sds[0] );
+      close( sds[1] );
+      sd = -1;
+      return( -1.0 );
+    }
+
+    buffer.clear();
+    parser.Reset();
+    mode = SINGLE_IMAGE;
+    format = UNDEF;
+    state = HEADER;
+    keep_alive = false;
+    int got = 0;
+    while ( got < parts ) {
+      int content_length = GetResponse();
+      if ( content_length <= 0 )
+        break;
+      // Capture would decode the content here, which is not what we are measuring
+      buffer.consume( content_length );
+      got++;
+    }
+
+    // A single image response may have closed the connection itself
+    if ( sd >= 0 )
+      Disconnect();
+    pthread_join( feeder, NULL );
+    if ( got < parts ) {
+      Error( "Only got %d of %d images on pass %d", got, parts, pass );
+      return( -1.0 );
+    }
+  }
+  int elapsed = tvDiffUsec( start );
+  if ( elapsed <= 0 )
+    return( 0.0 );
+  // Bytes per usec is MB/s
+  return( ((double)passes*response.size())/elapsed );
+}
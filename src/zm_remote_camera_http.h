@@ -23,6 +23,7 @@
 #include "zm_remote_camera.h"
 
 #include "zm_buffer.h"
+#include "zm_http_parser.h"
 #include "zm_regexp.h"
 #include "zm_utils.h"
 
@@ -42,6 +43,12 @@ protected:
   enum { UNDEF, JPEG, X_RGB, X_RGBZ } format;
   enum { HEADER, HEADERCONT, SUBHEADER, SUBHEADERCONT, CONTENT } state;
   enum { SIMPLE, REGEXP } method;
+  HttpParser parser;        // Used by the simple method
+  bool keep_alive;          // The last single image response left the connection open for another
+  bool request_pending;     // The request for the next image has already been sent
+  bool reused;              // The current request went on a connection used before, which may have gone stale
+  const uint8_t *captured_jpeg; // Content of the last JPEG captured, still in the buffer
+  unsigned int captured_jpeg_size;
 
 public:
   RemoteCameraHttp( unsigned int p_monitor_id, const std::string &method, const std::string &host, const std::string &port, const std::string &path, int p_width, int p_height, int p_colours, int p_brightness, int p_contrast, int p_hue, int p_colour, bool p_capture, bool p_record_audio );
@@ -57,8 +64,14 @@ public:
   int PreCapture();
   int Capture( Image &image );
   int PostCapture();
+  bool CapturesJpeg() const { return( true ); }
+  const uint8_t *CapturedJpeg( unsigned int &p_size ) const { p_size = captured_jpeg_size; return( captured_jpeg ); }
   int CaptureAndRecord( Image &image, timeval recording, char* event_directory ) {return 0;};
   int Close() { return 0; };
+
+  // Play a recorded response, headers included, through GetResponse as if the
+  // camera had sent it. Returns the rate in MB/s it was parsed at, or -1 on failure.
+  double BenchmarkResponse( const std::string &response, unsigned int passes );
 };
 
 #endif // ZM_REMOTE_CAMERA_HTTP_H
@@ -278,6 +278,7 @@ int RemoteCameraRtsp::Capture( Image &image ) {
 
     if ( rtspThread->getFrame( buffer ) ) {
       Debug( 3, "Read frame %d bytes", buffer.size() );
+      PublishSourceStats();
       Debug( 4, "Address %p", buffer.head() );
       Hexdump( 4, buffer.head(), 16 );
 
@@ -416,6 +417,7 @@ int RemoteCameraRtsp::CaptureAndRecord(Image &image, timeval recording, char* ev
 
     if ( rtspThread->getFrame( buffer ) ) {
       Debug( 3, "Read frame %d bytes", buffer.size() );
+      PublishSourceStats();
       Debug( 4, "Address %p", buffer.head() );
       Hexdump( 4, buffer.head(), 16 );
 
@@ -545,4 +547,11 @@ int RemoteCameraRtsp::CaptureAndRecord(Image &image, timeval recording, char* ev
 int RemoteCameraRtsp::PostCapture() {
   return( 0 );
 }
+
+// Mirrors the receive side's counters into the monitor's shared memory
+void RemoteCameraRtsp::PublishSourceStats() {
+  uint32_t frames_dropped, recv_calls_per_100_frames;
+  if ( monitor && rtspThread->getSourceStats( frames_dropped, recv_calls_per_100_frames ) )
+    monitor->SourceStats( frames_dropped, recv_calls_per_100_frames );
+}
 #endif // HAVE_LIBAVFORMAT
@@ -73,6 +73,8 @@ protected:
   struct SwsContext   *mConvertContext;
 #endif
 
+  void PublishSourceStats();
+
 public:
   RemoteCameraRtsp( unsigned int p_monitor_id, const std::string &method, const std::string &host, const std::string &port, const std::string &path, int p_width, int p_height, bool p_rtsp_describe, int p_colours, int p_brightness, int p_contrast, int p_hue, int p_colour, bool p_capture, bool p_record_audio );
   ~RemoteCameraRtsp();
@@ -109,11 +109,20 @@ typedef uint32_t Rgb;  // RGB colour type
 #define ZM_SUBPIX_ORDER_RGBA 8
 #define ZM_SUBPIX_ORDER_ABGR 9
 #define ZM_SUBPIX_ORDER_ARGB 10
+/* Planar YUV 4:2:0, only with ZM_COLOUR_GRAY8. The Y plane is laid out as a grayscale image and is followed by the quarter size U and V planes */
+#define ZM_SUBPIX_ORDER_YUV420P 11
 
 /* A macro to use default subpixel order for a specified colour. */
 /* for grayscale it will use NONE, for 3 colours it will use R,G,B, for 4 colours it will use R,G,B,A */
 #define ZM_SUBPIX_ORDER_DEFAULT_FOR_COLOUR(c)  ((c)<<1)
 
+/* Bytes taken by an image of the given format */
+inline unsigned int zm_image_size( unsigned int p_width, unsigned int p_height, unsigned int p_colours, unsigned int p_subpixelorder ) {
+  if ( p_subpixelorder == ZM_SUBPIX_ORDER_YUV420P )
+    return (p_width*p_height) + (2*((p_width+1)>>1)*((p_height+1)>>1));
+  return (p_width*p_height)*p_colours;
+}
+
 /* Convert RGB colour value into BGR\ARGB\ABGR */
 inline Rgb rgb_convert(Rgb p_col, int p_subpixorder) {
   Rgb result;
@@ -146,6 +155,15 @@ inline Rgb rgb_convert(Rgb p_col, int p_subpixorder) {
     case ZM_SUBPIX_ORDER_NONE:
     result = p_col & 0xff;
     break;
+    /* Planar YUV, packed as Y in the lowest byte then U and V (ITU-R BT.601) */
+    case ZM_SUBPIX_ORDER_YUV420P:
+    {
+    const int r = RED_VAL_RGBA(p_col), g = GREEN_VAL_RGBA(p_col), b = BLUE_VAL_RGBA(p_col);
+    result = ((77*r + 150*g + 29*b) >> 8)
+      | (((32768 - 43*r - 85*g + 128*b) >> 8) << 8)
+      | (((32768 + 128*r - 107*g - 21*b) >> 8) << 16);
+    }
+    break;
     default:
     return p_col;
     break;
@@ -301,6 +301,7 @@ int RtpCtrlThread::run()
   select.addReader( &rtpCtrlServer );
 
   unsigned char buffer[ZM_NETWORK_BUFSIZ];
+  DatagramBatch batch( RTCP_RECV_BATCH, RTCP_MAX_PACKET );
 
   time_t  last_receive = time(NULL);
   bool  timeout = false; // used as a flag that we had a timeout, and then sent an RR to see if we wake back up. Real timeout will happen when this is true.
@@ -336,15 +337,31 @@ int RtpCtrlThread::run()
     {
       if ( UdpInetSocket *socket = dynamic_cast<UdpInetSocket *>(*iter) )
       {
-        ssize_t nBytes = socket->recv( buffer, sizeof(buffer) );
-        Debug( 4, "Read %zd bytes on sd %d", nBytes, socket->getReadDesc() );
+        int nPackets = socket->recvBatch( batch );
+        if ( nPackets < 0 )
+        {
+          // Nothing was read, so there is nothing to report on either
+          continue;
+        }
+        Debug( 4, "Read %d packets on sd %d", nPackets, socket->getReadDesc() );
 
-        if ( nBytes )
+        bool closed = false;
+        for ( int i = 0; i < nPackets; i++ )
         {
-          recvPackets( buffer, nBytes );
+          if ( !batch.length( i ) )
+          {
+            closed = true;
+            break;
+          }
+          recvPackets( batch.packet( i ), batch.length( i ) );
+        }
 
+        if ( !closed )
+        {
+          // One set of reports for however many packets we read
           if ( sendReports )
           {
+            ssize_t nBytes;
             unsigned char *bufferPtr = buffer;
             bufferPtr += generateRr( bufferPtr, sizeof(buffer)-(bufferPtr-buffer) );
             bufferPtr += generateSdes( bufferPtr, sizeof(buffer)-(bufferPtr-buffer) );
@@ -34,6 +34,11 @@
 class RtspThread;
 class RtpSource;
 
+// Control packets read from the socket with each system call, and the
+// largest we expect
+#define RTCP_RECV_BATCH 8
+#define RTCP_MAX_PACKET 2048
+
 class RtpCtrlThread : public Thread
 {
 friend class RtspThread;
@@ -82,7 +82,7 @@ int RtpDataThread::run()
   Select select( 3 );
   select.addReader( &rtpDataSocket );
 
-  unsigned char buffer[ZM_NETWORK_BUFSIZ];
+  DatagramBatch batch( RTP_RECV_BATCH, RTP_MAX_PACKET );
   while ( !mStop && select.wait() >= 0 )
   {
      if ( mStop )
@@ -98,17 +98,20 @@ int RtpDataThread::run()
      {
        if ( UdpInetServer *socket = dynamic_cast<UdpInetServer *>(*iter) )
        {
-         int nBytes = socket->recv( buffer, sizeof(buffer) );
-         Debug( 4, "Got %d bytes on sd %d", nBytes, socket->getReadDesc() );
-         if ( nBytes )
+         int nPackets = socket->recvBatch( batch );
+         mRtpSource.countRecvCall();
+         Debug( 4, "Got %d packets on sd %d", nPackets, socket->getReadDesc() );
+         for ( int i = 0; i < nPackets; i++ )
          {
-            recvPacket( buffer, nBytes );
-         }
-         else
-         {
-          mStop = true;
-          break;
+           if ( !batch.length( i ) )
+           {
+             mStop = true;
+             break;
+           }
+           recvPacket( batch.packet( i ), batch.length( i ) );
          }
+         if ( mStop )
+           break;
        }
        else
        {
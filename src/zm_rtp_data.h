@@ -42,6 +42,11 @@ struct RtpDataHeader
   uint32_t csrc[];    // optional CSRC list
 };
 
+// Packets read from the socket with each system call, and the largest we
+// expect, which allows for jumbo frames
+#define RTP_RECV_BATCH 32
+#define RTP_MAX_PACKET 9216
+
 class RtpDataThread : public Thread
 {
 friend class RtspThread;
@@ -17,6 +17,7 @@
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 // 
 
+#include "zm.h"
 #include "zm_rtp_source.h"
 
 #include "zm_time.h"
@@ -33,12 +34,36 @@ RtpSource::RtpSource( int id, const std::string &localHost, int localPortBase, c
   mRemoteHost( remoteHost ),
   mRtpClock( rtpClock ),
   mCodecId( codecId ),
-  mFrame( 65536 ),
+  mFrameHead( 0 ),
+  mFrameTail( 0 ),
   mFrameCount( 0 ),
   mFrameGood( true ),
   mFrameReady( false ),
-  mFrameProcessed( false )
+  mFramesDropped( 0 ),
+  mFramesDroppedPrior( 0 ),
+  mReorderWindow( config.rtp_reorder_window ),
+  mReorderStarted( false ),
+  mReorderNextSeq( 0 ),
+  mReorderMaxSeq( 0 ),
+  mReorderHeld( 0 ),
+  mReorderWaiting( false ),
+  mPacketsReordered( 0 ),
+  mPacketsLate( 0 ),
+  mPacketsMissed( 0 ),
+  mPacketsReorderedPrior( 0 ),
+  mPacketsLatePrior( 0 ),
+  mPacketsMissedPrior( 0 ),
+  mRecvCalls( 0 ),
+  mRecvCallsPrior( 0 ),
+  mRecvCallsPer100Frames( 0 ),
+  mFrameCountPrior( 0 )
 {
+  for ( uint32_t i = 0; i < FRAME_SLOTS; i++ )
+    mFrames[i].size( 65536 );
+  mFrame = &mFrames[0];
+  for ( int i = 0; i < REORDER_SLOTS; i++ )
+    mReorder[i].valid = false;
+
   char hostname[256] = "";
   gethostname( hostname, sizeof(hostname) );
 
@@ -253,9 +278,142 @@ void RtpSource::updateRtcpStats()
   else
     mLostFraction = (lostInterval << 8) / expectedInterval;
   Debug( 5, "Lost fraction = %d", mLostFraction );
+
+  uint32_t recvCallsInterval = mRecvCalls - mRecvCallsPrior;
+  mRecvCallsPrior = mRecvCalls;
+  int frameInterval = mFrameCount - mFrameCountPrior;
+  mFrameCountPrior = mFrameCount;
+  if ( frameInterval > 0 )
+  {
+    mRecvCallsPer100Frames = (100*(uint64_t)recvCallsInterval)/frameInterval;
+    Debug( 2, "Read %d packets in %d calls for %d frames, %.2f calls per frame",
+        receivedInterval, recvCallsInterval, frameInterval, (double)recvCallsInterval/frameInterval );
+  }
+
+  uint32_t droppedInterval = mFramesDropped - mFramesDroppedPrior;
+  mFramesDroppedPrior = mFramesDropped;
+  if ( droppedInterval )
+    Info( "Dropped %d frames, %d in total, because capture didn't keep up", droppedInterval, mFramesDropped );
+
+  if ( mReorderWindow )
+  {
+    uint32_t reorderedInterval = mPacketsReordered - mPacketsReorderedPrior;
+    uint32_t lateInterval = mPacketsLate - mPacketsLatePrior;
+    uint32_t missedInterval = mPacketsMissed - mPacketsMissedPrior;
+    mPacketsReorderedPrior = mPacketsReordered;
+    mPacketsLatePrior = mPacketsLate;
+    mPacketsMissedPrior = mPacketsMissed;
+    if ( lateInterval || missedInterval )
+    {
+      Info( "Reordered %d packets, gave up on %d and dropped %d which arrived too late, %d/%d/%d in total",
+          reorderedInterval, missedInterval, lateInterval, mPacketsReordered, mPacketsMissed, mPacketsLate );
+    }
+    else
+    {
+      Debug( 3, "Reordered %d packets, %d in total", reorderedInterval, mPacketsReordered );
+    }
+  }
 }
 
 bool RtpSource::handlePacket( const unsigned char *packet, size_t packetLen )
+{
+  const RtpDataHeader *rtpHeader = (RtpDataHeader *)packet;
+
+  // Jitter is about when packets arrive, not when we get round to using them
+  updateJitter( rtpHeader );
+
+  if ( !mReorderWindow )
+  {
+    processPacket( packet, packetLen );
+    return( true );
+  }
+
+  struct timeval now = tvNow();
+  uint16_t seq = ntohs(rtpHeader->seqN);
+  if ( !mReorderStarted )
+  {
+    mReorderStarted = true;
+    mReorderNextSeq = seq;
+    mReorderMaxSeq = seq;
+  }
+
+  int16_t offset = seq - mReorderNextSeq;
+  if ( offset < 0 && offset >= -MAX_MISORDER )
+  {
+    Debug( 3, "Dropping packet %d, already passed on or given up on", seq );
+    mPacketsLate++;
+    return( true );
+  }
+  if ( offset < 0 || offset >= REORDER_SLOTS )
+  {
+    // Too far out to wait for what is in between, the stream has jumped
+    Debug( 3, "Packet %d is %d from the next expected, resynchronising", seq, offset );
+    releasePackets( now, true );
+    mReorderNextSeq = seq;
+    mReorderMaxSeq = seq;
+  }
+
+  ReorderSlot &slot = mReorder[seq % REORDER_SLOTS];
+  if ( slot.valid )
+  {
+    Debug( 3, "Dropping duplicate packet %d", seq );
+    mPacketsLate++;
+    return( true );
+  }
+  if ( (int16_t)(seq - mReorderMaxSeq) < 0 )
+  {
+    Debug( 3, "Packet %d arrived out of order, after %d", seq, mReorderMaxSeq );
+    mPacketsReordered++;
+  }
+  else
+  {
+    mReorderMaxSeq = seq;
+  }
+  slot.packet.assign( packet, packetLen );
+  slot.arrival = now;
+  slot.valid = true;
+  mReorderHeld++;
+
+  releasePackets( now, false );
+  return( true );
+}
+
+// Pass held packets on in sequence. A missing packet is waited for until
+// the window has passed since we found the gap, or not at all if flushing.
+void RtpSource::releasePackets( const struct timeval &now, bool flush )
+{
+  while ( mReorderHeld )
+  {
+    ReorderSlot &slot = mReorder[mReorderNextSeq % REORDER_SLOTS];
+    if ( slot.valid )
+    {
+      Debug( 5, "Passing on packet %d after %d us", mReorderNextSeq, tvDiffUsec( slot.arrival, now ) );
+      processPacket( slot.packet, slot.packet.size() );
+      slot.valid = false;
+      mReorderHeld--;
+      mReorderNextSeq++;
+      mReorderWaiting = false;
+      continue;
+    }
+    if ( !flush )
+    {
+      if ( !mReorderWaiting )
+      {
+        mReorderWaiting = true;
+        mReorderWaitStart = now;
+      }
+      if ( tvDiffUsec( mReorderWaitStart, now ) < mReorderWindow*1000 )
+        break;
+    }
+    Debug( 3, "Giving up on packet %d", mReorderNextSeq );
+    mPacketsMissed++;
+    mReorderNextSeq++;
+  }
+  if ( flush )
+    mReorderWaiting = false;
+}
+
+void RtpSource::processPacket( const unsigned char *packet, size_t packetLen )
 {
   const RtpDataHeader *rtpHeader;
   rtpHeader = (RtpDataHeader *)packet;
@@ -303,9 +461,9 @@ bool RtpSource::handlePacket( const unsigned char *packet, size_t packetLen )
               if ( packet[rtpHeaderSize+1] & 0x80 )
               {
                 // Now we will form new header of frame
-                mFrame.append( "\x0\x0\x1\x0", 4 );
+                mFrame->append( "\x0\x0\x1\x0", 4 );
                 // Reconstruct NAL header from FU headers
-                *(mFrame+3) = (packet[rtpHeaderSize+1] & 0x1f) |
+                *(*mFrame+3) = (packet[rtpHeaderSize+1] & 0x1f) |
                   (packet[rtpHeaderSize] & 0xe0);
               }
 
@@ -319,54 +477,57 @@ bool RtpSource::handlePacket( const unsigned char *packet, size_t packetLen )
         }
 
         // Append NAL frame start code
-        if ( !mFrame.size() )
-          mFrame.append( "\x0\x0\x1", 3 );
+        if ( !mFrame->size() )
+          mFrame->append( "\x0\x0\x1", 3 );
       }
-      mFrame.append( packet+rtpHeaderSize+extraHeader, packetLen-rtpHeaderSize-extraHeader ); 
+      mFrame->append( packet+rtpHeaderSize+extraHeader, packetLen-rtpHeaderSize-extraHeader ); 
     } else {
       Debug( 3, "NOT H264 frame: type is %d", mCodecId );
     }
 
-    Hexdump( 4, mFrame.head(), 16 );
+    Hexdump( 4, mFrame->head(), 16 );
 
     if ( thisM )
     {
       if ( mFrameGood )
       {
-        Debug( 3, "Got new frame %d, %d bytes", mFrameCount, mFrame.size() );
+        Debug( 3, "Got new frame %d, %d bytes", mFrameCount, mFrame->size() );
 
-        mFrameProcessed.setValueImmediate( false );
-        mFrameReady.updateValueSignal( true );
-        if ( !mFrameProcessed.getValueImmediate() )
+        // Keep a slot to assemble the next frame into
+        if ( mFrameHead+1 - mFrameTail >= FRAME_SLOTS )
         {
-          // What is the point of this for loop? Is it just me, or will it call getUpdatedValue once or twice? Could it not be better written as
-          // if ( ! mFrameProcessed.getUpdatedValue( 1 ) && mFrameProcessed.getUpdatedValue( 1 ) ) return false;
-
-          for ( int count = 0; !mFrameProcessed.getUpdatedValue( 1 ); count++ )
-            if( count > 1 )
-              return( false );
+          Debug( 3, "Frame queue full, dropping frame %d", mFrameCount );
+          mFramesDropped++;
+        }
+        else
+        {
+          // Make the frame contents visible before publishing it
+          __sync_synchronize();
+          mFrameHead = mFrameHead + 1;
+          mFrame = &mFrames[mFrameHead % FRAME_SLOTS];
+          mFrameReady.updateValueSignal( true );
         }
         mFrameCount++;
       }
       else
       {
-        Warning( "Discarding incomplete frame %d, %d bytes", mFrameCount, mFrame.size() );
+        Warning( "Discarding incomplete frame %d, %d bytes", mFrameCount, mFrame->size() );
       }
-      mFrame.clear();
+      mFrame->clear();
     }
   }
   else
   {
-    if ( mFrame.size() )
+    if ( mFrame->size() )
     {
-      Warning( "Discarding partial frame %d, %d bytes", mFrameCount, mFrame.size() );
+      Warning( "Discarding partial frame %d, %d bytes", mFrameCount, mFrame->size() );
     }
     else
     {
       Warning( "Discarding frame %d", mFrameCount );
     }
     mFrameGood = false;
-    mFrame.clear();
+    mFrame->clear();
   }
   if ( thisM )
   {
@@ -375,26 +536,24 @@ bool RtpSource::handlePacket( const unsigned char *packet, size_t packetLen )
   }
   else
     prevM = false;
-
-  updateJitter( rtpHeader );
-
-  return( true );
 }
 
 bool RtpSource::getFrame( Buffer &buffer )
 {
   Debug( 3, "Getting frame" );
-  if ( !mFrameReady.getValueImmediate() )
+  // Short waits, as a frame that arrives just before we start waiting doesn't wake us
+  for ( int count = 0; mFrameTail == mFrameHead; count++ )
   {
-    // Allow for a couple of spurious returns
-    for ( int count = 0; !mFrameReady.getUpdatedValue( 1 ); count++ )
-      if ( count > 1 )
-        return( false );
+    if ( count >= 30 )
+      return( false );
+    mFrameReady.getUpdatedValue( 0.1 );
   }
-  buffer = mFrame;
-  mFrameReady.setValueImmediate( false );
-  mFrameProcessed.updateValueSignal( true );
-  Debug( 4, "Copied %d bytes", buffer.size() );
+  __sync_synchronize();
+  // Hand over the frame without copying it, the slot keeps the caller's old storage
+  buffer.swap( mFrames[mFrameTail % FRAME_SLOTS] );
+  __sync_synchronize();
+  mFrameTail = mFrameTail + 1;
+  Debug( 4, "Took %d bytes, %d frames queued", buffer.size(), mFrameHead - mFrameTail );
   return( true );
 }
 
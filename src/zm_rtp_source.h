@@ -41,6 +41,8 @@ private:
   static const int MAX_DROPOUT = 3000;
   static const int MAX_MISORDER = 100;
   static const int MIN_SEQUENTIAL = 2;
+  static const uint32_t FRAME_SLOTS = 8;
+  static const int REORDER_SLOTS = 256;
 
 private:
   // Identity
@@ -86,15 +88,57 @@ private:
 
   _AVCODECID mCodecId;
 
-  Buffer mFrame;
+  // Completed frames are queued in a single producer, single consumer ring
+  // so the rtp thread never waits for the consumer. The rtp thread
+  // assembles into the slot at mFrameHead and the consumer swaps frames out
+  // from mFrameTail. If the ring is full the newest frame is dropped, which
+  // keeps parameter sets and the frames that depend on them in order.
+  Buffer mFrames[FRAME_SLOTS];
+  Buffer *mFrame;                 // The frame being assembled
+  volatile uint32_t mFrameHead;   // Free running count of frames queued
+  volatile uint32_t mFrameTail;   // Free running count of frames taken
   int mFrameCount;
   bool mFrameGood;
   bool prevM;
   ThreadData<bool> mFrameReady;
-  ThreadData<bool> mFrameProcessed;
+
+  uint32_t mFramesDropped;      // Completed frames dropped because the queue was full
+  uint32_t mFramesDroppedPrior; // Dropped at last stats interval
+
+  // Packets are held for up to mReorderWindow ms, indexed by sequence
+  // number, so that ones which arrive out of order can be put back in
+  // sequence before frames are assembled from them.
+  typedef struct
+  {
+    bool valid;
+    struct timeval arrival;
+    Buffer packet;
+  } ReorderSlot;
+  ReorderSlot mReorder[REORDER_SLOTS];
+  int mReorderWindow;             // ms to wait for a missing packet, 0 to pass packets straight through
+  bool mReorderStarted;
+  uint16_t mReorderNextSeq;       // Next packet to be passed on
+  uint16_t mReorderMaxSeq;        // Highest packet received
+  int mReorderHeld;               // Packets waiting in mReorder
+  bool mReorderWaiting;           // Whether we are waiting for mReorderNextSeq to turn up
+  struct timeval mReorderWaitStart;
+
+  uint32_t mPacketsReordered;     // Received out of order but put back in sequence
+  uint32_t mPacketsLate;          // Received after we had given up on them, or duplicated
+  uint32_t mPacketsMissed;        // Given up on
+  uint32_t mPacketsReorderedPrior;
+  uint32_t mPacketsLatePrior;
+  uint32_t mPacketsMissedPrior;
+
+  uint32_t mRecvCalls;            // System calls made to read data packets
+  uint32_t mRecvCallsPrior;
+  uint32_t mRecvCallsPer100Frames; // Over the last stats interval
+  int mFrameCountPrior;
 
 private:
   void init( uint16_t seq );
+  void releasePackets( const struct timeval &now, bool flush );
+  void processPacket( const unsigned char *packet, size_t packetLen );
 
 public:
   RtpSource( int id, const std::string &localHost, int localPortBase, const std::string &remoteHost, int remotePortBase, uint32_t ssrc, uint16_t seq, uint32_t rtpClock, uint32_t rtpTime, _AVCODECID codecId );
@@ -105,6 +149,10 @@ public:
   void updateRtcpStats();
 
   bool handlePacket( const unsigned char *packet, size_t packetLen );
+  void countRecvCall()
+  {
+    mRecvCalls++;
+  }
 
   uint32_t getSsrc() const
   {
@@ -116,6 +164,14 @@ public:
   }
 
   bool getFrame( Buffer &buffer );
+  uint32_t getFramesDropped() const
+  {
+    return( mFramesDropped );
+  }
+  uint32_t getRecvCallsPer100Frames() const
+  {
+    return( mRecvCallsPer100Frames );
+  }
 
   const std::string &getCname() const
   {
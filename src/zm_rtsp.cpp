@@ -640,7 +640,11 @@ Debug(5, "sendkeepalive %d, timeout %d, now: %d last: %d since: %d", sendKeepali
       Select select( double(config.http_timeout)/1000.0 );
       select.addReader( &mRtspSocket );
 
-      Buffer buffer( ZM_NETWORK_BUFSIZ );
+      // Packets are read straight into the ring and handed on from there,
+      // only ones which wrap round its end get copied out first. It holds
+      // the largest interleaved packet with room to spare.
+      RingBuffer buffer( 4*ZM_NETWORK_BUFSIZ );
+      unsigned char packetBuffer[65535];
       std::string keepaliveMessage = "OPTIONS "+mUrl+" RTSP/1.0\r\n";
       std::string keepaliveResponse = "RTSP/1.0 200 OK\r\n";
       while ( !mStop && select.wait() >= 0 ) {
@@ -650,56 +654,66 @@ Debug(5, "sendkeepalive %d, timeout %d, now: %d last: %d since: %d", sendKeepali
           break;
         }
 
-        static char tempBuffer[ZM_NETWORK_BUFSIZ];
-        ssize_t nBytes = mRtspSocket.recv( tempBuffer, sizeof(tempBuffer) );
-        buffer.append( tempBuffer, nBytes );
-        Debug( 4, "Read %zd bytes on sd %d, %d total", nBytes, mRtspSocket.getReadDesc(), buffer.size() );
+        int nBytes = buffer.read_into( mRtspSocket.getReadDesc(), ZM_NETWORK_BUFSIZ );
+        if ( nBytes <= 0 ) {
+          if ( nBytes < 0 ) {
+            Error( "Unable to read RTSP interleaved data on sd %d: %s", mRtspSocket.getReadDesc(), strerror(errno) );
+          } else {
+            Error( "RTSP connection closed on sd %d", mRtspSocket.getReadDesc() );
+          }
+          break;
+        }
+        Debug( 4, "Read %d bytes on sd %d, %d total", nBytes, mRtspSocket.getReadDesc(), buffer.size() );
 
         while( buffer.size() > 0 ) {
           if ( buffer[0] == '$' ) {
             if ( buffer.size() < 4 )
               break;
             unsigned char channel = buffer[1];
-            unsigned short len = ntohs( *((unsigned short *)(buffer+2)) );
+            unsigned short len = (buffer[2] << 8) | buffer[3];
 
             Debug( 4, "Got %d bytes left, expecting %d byte packet on channel %d", buffer.size(), len, channel );
-            if ( (unsigned short)buffer.size() < (len+4) ) {
+            if ( buffer.size() < (unsigned int)(len+4) ) {
               Debug( 4, "Missing %d bytes, rereading", (len+4)-buffer.size() );
               break;
             }
+            if ( channel != remoteChannels[0] && channel != remoteChannels[1] )
+            {
+              Error( "Unexpected channel selector %d in RTSP interleaved data", channel );
+              buffer.clear();
+              break;
+            }
+            buffer.consume( 4 );
+            unsigned char *packet = buffer.contiguous( len );
+            if ( !packet )
+            {
+              buffer.peek( packetBuffer, len );
+              packet = packetBuffer;
+            }
             if ( channel == remoteChannels[0] ) {
               Debug( 4, "Got %d bytes on data channel %d, packet length is %d", buffer.size(), channel, len );
-              Hexdump( 4, (char *)buffer, 16 );
-              rtpDataThread.recvPacket( buffer+4, len );
+              Hexdump( 4, packet, 16 );
+              rtpDataThread.recvPacket( packet, len );
               Debug( 4, "Received" );
             }
-            else if ( channel == remoteChannels[1] )
-            {
-//              len = ntohs( *((unsigned short *)(buffer+2)) );
-//              Debug( 4, "Got %d bytes on control channel %d", nBytes, channel );
-              Debug( 4, "Got %d bytes on control channel %d, packet length is %d", buffer.size(), channel, len );
-              Hexdump( 4, (char *)buffer, 16 );
-              rtpCtrlThread.recvPackets( buffer+4, len );
-            }
             else
             {
-              Error( "Unexpected channel selector %d in RTSP interleaved data", buffer[1] );
-              buffer.clear();
-              break;
+              Debug( 4, "Got %d bytes on control channel %d, packet length is %d", buffer.size(), channel, len );
+              Hexdump( 4, packet, 16 );
+              rtpCtrlThread.recvPackets( packet, len );
             }
-            buffer.consume( len+4 );
-            nBytes -= len+4;
+            buffer.consume( len );
           }
           else
           {
-            if ( keepaliveResponse.compare( 0, keepaliveResponse.size(), (char *)buffer, keepaliveResponse.size() ) == 0 )
+            // Rare enough that moving the data round to search it doesn't matter
+            char *head = (char *)buffer.linearize();
+            if ( buffer.size() >= keepaliveResponse.size() && keepaliveResponse.compare( 0, keepaliveResponse.size(), head, keepaliveResponse.size() ) == 0 )
             {
-              Debug( 4, "Got keepalive response '%s'", (char *)buffer );
-              //buffer.consume( keepaliveResponse.size() );
-              if ( char *charPtr = (char *)memchr( (char *)buffer, '$', buffer.size() ) )
+              Debug( 4, "Got keepalive response '%.*s'", (int)keepaliveResponse.size(), head );
+              if ( char *charPtr = (char *)memchr( head, '$', buffer.size() ) )
               {
-                int discardBytes = charPtr-(char *)buffer;
-                buffer -= discardBytes;
+                buffer.consume( charPtr-head );
               }
               else
               {
@@ -708,17 +722,17 @@ Debug(5, "sendkeepalive %d, timeout %d, now: %d last: %d since: %d", sendKeepali
             }
             else
             {
-              if ( char *charPtr = (char *)memchr( (char *)buffer, '$', buffer.size() ) )
+              if ( char *charPtr = (char *)memchr( head, '$', buffer.size() ) )
               {
-                int discardBytes = charPtr-(char *)buffer;
+                int discardBytes = charPtr-head;
                 Warning( "Unexpected format RTSP interleaved data, resyncing by %d bytes", discardBytes );
-                Hexdump( -1, (char *)buffer, discardBytes );
-                buffer -= discardBytes;
+                Hexdump( -1, head, discardBytes );
+                buffer.consume( discardBytes );
               }
               else
               {
                 Warning( "Unexpected format RTSP interleaved data, dumping %d bytes", buffer.size() );
-                Hexdump( -1, (char *)buffer, 32 );
+                Hexdump( -1, head, 32 );
                 buffer.clear();
               }
             }
@@ -735,7 +749,6 @@ Debug(5, "sendkeepalive %d, timeout %d, now: %d last: %d since: %d", sendKeepali
             return( -1 );
           lastKeepalive = now;
         }
-        buffer.tidy( 1 );
       }
 #if 0
       message = "PAUSE "+mUrl+" RTSP/1.0\r\nSession: "+session+"\r\n";
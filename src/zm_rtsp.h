@@ -128,6 +128,16 @@ public:
       return( false );
     return( iter->second->getFrame( frame ) );
   }
+  // Stats of the source that frames are taken from, false if there isn't one yet
+  bool getSourceStats( uint32_t &framesDropped, uint32_t &recvCallsPer100Frames )
+  {
+    SourceMap::iterator iter = mSources.begin();
+    if ( iter == mSources.end() )
+      return( false );
+    framesDropped = iter->second->getFramesDropped();
+    recvCallsPer100Frames = iter->second->getRecvCallsPer100Frames();
+    return( true );
+  }
   int run();
   void stop()
   {
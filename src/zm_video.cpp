@@ -105,7 +105,7 @@ X264MP4Writer::X264MP4Writer(
   swscaleobj.SetDefaults(zm_pf, codec_pf, width, height);
 
   /* Calculate the image sizes. We will need this for parameter checking */
-  zm_imgsize = colours * width * height;
+  zm_imgsize = zm_image_size(width, height, colours, subpixelorder);
 #if LIBAVUTIL_VERSION_CHECK(54, 6, 0, 6, 0)
   codec_imgsize = av_image_get_buffer_size(codec_pf, width, height, 1);
 #else
@@ -108,12 +108,9 @@ void Zone::Setup(
     }
   }
 
-  // FIXME: Is this not a problem? If you had two zones for a monitor.. then these would conflict. You would only get 1 dump file
   if ( config.record_diag_images ) {
-    static char diag_path[PATH_MAX] = "";
-    if ( ! diag_path[0] ) {
-      snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-poly.jpg", monitor->getStorage()->Path(), id);
-    }
+    char diag_path[PATH_MAX];
+    snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-poly.jpg", monitor->getStorage()->Path(), id);
     pg_image->WriteJpeg( diag_path );
   }
 } // end Zone::Setup
@@ -126,7 +123,7 @@ Zone::~Zone() {
 }
 
 void Zone::RecordStats( const Event *event ) {
-  static char sql[ZM_SQL_MED_BUFSIZ];
+  char sql[ZM_SQL_MED_BUFSIZ];
 	snprintf( sql, sizeof(sql), "insert into Stats set MonitorId=%d, ZoneId=%d, EventId=%d, FrameId=%d, PixelDiff=%d, AlarmPixels=%d, FilterPixels=%d, BlobPixels=%d, Blobs=%d, MinBlobSize=%d, MaxBlobSize=%d, MinX=%d, MinY=%d, MaxX=%d, MaxY=%d, Score=%d", monitor->Id(), id, event->Id(), event->Frames()+1, pixel_diff, alarm_pixels, alarm_filter_pixels, alarm_blob_pixels, alarm_blobs, min_blob_size, max_blob_size, alarm_box.LoX(), alarm_box.LoY(), alarm_box.HiX(), alarm_box.HiY(), score );
   db_mutex.lock();
 	if ( mysql_query( &dbconn, sql ) ) {
@@ -231,10 +228,8 @@ bool Zone::CheckAlarms( const Image *delta_image ) {
   std_alarmedpixels(diff_image, pg_image, &alarm_pixels, &pixel_diff_count);
 
   if ( config.record_diag_images ) {
-    static char diag_path[PATH_MAX] = "";
-    if ( ! diag_path[0] ) {
-      snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 1 );
-    }
+    char diag_path[PATH_MAX];
+    snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 1 );
     diff_image->WriteJpeg( diag_path );
   }
 
@@ -314,10 +309,8 @@ bool Zone::CheckAlarms( const Image *delta_image ) {
     }
 
     if ( config.record_diag_images ) {
-      static char diag_path[PATH_MAX] = "";
-      if ( !diag_path[0] ) {
-        snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 2 );
-      }
+      char diag_path[PATH_MAX];
+      snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 2 );
       diff_image->WriteJpeg( diag_path );
     }
 
@@ -524,10 +517,8 @@ bool Zone::CheckAlarms( const Image *delta_image ) {
         }
       }
       if ( config.record_diag_images ) {
-        static char diag_path[PATH_MAX] = "";
-        if ( !diag_path[0] ) {
-          snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 3 );
-        }
+        char diag_path[PATH_MAX];
+        snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 3 );
         diff_image->WriteJpeg( diag_path );
       }
 
@@ -571,10 +562,8 @@ bool Zone::CheckAlarms( const Image *delta_image ) {
         }
       }
       if ( config.record_diag_images ) {
-        static char diag_path[PATH_MAX] = "";
-        if ( !diag_path[0] ) {
-          snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 4 );
-        }
+        char diag_path[PATH_MAX];
+        snprintf( diag_path, sizeof(diag_path), "%s/diag-%d-%d.jpg", monitor->getStorage()->Path(), id, 4 );
         diff_image->WriteJpeg( diag_path );
       }
       Debug( 5, "Got %d blob pixels, %d blobs, need %d -> %d, %d -> %d", alarm_blob_pixels, alarm_blobs, min_blob_pixels, max_blob_pixels, min_blobs, max_blobs );       
@@ -824,16 +813,11 @@ bool Zone::ParseZoneString( const char *zone_string, int &zone_id, int &colour,
 }
 
 int Zone::Load( Monitor *monitor, Zone **&zones ) {
-  static char sql[ZM_SQL_MED_BUFSIZ];
+  char sql[ZM_SQL_MED_BUFSIZ];
   snprintf( sql, sizeof(sql), "select Id,Name,Type+0,Units,Coords,AlarmRGB,CheckMethod+0,MinPixelThreshold,MaxPixelThreshold,MinAlarmPixels,MaxAlarmPixels,FilterX,FilterY,MinFilterPixels,MaxFilterPixels,MinBlobPixels,MaxBlobPixels,MinBlobs,MaxBlobs,OverloadFrames,ExtendAlarmFrames from Zones where MonitorId = %d order by Type, Id", monitor->Id() );
-  if ( mysql_query( &dbconn, sql ) ) {
-    Error( "Can't run query: %s", mysql_error( &dbconn ) );
-    exit( mysql_errno( &dbconn ) );
-  }
-
-  MYSQL_RES *result = mysql_store_result( &dbconn );
+  // Fetched under the db lock, as the capture daemon may be analysing in another thread
+  MYSQL_RES *result = zmDbFetch( sql );
   if ( !result ) {
-    Error( "Can't use query result: %s", mysql_error( &dbconn ) );
     exit( mysql_errno( &dbconn ) );
   }
   int n_zones = mysql_num_rows( result );
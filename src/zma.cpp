@@ -27,6 +27,9 @@ zma - The ZoneMinder Analysis daemon
 
  zma -m <monitor_id>
  zma --monitor <monitor_id>
+ zma -m <monitor_id>,<monitor_id>... [-t <threads>]
+ zma -a [-t <threads>]
+ zma --all [--threads <threads>]
  zma -h
  zma --help
  zma -v
@@ -39,9 +42,14 @@ for motion which might generate an alarm or event. It generally keeps up with
 the Capture daemon but if very busy may skip some frames to prevent it falling
 behind.
 
+Given more than one monitor, or all of them, it analyses them all from a pool
+of worker threads instead of needing a process for each.
+
 =head1 OPTIONS
 
- -m, --monitor_id         - ID of the monitor to analyse
+ -m, --monitor_id         - ID of the monitor to analyse, may be a comma separated list or given more than once
+ -a, --all                - Analyse all the monitors on this server doing motion detection
+ -t, --threads            - How many threads to analyse with, defaults to the number of cpus
  -h, --help             - Display usage information
  -v, --version          - Print the installed version of ZoneMinder
 
@@ -56,11 +64,16 @@ behind.
 #include "zm_db.h"
 #include "zm_signal.h"
 #include "zm_monitor.h"
+#include "zm_analysis_pool.h"
+
+#include <vector>
 
 void Usage() {
-  fprintf(stderr, "zma -m <monitor_id>\n");
+  fprintf(stderr, "zma -m <monitor_id> or -a\n");
   fprintf(stderr, "Options:\n");
-  fprintf(stderr, "  -m, --monitor <monitor_id>   : Specify which monitor to use\n");
+  fprintf(stderr, "  -m, --monitor <monitor_id>   : Specify which monitor to use, or a comma separated list of them\n");
+  fprintf(stderr, "  -a, --all            : Analyse all monitors on this server doing motion detection\n");
+  fprintf(stderr, "  -t, --threads <threads>  : Number of threads to analyse several monitors with\n");
   fprintf(stderr, "  -h, --help           : This screen\n");
   fprintf(stderr, "  -v, --version        : Report the installed version of ZoneMinder\n");
   exit(0);
@@ -72,9 +85,14 @@ int main( int argc, char *argv[] ) {
   srand(getpid() * time(0));
 
   int id = -1;
+  std::vector<unsigned int> ids;
+  bool all = false;
+  int n_threads = 0;
 
   static struct option long_options[] = {
     {"monitor", 1, 0, 'm'},
+    {"all", 0, 0, 'a'},
+    {"threads", 1, 0, 't'},
     {"help", 0, 0, 'h'},
     {"version", 0, 0, 'v'},
     {0, 0, 0, 0}
@@ -83,14 +101,24 @@ int main( int argc, char *argv[] ) {
   while (1) {
     int option_index = 0;
 
-    int c = getopt_long (argc, argv, "m:h:v", long_options, &option_index);
+    int c = getopt_long (argc, argv, "m:at:h:v", long_options, &option_index);
     if ( c == -1 ) {
       break;
     }
 
     switch (c) {
       case 'm':
-        id = atoi(optarg);
+        for ( char *id_str = strtok(optarg, ","); id_str; id_str = strtok(NULL, ",") ) {
+          id = atoi(id_str);
+          if ( id > 0 )
+            ids.push_back(id);
+        }
+        break;
+      case 'a':
+        all = true;
+        break;
+      case 't':
+        n_threads = atoi(optarg);
         break;
       case 'h':
       case '?':
@@ -113,14 +141,18 @@ int main( int argc, char *argv[] ) {
     Usage();
   }
 
-  if ( id < 0 ) {
+  if ( !all && ids.empty() ) {
     fprintf(stderr, "Bogus monitor %d\n", id);
     Usage();
     exit(0);
   }
 
   char log_id_string[16];
-  snprintf(log_id_string, sizeof(log_id_string), "zma_m%d", id);
+  if ( all ) {
+    snprintf(log_id_string, sizeof(log_id_string), "zma_all");
+  } else {
+    snprintf(log_id_string, sizeof(log_id_string), "zma_m%d", ids[0]);
+  }
 
   zmLoadConfig();
 
@@ -128,6 +160,51 @@ int main( int argc, char *argv[] ) {
 
   hwcaps_detect();
 
+  if ( all || ids.size() > 1 || n_threads ) {
+    if ( all ) {
+      std::string sql = "SELECT Id FROM Monitors WHERE Function != 'None' AND Function != 'Monitor' AND Type != 'WebSite'";
+      if ( staticConfig.SERVER_ID )
+        sql += stringtf(" AND ServerId=%d", staticConfig.SERVER_ID);
+      MYSQL_RES *result = zmDbFetch(sql.c_str());
+      if ( !result )
+        exit(mysql_errno(&dbconn));
+      while ( MYSQL_ROW dbrow = mysql_fetch_row(result) )
+        ids.push_back(atoi(dbrow[0]));
+      mysql_free_result(result);
+    }
+    if ( ids.empty() ) {
+      Error("No monitors to analyse");
+      exit(-1);
+    }
+    if ( n_threads <= 0 )
+      n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    Info("Analysing %d monitors with up to %d threads", (int)ids.size(), n_threads);
+    zmSetDefaultHupHandler();
+    zmSetDefaultTermHandler();
+    zmSetDefaultDieHandler();
+
+    AnalysisPool *pool = new AnalysisPool(&ids[0], ids.size(), n_threads);
+    pool->start();
+    while ( !zm_terminate ) {
+      // The workers do everything, we just pass on signals
+      sleep(1);
+      if ( zm_reload ) {
+        pool->reload();
+        logTerm();
+        logInit(log_id_string);
+        zm_reload = false;
+      }
+    }
+    delete pool;
+
+    Image::Deinitialise();
+    logTerm();
+    zmDbClose();
+    return( 0 );
+  }
+  id = ids[0];
+
   Monitor *monitor = Monitor::Load(id, true, Monitor::ANALYSIS);
 
   if ( monitor ) {
@@ -160,8 +237,14 @@ int main( int argc, char *argv[] ) {
         }
       }
 
+      // Taken before looking for an image so that one captured meanwhile still wakes us
+      uint32_t capture_seq = monitor->CaptureSeq();
       if ( !monitor->Analyse() ) {
-        usleep(monitor->Active()?ZM_SAMPLE_RATE:ZM_SUSPENDED_RATE);
+        if ( monitor->Active() ) {
+          monitor->WaitForCapture(capture_seq, ZM_SUSPENDED_RATE);
+        } else {
+          usleep(ZM_SUSPENDED_RATE);
+        }
       } else if ( analysis_rate ) {
         usleep(analysis_rate);
       }
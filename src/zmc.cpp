@@ -29,8 +29,8 @@ zmc - The ZoneMinder Capture daemon
  zmc --device <device_path>
  zmc -f <file_path>
  zmc --file <file_path>
- zmc -m <monitor_id>
- zmc --monitor <monitor_id>
+ zmc -m <monitor_id>[,<monitor_id>...]
+ zmc --monitor <monitor_id>[,<monitor_id>...]
  zmc -h
  zmc --help
  zmc -v
@@ -41,11 +41,19 @@ zmc - The ZoneMinder Capture daemon
 This binary's job is to sit on a video device and suck frames off it as fast as
 possible, this should run at more or less constant speed.
 
+If ZM_OPT_ANALYSIS_IN_CAPTURE is set it also analyses its monitors from a
+separate thread, doing the work that would otherwise be done by zma.
+
+Several monitors can be given to -m as a comma separated list, so that one
+process captures them all. This suits cURL monitors, whose transfers all run
+from one engine thread however many there are. The monitors are captured in
+turn, so each runs no faster than the slowest of them.
+
 =head1 OPTIONS
 
  -d, --device <device_path>         - For local cameras, device to access. e.g /dev/video0 etc
  -f, --file <file_path>           - For local images, jpg file to access.
- -m, --monitor_id             - ID of the monitor to analyse
+ -m, --monitor_id             - ID of the monitor to capture, or a comma separated list of them
  -h, --help                 - Display usage information
  -v, --version              - Print the installed version of ZoneMinder
 
@@ -55,6 +63,7 @@ possible, this should run at more or less constant speed.
 
 #include <getopt.h>
 #include <signal.h>
+#include <vector>
 #if defined(__FreeBSD__)
 #include <limits.h>
 #else
@@ -70,6 +79,7 @@ possible, this should run at more or less constant speed.
 #include "zm_time.h"
 #include "zm_signal.h"
 #include "zm_monitor.h"
+#include "zm_analysis_pool.h"
 
 void Usage() {
   fprintf(stderr, "zmc -d <device_path> or -r <proto> -H <host> -P <port> -p <path> or -f <file_path> or -m <monitor_id>\n");
@@ -81,7 +91,7 @@ void Usage() {
   fprintf(stderr, "  -d, --device <device_path>         : For local cameras, device to access. E.g /dev/video0 etc\n");
 #endif
   fprintf(stderr, "  -f, --file <file_path>           : For local images, jpg file to access.\n");
-  fprintf(stderr, "  -m, --monitor <monitor_id>         : For sources associated with a single monitor\n");
+  fprintf(stderr, "  -m, --monitor <monitor_id>         : For sources associated with a single monitor, or a comma separated list of them\n");
   fprintf(stderr, "  -h, --help                 : This screen\n");
   fprintf(stderr, "  -v, --version              : Report the installed version of ZoneMinder\n");
   exit(0);
@@ -99,6 +109,7 @@ int main(int argc, char *argv[]) {
   const char *path = "";
   const char *file = "";
   int monitor_id = -1;
+  std::vector<unsigned int> monitor_ids;
 
   static struct option long_options[] = {
     {"device", 1, 0, 'd'},
@@ -138,7 +149,11 @@ int main(int argc, char *argv[]) {
         file = optarg;
         break;
       case 'm':
-        monitor_id = atoi(optarg);
+        for ( char *id_str = strtok(optarg, ","); id_str; id_str = strtok(NULL, ",") ) {
+          monitor_id = atoi(id_str);
+          if ( monitor_id > 0 )
+            monitor_ids.push_back(monitor_id);
+        }
         break;
       case 'h':
       case '?':
@@ -161,7 +176,7 @@ int main(int argc, char *argv[]) {
     Usage();
   }
 
-  int modes = ( (device[0]?1:0) + (host[0]?1:0) + (file[0]?1:0) + (monitor_id > 0 ? 1 : 0) );
+  int modes = ( (device[0]?1:0) + (host[0]?1:0) + (file[0]?1:0) + (monitor_ids.empty() ? 0 : 1) );
   if ( modes > 1 ) {
     fprintf(stderr, "Only one of device, host/port/path, file or monitor id allowed\n");
     Usage();
@@ -184,7 +199,7 @@ int main(int argc, char *argv[]) {
     const char *slash_ptr = strrchr(file, '/');
     snprintf(log_id_string, sizeof(log_id_string), "zmc_f%s", slash_ptr?slash_ptr+1:file);
   } else {
-    snprintf(log_id_string, sizeof(log_id_string), "zmc_m%d", monitor_id);
+    snprintf(log_id_string, sizeof(log_id_string), "zmc_m%d", monitor_ids[0]);
   }
 
   zmLoadConfig();
@@ -207,11 +222,13 @@ int main(int argc, char *argv[]) {
   } else if ( file[0] ) {
     n_monitors = Monitor::LoadFileMonitors(file, monitors, Monitor::CAPTURE);
   } else {
-    Monitor *monitor = Monitor::Load(monitor_id, true, Monitor::CAPTURE);
-    if ( monitor ) {
-      monitors = new Monitor *[1];
-      monitors[0] = monitor;
-      n_monitors = 1;
+    monitors = new Monitor *[monitor_ids.size()];
+    for ( unsigned int i = 0; i < monitor_ids.size(); i++ ) {
+      Monitor *monitor = Monitor::Load(monitor_ids[i], true, Monitor::CAPTURE);
+      if ( monitor )
+        monitors[n_monitors++] = monitor;
+      else
+        Error("Can't find monitor with id of %d", monitor_ids[i]);
     }
   }
 
@@ -231,7 +248,23 @@ int main(int argc, char *argv[]) {
   sigaddset(&block_set, SIGUSR1);
   sigaddset(&block_set, SIGUSR2);
 
+  AnalysisPool *analysis_pool = NULL;
+  if ( config.opt_analysis_in_capture ) {
+    // Started once the shared memory is set up, as the analysis side attaches to it.
+    // A single worker, in place of the one zma per monitor it replaces.
+    unsigned int *pool_monitor_ids = new unsigned int[n_monitors];
+    for ( int i = 0; i < n_monitors; i++ )
+      pool_monitor_ids[i] = monitors[i]->Id();
+    analysis_pool = new AnalysisPool(pool_monitor_ids, n_monitors, 1);
+    delete[] pool_monitor_ids;
+    analysis_pool->start();
+  }
+
   int result = 0;
+  // Monitors sharing a device only need it priming once, separately listed
+  // ones each need it, and again only once they have been closed.
+  int n_primed = monitor_ids.empty() ? 1 : n_monitors;
+  std::vector<bool> primed(n_primed, false);
 
   while ( !zm_terminate ) {
     result = 0;
@@ -243,13 +276,25 @@ int main(int argc, char *argv[]) {
       snprintf(sql, sizeof(sql),
           "REPLACE INTO Monitor_Status (MonitorId, Status) VALUES ('%d','Running')",
           monitors[i]->Id());
+      db_mutex.lock();
       if ( mysql_query(&dbconn, sql) ) {
         Error("Can't run query: %s", mysql_error(&dbconn));
       }
+      db_mutex.unlock();
     }
     // Outer primary loop, handles connection to camera
-    if ( monitors[0]->PrimeCapture() < 0 ) {
-      Error("Failed to prime capture of initial monitor");
+    int prime_result = 0;
+    for ( int i = 0; i < n_primed && prime_result >= 0; i++ ) {
+      if ( primed[i] )
+        continue;
+      prime_result = monitors[i]->PrimeCapture();
+      if ( prime_result < 0 ) {
+        Error("Failed to prime capture of monitor %d %s", monitors[i]->Id(), monitors[i]->Name());
+      } else {
+        primed[i] = true;
+      }
+    }
+    if ( prime_result < 0 ) {
       sleep(10);
       continue;
     }
@@ -257,9 +302,11 @@ int main(int argc, char *argv[]) {
       snprintf(sql, sizeof(sql),
           "REPLACE INTO Monitor_Status (MonitorId, Status) VALUES ('%d','Connected')",
           monitors[i]->Id());
+      db_mutex.lock();
       if ( mysql_query(&dbconn, sql) ) {
         Error("Can't run query: %s", mysql_error(&dbconn));
       }
+      db_mutex.unlock();
     }
 
     int *capture_delays = new int[n_monitors];
@@ -301,18 +348,21 @@ int main(int argc, char *argv[]) {
           if ( monitors[i]->PreCapture() < 0 ) {
             Error("Failed to pre-capture monitor %d %d (%d/%d)", monitors[i]->Id(), monitors[i]->Name(), i+1, n_monitors);
             monitors[i]->Close();
+            primed[i < n_primed ? i : 0] = false;
             result = -1;
             break;
           }
           if ( monitors[i]->Capture() < 0 ) {
             Error("Failed to capture image from monitor %d %s (%d/%d)", monitors[i]->Id(), monitors[i]->Name(), i+1, n_monitors);
             monitors[i]->Close();
+            primed[i < n_primed ? i : 0] = false;
             result = -1;
             break;
           }
           if ( monitors[i]->PostCapture() < 0 ) {
             Error("Failed to post-capture monitor %d %s (%d/%d)", monitors[i]->Id(), monitors[i]->Name(), i+1, n_monitors);
             monitors[i]->Close();
+            primed[i < n_primed ? i : 0] = false;
             result = -1;
             break;
           }
@@ -334,6 +384,8 @@ int main(int argc, char *argv[]) {
         for ( int i = 0; i < n_monitors; i++ ) {
           monitors[i]->Reload();
         }
+        if ( analysis_pool )
+          analysis_pool->reload();
         logTerm();
         logInit(log_id_string);
         zm_reload = false;
@@ -349,14 +401,21 @@ int main(int argc, char *argv[]) {
     delete [] last_capture_times;
   } // end while ! zm_terminate outer connection loop
 
+  if ( analysis_pool ) {
+    analysis_pool->stop();
+    delete analysis_pool;
+  }
+
   for ( int i = 0; i < n_monitors; i++ ) {
     static char sql[ZM_SQL_SML_BUFSIZ];
     snprintf(sql, sizeof(sql),
         "REPLACE INTO Monitor_Status (MonitorId, Status) VALUES ('%d','NotRunning')",
         monitors[i]->Id());
+    db_mutex.lock();
     if ( mysql_query(&dbconn, sql) ) {
       Error("Can't run query: %s", mysql_error(&dbconn));
     }
+    db_mutex.unlock();
     delete monitors[i];
   }
   delete [] monitors;
@@ -69,6 +69,9 @@ Options for use with monitors:
   -W, --write_index                       - Output ring buffer write index
   -e, --event                             - Output last event index
   -f, --fps                               - Output last Frames Per Second captured reading
+  -b, --benchmark [passes]                - Output the rate, in MB/s, at which image deltas are computed over the ring buffer
+  -x, --http_benchmark <capture_file>     - Output the rates, in MB/s, at which the simple and regexp http methods parse
+                                            a recorded camera response, headers included, with -b setting the passes
   -z, --zones                             - Write last captured image overlaid with zones to <monitor_name>-Zones.jpg
   -a, --alarm                             - Force alarm in monitor, this will trigger recording until cancelled with -c
   -n, --noalarm                           - Force no alarms in monitor, this will prevent alarms until cancelled with -c
@@ -95,6 +98,7 @@ Options for use with monitors:
 #include "zm_signal.h"
 #include "zm_monitor.h"
 #include "zm_local_camera.h"
+#include "zm_remote_camera_http.h"
 
 void Usage( int status=-1 ) {
   fprintf( stderr, "zmu <-d device_path> [-v] [function] [-U<username> -P<password>]\n" );
@@ -125,6 +129,9 @@ void Usage( int status=-1 ) {
   fprintf( stderr, "  -W, --write_index        : Output ring buffer write index\n" );
   fprintf( stderr, "  -e, --event          : Output last event index\n" );
   fprintf( stderr, "  -f, --fps            : Output last Frames Per Second captured reading\n" );
+  fprintf( stderr, "  -b, --benchmark [passes]     : Output the rate, in MB/s, at which image deltas are computed over the ring buffer\n" );
+  fprintf( stderr, "  -x, --http_benchmark <capture_file> : Output the rates, in MB/s, at which the simple and regexp http methods parse\n" );
+  fprintf( stderr, "                   a recorded camera response, headers included, with -b setting the passes\n" );
   fprintf( stderr, "  -z, --zones          : Write last captured image overlaid with zones to <monitor_name>-Zones.jpg\n" );
   fprintf( stderr, "  -a, --alarm          : Force alarm in monitor, this will trigger recording until cancelled with -c\n" );
   fprintf( stderr, "  -n, --noalarm          : Force no alarms in monitor, this will prevent alarms until cancelled with -c\n" );
@@ -160,6 +167,8 @@ typedef enum {
 	ZMU_HUE        = 0x00004000,
 	ZMU_COLOUR     = 0x00008000,
 	ZMU_RELOAD     = 0x00010000,
+	ZMU_BENCHMARK  = 0x00020000,
+	ZMU_HTTP_BENCHMARK = 0x00040000,
 	ZMU_ENABLE     = 0x00100000,
 	ZMU_DISABLE    = 0x00200000,
 	ZMU_SUSPEND    = 0x00400000,
@@ -169,7 +178,7 @@ typedef enum {
 
 bool ValidateAccess( User *user, int mon_id, int function ) {
   bool allowed = true;
-  if ( function & (ZMU_STATE|ZMU_IMAGE|ZMU_TIME|ZMU_READ_IDX|ZMU_WRITE_IDX|ZMU_FPS) ) {
+  if ( function & (ZMU_STATE|ZMU_IMAGE|ZMU_TIME|ZMU_READ_IDX|ZMU_WRITE_IDX|ZMU_FPS|ZMU_BENCHMARK) ) {
     if ( user->getStream() < User::PERM_VIEW )
       allowed = false;
   }
@@ -231,6 +240,8 @@ int main( int argc, char *argv[] ) {
     {"write_index", 0, 0, 'W'},
     {"event", 0, 0, 'e'},
     {"fps", 0, 0, 'f'},
+    {"benchmark", 2, 0, 'b'},
+    {"http_benchmark", 1, 0, 'x'},
     {"zones", 2, 0, 'z'},
     {"alarm", 0, 0, 'a'},
     {"noalarm", 0, 0, 'n'},
@@ -257,6 +268,8 @@ int main( int argc, char *argv[] ) {
 
   int image_idx = -1;
   int scale = -1;
+  int benchmark_passes = 10;
+  const char *capture_file = 0;
   int brightness = -1;
   int contrast = -1;
   int hue = -1;
@@ -275,7 +288,7 @@ int main( int argc, char *argv[] ) {
   while (1) {
     int option_index = 0;
 
-    int c = getopt_long (argc, argv, "d:m:vsEDLurwei::S:t::fz::ancqhlB::C::H::O::U:P:A:V:", long_options, &option_index);
+    int c = getopt_long (argc, argv, "d:m:vsEDLurwei::S:t::fb::x:z::ancqhlB::C::H::O::U:P:A:V:", long_options, &option_index);
     if (c == -1) {
       break;
     }
@@ -319,6 +332,15 @@ int main( int argc, char *argv[] ) {
       case 'f':
         function |= ZMU_FPS;
         break;
+      case 'b':
+        function |= ZMU_BENCHMARK;
+        if ( optarg )
+          benchmark_passes = atoi( optarg );
+        break;
+      case 'x':
+        function |= ZMU_HTTP_BENCHMARK;
+        capture_file = optarg;
+        break;
       case 'z':
         function |= ZMU_ZONES;
         if ( optarg )
@@ -539,6 +561,19 @@ int main( int argc, char *argv[] ) {
           have_output = true;
         }
       }
+      if ( function & ZMU_BENCHMARK ) {
+        if ( benchmark_passes < 1 )
+          benchmark_passes = 1;
+        double rate = monitor->BenchmarkDelta( benchmark_passes );
+        if ( verbose )
+          printf( "Image deltas over the ring buffer at %.1f MB/s, %" PRIu64 " of %" PRIu64 " kB in huge pages\n",
+              rate, monitor->HugePageBytes()/1024, (uint64_t)monitor->MemSize()/1024 );
+        else {
+          if ( have_output ) printf( "%c", separator );
+          printf( "%.1f", rate );
+          have_output = true;
+        }
+      }
       if ( function & ZMU_IMAGE ) {
         if ( verbose ) {
           if ( image_idx == -1 )
@@ -673,6 +708,39 @@ int main( int argc, char *argv[] ) {
       exit_zmu( -1 );
     }
   } else {
+    if ( function & ZMU_HTTP_BENCHMARK ) {
+      std::string response;
+      FILE *fp = fopen( capture_file, "rb" );
+      if ( !fp ) {
+        fprintf( stderr, "Error, can't open %s: %s\n", capture_file, strerror(errno) );
+        exit_zmu( -1 );
+      }
+      char chunk[65536];
+      size_t n;
+      while ( (n = fread( chunk, 1, sizeof(chunk), fp )) > 0 )
+        response.append( chunk, n );
+      fclose( fp );
+      if ( benchmark_passes < 1 )
+        benchmark_passes = 1;
+
+      // The cameras are never connected, so only need a size Camera accepts
+      RemoteCameraHttp simple( 0, "simple", "localhost", "80", "/", 640, 480, ZM_COLOUR_RGB24, -1, -1, -1, -1, false, false );
+      double simple_rate = simple.BenchmarkResponse( response, benchmark_passes );
+#if HAVE_LIBPCRE
+      RemoteCameraHttp regexp( 0, "regexp", "localhost", "80", "/", 640, 480, ZM_COLOUR_RGB24, -1, -1, -1, -1, false, false );
+      double regexp_rate = regexp.BenchmarkResponse( response, benchmark_passes );
+#else // HAVE_LIBPCRE
+      double regexp_rate = -1.0;
+#endif // HAVE_LIBPCRE
+      if ( verbose ) {
+        printf( "Simple http method parses %s at %.1f MB/s\n", capture_file, simple_rate );
+        printf( "Regexp http method parses %s at %.1f MB/s\n", capture_file, regexp_rate );
+      } else {
+        printf( "%.1f %.1f\n", simple_rate, regexp_rate );
+      }
+      exit_zmu( simple_rate < 0.0 ? -1 : 0 );
+    }
+
     if ( function & ZMU_QUERY ) {
 #if ZM_HAS_V4L
 			char vidString[0x10000] = "";
@@ -377,6 +377,24 @@ private $control_fields = array(
 
   function zmaControl( $mode=false ) {
     if ( (!defined('ZM_SERVER_ID')) or ( array_key_exists('ServerId', $this) and (ZM_SERVER_ID==$this->{'ServerId'}) ) ) {
+      if ( ZM_OPT_ANALYSIS_IN_CAPTURE ) {
+        // zmc analyses in a thread of its own, so just have it pick up any change of function
+        if ( ZM_OPT_CONTROL ) {
+          daemonControl( 'stop', 'zmtrack.pl', '-m '.$this->{'Id'} );
+        }
+        if ( $mode != 'stop' && $this->{'Function'} != 'None' ) {
+          if ( $this->{'Type'} == 'Local' ) {
+            $zmcArgs = '-d '.$this->{'Device'};
+          } else {
+            $zmcArgs = '-m '.$this->{'Id'};
+          }
+          daemonControl( 'reload', 'zmc', $zmcArgs );
+          if ( ZM_OPT_CONTROL && $this->{'Controllable'} && $this->{'TrackMotion'} && ( $this->{'Function'} == 'Modect' || $this->{'Function'} == 'Mocord' ) ) {
+            daemonControl( 'start', 'zmtrack.pl', '-m '.$this->{'Id'} );
+          }
+        }
+        return;
+      }
       if ( $this->{'Function'} == 'None' || $this->{'Function'} == 'Monitor' || $mode == 'stop' ) {
         if ( ZM_OPT_CONTROL ) {
           daemonControl( 'stop', 'zmtrack.pl', '-m '.$this->{'Id'} );
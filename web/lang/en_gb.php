@@ -931,6 +931,7 @@ $OLANG = array(
 		          "Examples (do not enter quotes)~~~~".
 		          "\"allowed_media_types=video\" Set datatype to request fromcam (audio, video, data)~~~~".
 		          "\"reorder_queue_size=nnn\" Set number of packets to buffer for handling of reordered packets~~~~".
+		          "\"low_latency=1\" Use settings which reduce the delay before images are available, at the cost of tolerating less network jitter~~~~".
 		          "\"loglevel=debug\" Set verbosity of FFmpeg (quiet, panic, fatal, error, warning, info, verbose, debug)"
 	),
         'OPTIONS_RTSPTrans' => array(
@@ -18,6 +18,9 @@
 #cmakedefine HAVE_DECL_BACKTRACE 1
 #cmakedefine HAVE_DECL_BACKTRACE_SYMBOLS 1
 #cmakedefine HAVE_POSIX_MEMALIGN 1
+#cmakedefine HAVE_RECVMMSG 1
+#cmakedefine HAVE_LINUX_FUTEX_H 1
+#cmakedefine HAVE_SYS_VFS_H 1
 #cmakedefine HAVE_SIGINFO_T 1
 #cmakedefine HAVE_UCONTEXT_T 1
 